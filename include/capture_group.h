@@ -0,0 +1,115 @@
+#ifndef __CAPTURE_GROUP_H_
+#define __CAPTURE_GROUP_H_
+
+#include "webcam_v4l2.h"
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace noevil {
+namespace webcam {
+
+struct CaptureGroupOptions {
+    // widest timestamp spread allowed within one frame set
+    uint64_t tolerance_us = 5000;
+    // frames held per camera while waiting for the others, at least 1 and
+    // at most the buffer count - 2 of the camera, checked on Start
+    uint32_t max_pending = 2;
+};
+
+// timestamp skew of one camera against the first camera of the group
+struct CameraSkewStats {
+    uint64_t frames = 0;  // frames retrieved
+    uint64_t matched = 0; // frames delivered in a set
+    uint64_t dropped = 0; // too old to match or held too long
+    int64_t last_skew_us = 0;
+    int64_t min_skew_us = 0;
+    int64_t max_skew_us = 0;
+    int64_t total_skew_us = 0;
+
+    int64_t mean_skew_us() const {
+        return matched ? total_skew_us / (int64_t)matched : 0;
+    }
+};
+
+struct CaptureGroupStats {
+    uint64_t sets = 0;
+    // widest spread of a delivered set
+    uint64_t max_spread_us = 0;
+    std::vector<CameraSkewStats> cameras;
+};
+
+// Streams several cameras at once and delivers frame sets, one frame per
+// camera in the order they were added, whose V4L2 timestamps lie within the
+// tolerance. Frames of a leading camera are held until the others catch up,
+// frames that are too old to be matched any more are dropped.
+//
+// The cameras are driven from one epoll set like CaptureReactor. The leases
+// of a set are released when the handler returns unless it moves them away.
+// All calls are expected from one thread.
+class CaptureGroup final {
+public:
+    using FrameSetHandler = std::function<void(std::vector<FrameLease> &)>;
+
+    // throws std::invalid_argument if max_pending is 0
+    explicit CaptureGroup(
+        const CaptureGroupOptions &options = CaptureGroupOptions());
+    ~CaptureGroup();
+
+    CaptureGroup(const CaptureGroup &) = delete;
+    CaptureGroup &operator=(const CaptureGroup &) = delete;
+
+    std::string GetError() const { return error_; }
+
+    // open and configured cameras, only while stopped
+    bool Add(WebcamV4l2 *cam);
+    size_t size() const { return members_.size(); }
+
+    void SetHandler(const FrameSetHandler &handler) { handler_ = handler; }
+
+    // start or stop streaming on all cameras
+    bool Start();
+    bool Stop();
+
+    // wait up to timeout milliseconds, -1 for ever, retrieve the ready
+    // frames and deliver every complete set
+    // @return sets delivered, -1 on failure
+    int Poll(int timeout);
+
+    CaptureGroupStats GetStats() const;
+
+private:
+    struct Member {
+        WebcamV4l2 *cam;
+        std::deque<FrameLease> pending;
+        CameraSkewStats stats;
+    };
+
+    static constexpr int kMaxEvents = 64;
+
+    int Match();
+    void Deliver();
+
+    int epoll_fd_;
+    bool running_;
+    CaptureGroupOptions options_;
+    std::string error_;
+
+    std::vector<std::unique_ptr<Member>> members_;
+    // camera fd to member index
+    std::unordered_map<int, size_t> index_;
+    FrameSetHandler handler_;
+    std::vector<FrameLease> set_;
+
+    uint64_t sets_;
+    uint64_t max_spread_us_;
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __CAPTURE_GROUP_H_ */
@@ -0,0 +1,72 @@
+#ifndef __CAPTURE_REACTOR_H_
+#define __CAPTURE_REACTOR_H_
+
+#include "webcam_v4l2.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace noevil {
+namespace webcam {
+
+// Drives many started cameras from one epoll set on one thread. Whenever a
+// camera fd is readable one frame is leased with Retrieve and handed to the
+// camera's handler. The lease is released when the handler returns unless
+// the handler moves it away. A camera whose fd reports EPOLLERR or EPOLLHUP,
+// e.g. unplugged or streaming off, is removed and its drop handler called.
+//
+// All calls are expected from the reactor thread, except Stop.
+class CaptureReactor final {
+public:
+    using FrameHandler = std::function<void(WebcamV4l2 &, FrameLease &)>;
+    // called once the camera is removed, e.g. to reconnect and add it again
+    using DropHandler = std::function<void(WebcamV4l2 &)>;
+
+    CaptureReactor();
+    ~CaptureReactor();
+
+    CaptureReactor(const CaptureReactor &) = delete;
+    CaptureReactor &operator=(const CaptureReactor &) = delete;
+
+    std::string GetError() const { return error_; }
+
+    bool Add(WebcamV4l2 *cam, const FrameHandler &handler,
+             const DropHandler &on_drop = DropHandler());
+    bool Remove(WebcamV4l2 *cam);
+    size_t size() const { return entries_.size(); }
+
+    // wait up to timeout milliseconds, -1 for ever, and dispatch the ready
+    // cameras
+    // @return frames dispatched, -1 on failure
+    int Poll(int timeout);
+
+    // Poll until Stop, also a Stop issued before Run started
+    void Run(int timeout = 100);
+    void Stop();
+
+private:
+    struct Entry {
+        WebcamV4l2 *cam;
+        FrameHandler handler;
+        DropHandler on_drop;
+    };
+
+    static constexpr int kMaxEvents = 64;
+
+    int epoll_fd_;
+    int wakeup_fd_;
+    // set by Stop only, cleared when Run returns
+    std::atomic<bool> stop_;
+    std::string error_;
+
+    // by camera fd
+    std::unordered_map<int, std::shared_ptr<Entry>> entries_;
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __CAPTURE_REACTOR_H_ */
@@ -0,0 +1,104 @@
+#ifndef __DEVICE_MONITOR_H_
+#define __DEVICE_MONITOR_H_
+
+#include "webcam_v4l2.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace noevil {
+namespace webcam {
+
+struct ReconnectStats {
+    uint32_t removals = 0;
+    uint32_t reconnects = 0;
+    // reconnect attempts on a node of the camera's bus that failed
+    uint32_t failures = 0;
+    // removal seen to restored, and streaming again if it streamed before
+    uint64_t last_recovery_us = 0;
+    uint64_t max_recovery_us = 0;
+    uint64_t total_recovery_us = 0;
+
+    uint64_t mean_recovery_us() const {
+        return reconnects ? total_recovery_us / reconnects : 0;
+    }
+};
+
+// Watches the device directory with inotify and brings cameras back after a
+// USB reset or a replug. When the node of a camera is removed the camera is
+// stopped and closed. Every video node created afterwards is probed with
+// VIDIOC_QUERYCAP for the lost cameras: the one whose bus_info matches the
+// snapshot taken at Add reconnects, with format, fps, input, buffer count and
+// controls restored, and streams again if it did before.
+//
+// The fd of a camera changes on reconnect, so cameras driven by a
+// CaptureReactor or CaptureGroup have to be removed and added again from
+// the handler. Control values changed after Add are restored if control
+// events kept them current in the camera's cache until the removal, others
+// only if Update took a new snapshot. All calls are expected from one
+// thread.
+class DeviceMonitor final {
+public:
+    // connected is false on removal, true once the camera is back
+    using Handler = std::function<void(WebcamV4l2 &, bool connected)>;
+
+    explicit DeviceMonitor(const std::string &dir = "/dev");
+    ~DeviceMonitor();
+
+    DeviceMonitor(const DeviceMonitor &) = delete;
+    DeviceMonitor &operator=(const DeviceMonitor &) = delete;
+
+    std::string GetError() const { return error_; }
+
+    // open camera with a negotiated format and a node in the directory,
+    // best after Start
+    bool Add(WebcamV4l2 *cam);
+    // take the snapshot again after reconfiguration, only while connected
+    bool Update(WebcamV4l2 *cam);
+    bool Remove(WebcamV4l2 *cam);
+    size_t size() const { return entries_.size(); }
+
+    void SetHandler(const Handler &handler) { handler_ = handler; }
+
+    // readable when node events are pending, for own event loops
+    int fd() const { return inotify_fd_; }
+
+    // wait up to timeout milliseconds, -1 for ever, for node events and
+    // handle them
+    // @return cameras reconnected, -1 on failure
+    int Poll(int timeout);
+
+    bool IsConnected(const WebcamV4l2 *cam) const;
+    ReconnectStats GetStats(const WebcamV4l2 *cam) const;
+
+private:
+    struct Entry {
+        WebcamV4l2 *cam;
+        WebcamSnapshot snapshot;
+        // node name within the directory
+        std::string node;
+        bool connected;
+        bool streaming;
+        uint64_t lost_us;
+        ReconnectStats stats;
+    };
+
+    Entry *Find(const WebcamV4l2 *cam) const;
+    void Lost(Entry &entry);
+    bool TryReconnect(Entry &entry, const std::string &node);
+
+    int inotify_fd_;
+    int watch_;
+    std::string dir_;
+    std::string error_;
+
+    std::vector<std::unique_ptr<Entry>> entries_;
+    Handler handler_;
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __DEVICE_MONITOR_H_ */
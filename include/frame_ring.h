@@ -0,0 +1,119 @@
+#ifndef __FRAME_RING_H_
+#define __FRAME_RING_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace noevil {
+namespace webcam {
+
+// Bounded lock-free ring of trivially copyable frame descriptors.
+//
+// Meant for one producer and one consumer, but a slot is claimed with a CAS
+// before it is read, so the producer may pop too, e.g. to drop the oldest
+// entry when the ring is full. Every slot carries a sequence number telling
+// whether it is free for the next push or holds data for the next pop
+// (D. Vyukov's bounded queue).
+template <typename T>
+class FrameRing final {
+public:
+    // capacity is rounded up to a power of two
+    explicit FrameRing(size_t capacity)
+        : mask_(RoundUp(capacity) - 1),
+          cells_(new Cell[mask_ + 1]),
+          push_pos_(0),
+          pop_pos_(0) {
+        for (size_t i = 0; i <= mask_; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    FrameRing(const FrameRing &) = delete;
+    FrameRing &operator=(const FrameRing &) = delete;
+
+    size_t capacity() const { return mask_ + 1; }
+
+    // approximate while the other side is running
+    size_t size() const {
+        size_t push = push_pos_.load(std::memory_order_acquire);
+        size_t pop = pop_pos_.load(std::memory_order_acquire);
+        return push >= pop ? push - pop : 0;
+    }
+
+    // @return false if full
+    bool Push(const T &value) {
+        size_t pos = push_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (push_pos_.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = push_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // @return false if empty
+    bool Pop(T &value) {
+        size_t pos = pop_pos_.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (pop_pos_.compare_exchange_weak(
+                        pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(pos + mask_ + 1,
+                                        std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = pop_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    static size_t RoundUp(size_t n) {
+        size_t size = 1;
+        while (size < n) {
+            size <<= 1;
+        }
+        return size;
+    }
+
+    const size_t mask_;
+    std::unique_ptr<Cell[]> cells_;
+
+    // a cache line apart to avoid false sharing between producer and
+    // consumer, by padding, alignas(64) is not honoured by new before C++17
+    char pad0_[64];
+    std::atomic<size_t> push_pos_;
+    char pad1_[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> pop_pos_;
+    char pad2_[64 - sizeof(std::atomic<size_t>)];
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __FRAME_RING_H_ */
@@ -41,15 +41,34 @@ namespace util {
 
 using Logger = std::shared_ptr<spdlog::logger>;
 
-// create logger sink
+// create logger sink, async hands messages to a background thread of spdlog
+// so callers never wait for the file, the oldest pending message is dropped
+// when queue_size are waiting
 void Init(const std::string &log_path, int size = 1024 * 1024 * 10,
-          int count = 10);
+          int count = 10, bool async = false, size_t queue_size = 8192);
 
 void SetLevel(spdlog::level::level_enum level);
 
 // create or get looger
 Logger GetLogger(const std::string &name);
 
+// Lets a burst of messages through per interval and counts the rest, for
+// error paths that may fail at frame rate. Not thread safe.
+class LogRateLimit final {
+public:
+    explicit LogRateLimit(uint32_t burst = 5, uint32_t interval_ms = 1000);
+
+    // @param suppressed messages dropped since the last one let through
+    bool Allow(uint32_t &suppressed);
+
+private:
+    uint32_t burst_;
+    uint64_t interval_us_;
+    uint64_t window_us_;
+    uint32_t passed_;
+    uint32_t suppressed_;
+};
+
 } // namespace util
 } // namespace noevil
 
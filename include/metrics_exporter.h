@@ -0,0 +1,73 @@
+#ifndef __METRICS_EXPORTER_H_
+#define __METRICS_EXPORTER_H_
+
+#include "webcam_v4l2.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace noevil {
+namespace webcam {
+
+class DeviceMonitor;
+
+// Publishes the StreamStats of cameras in the Prometheus text format 0.0.4,
+// labelled by device node and bus_info: fps, jitter, drops, payload rate,
+// buffers out of the driver queue, latency, wait and hold quantiles, and
+// reconnect counts if a DeviceMonitor is given. Either served over HTTP by
+// a small listener or written as a textfile for the node_exporter textfile
+// collector. All calls are expected from the thread driving the cameras.
+class MetricsExporter final {
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter &) = delete;
+    MetricsExporter &operator=(const MetricsExporter &) = delete;
+
+    std::string GetError() const { return error_; }
+
+    // labelled by the bus_info of its last VIDIOC_QUERYCAP, which
+    // survives a reconnect, the camera need not be open yet
+    bool Add(WebcamV4l2 *cam);
+    bool Remove(WebcamV4l2 *cam);
+    size_t size() const { return cams_.size(); }
+
+    // reconnect counts of the cameras it watches, nullptr for none
+    void SetMonitor(const DeviceMonitor *monitor) { monitor_ = monitor; }
+
+    // the exposition of every camera added
+    std::string Render() const;
+
+    // written to a temporary file and renamed over path, so the collector
+    // never reads half of it
+    bool WriteTextfile(const std::string &path);
+
+    // serve GET /metrics on address, port 0 for any free one
+    bool Listen(const std::string &address, uint16_t port);
+    // the port bound by Listen
+    uint16_t port() const { return port_; }
+    // readable when a scrape is waiting, for own event loops
+    int fd() const { return listen_fd_; }
+
+    // wait up to timeout milliseconds, -1 for ever, and answer up to 8 of
+    // the connections waiting, one request each within 200 ms
+    // @return requests answered, -1 on failure
+    int Poll(int timeout);
+
+private:
+    void Serve(int fd);
+
+    int listen_fd_;
+    uint16_t port_;
+    std::string error_;
+
+    std::vector<WebcamV4l2 *> cams_;
+    const DeviceMonitor *monitor_;
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __METRICS_EXPORTER_H_ */
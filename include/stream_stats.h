@@ -0,0 +1,253 @@
+#ifndef __STREAM_STATS_H_
+#define __STREAM_STATS_H_
+
+#include <atomic>
+#include <cstdint>
+
+namespace noevil {
+namespace webcam {
+
+// percentiles of a LatencyHistogram, exact up to the bucket width
+struct LatencySummary {
+    uint64_t count = 0;
+    uint64_t sum_us = 0;
+    uint64_t mean_us = 0;
+    uint64_t max_us = 0;
+    uint64_t p50_us = 0;
+    uint64_t p99_us = 0;
+    uint64_t p999_us = 0;
+};
+
+// Log-linear histogram of microseconds for one writer and any number of
+// readers, without locks. Values below 8 have a bucket each, every power of
+// two above is split into 8 linear buckets, so a bucket is at most 12.5% of
+// its values wide. Values from 2^32 us on share the last bucket.
+class LatencyHistogram final {
+public:
+    enum { kSubBits = 3, kBuckets = (32 - kSubBits + 1) << kSubBits };
+
+    LatencyHistogram() { Reset(); }
+
+    LatencyHistogram(const LatencyHistogram &) = delete;
+    LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+    // writer only
+    void Record(uint64_t us) {
+        Add(buckets_[Index(us)], 1);
+        Add(sum_, us);
+        if (us > max_.load(std::memory_order_relaxed)) {
+            max_.store(us, std::memory_order_relaxed);
+        }
+    }
+
+    // by the writer, or while it is idle
+    void Reset() {
+        for (auto &bucket : buckets_) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    // any thread, a record in flight may count in one field but not yet in
+    // another
+    LatencySummary Summarize() const {
+        uint64_t counts[kBuckets];
+        uint64_t total = 0;
+        for (int i = 0; i < kBuckets; ++i) {
+            counts[i] = buckets_[i].load(std::memory_order_relaxed);
+            total += counts[i];
+        }
+
+        LatencySummary summary;
+        if (!total) {
+            return summary;
+        }
+        summary.count = total;
+        summary.sum_us = sum_.load(std::memory_order_relaxed);
+        summary.mean_us = summary.sum_us / total;
+        summary.max_us = max_.load(std::memory_order_relaxed);
+
+        // rank of a quantile in per mille, rounded up
+        uint64_t ranks[] = {(total * 500 + 999) / 1000,
+                            (total * 990 + 999) / 1000,
+                            (total * 999 + 999) / 1000};
+        uint64_t *values[] = {&summary.p50_us, &summary.p99_us,
+                              &summary.p999_us};
+        uint64_t seen = 0;
+        int q = 0;
+        for (int i = 0; i < kBuckets && q < 3; ++i) {
+            seen += counts[i];
+            while (q < 3 && seen >= ranks[q]) {
+                uint64_t bound = UpperBound(i);
+                *values[q++] =
+                    bound < summary.max_us ? bound : summary.max_us;
+            }
+        }
+        return summary;
+    }
+
+    static int Index(uint64_t us) {
+        if (us < (1u << kSubBits)) {
+            return (int)us;
+        }
+        if (us >> 32) {
+            return kBuckets - 1;
+        }
+        int exp = 63 - __builtin_clzll(us);
+        return ((exp - kSubBits + 1) << kSubBits) |
+               (int)((us >> (exp - kSubBits)) & ((1u << kSubBits) - 1));
+    }
+
+    // the largest value of a bucket
+    static uint64_t UpperBound(int index) {
+        if (index < (1 << kSubBits)) {
+            return index;
+        }
+        int shift = (index >> kSubBits) - 1;
+        uint64_t low = (uint64_t)((1 << kSubBits) |
+                                  (index & ((1 << kSubBits) - 1)))
+                       << shift;
+        return low + (1ull << shift) - 1;
+    }
+
+private:
+    // single writer, no locked instruction
+    static void Add(std::atomic<uint64_t> &counter, uint64_t value) {
+        counter.store(counter.load(std::memory_order_relaxed) + value,
+                      std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+};
+
+// how a stream performs since it was started
+struct StreamStats {
+    uint64_t frames = 0;
+    // from the capture timestamps of the first and the last frame
+    double fps = 0;
+    // mean deviation of one frame interval from the one before, smoothed
+    // by 1/16 as the RFC 3550 interarrival jitter
+    uint64_t jitter_us = 0;
+    // sequence gaps, frames the driver had no buffer for
+    uint64_t dropped = 0;
+    // buffers flagged V4L2_BUF_FLAG_ERROR
+    uint64_t errors = 0;
+    // payload, per second as the mean frame size times fps
+    uint64_t bytes = 0;
+    double bytes_per_second = 0;
+    // dequeued and not requeued yet: leased, in the ring or being copied
+    uint64_t buffers_out = 0;
+    // poll until a frame is ready, by grab and the capture thread only
+    LatencySummary wait;
+    // VIDIOC_DQBUF until VIDIOC_QBUF
+    LatencySummary hold;
+    // capture timestamp until the frame is handed out, at the dequeue for
+    // grab and retrieve or at PopFrame, monotonic timestamps only
+    LatencySummary latency;
+};
+
+// Writer side of StreamStats, updated by the thread dequeuing at the time.
+// Snapshot never blocks it.
+class StreamMetrics final {
+public:
+    StreamMetrics() { Reset(); }
+
+    StreamMetrics(const StreamMetrics &) = delete;
+    StreamMetrics &operator=(const StreamMetrics &) = delete;
+
+    // per dequeued buffer, ts_us its capture timestamp
+    void OnFrame(uint64_t ts_us, uint32_t bytes, uint32_t dropped,
+                 bool error) {
+        uint64_t frames = frames_.load(std::memory_order_relaxed);
+        if (!frames) {
+            first_ts_us_.store(ts_us, std::memory_order_relaxed);
+        } else {
+            int64_t interval =
+                (int64_t)(ts_us - last_ts_us_.load(std::memory_order_relaxed));
+            if (frames > 1) {
+                int64_t d = interval - last_interval_;
+                uint64_t jitter = jitter16_.load(std::memory_order_relaxed);
+                jitter += (uint64_t)(d < 0 ? -d : d) - jitter / 16;
+                jitter16_.store(jitter, std::memory_order_relaxed);
+            }
+            last_interval_ = interval;
+        }
+        last_ts_us_.store(ts_us, std::memory_order_relaxed);
+        frames_.store(frames + 1, std::memory_order_relaxed);
+        bytes_.store(bytes_.load(std::memory_order_relaxed) + bytes,
+                     std::memory_order_relaxed);
+
+        if (dropped) {
+            dropped_.store(dropped_.load(std::memory_order_relaxed) + dropped,
+                           std::memory_order_relaxed);
+        }
+        if (error) {
+            errors_.store(errors_.load(std::memory_order_relaxed) + 1,
+                          std::memory_order_relaxed);
+        }
+    }
+
+    // while no thread dequeues
+    void Reset() {
+        frames_.store(0, std::memory_order_relaxed);
+        bytes_.store(0, std::memory_order_relaxed);
+        dropped_.store(0, std::memory_order_relaxed);
+        errors_.store(0, std::memory_order_relaxed);
+        first_ts_us_.store(0, std::memory_order_relaxed);
+        last_ts_us_.store(0, std::memory_order_relaxed);
+        jitter16_.store(0, std::memory_order_relaxed);
+        last_interval_ = 0;
+        wait.Reset();
+        hold.Reset();
+        latency.Reset();
+    }
+
+    StreamStats Snapshot() const {
+        StreamStats stats;
+        stats.frames = frames_.load(std::memory_order_relaxed);
+        uint64_t first = first_ts_us_.load(std::memory_order_relaxed);
+        uint64_t last = last_ts_us_.load(std::memory_order_relaxed);
+        if (stats.frames > 1 && last > first) {
+            stats.fps = (stats.frames - 1) * 1e6 / (last - first);
+        }
+        stats.jitter_us = jitter16_.load(std::memory_order_relaxed) / 16;
+        stats.dropped = dropped_.load(std::memory_order_relaxed);
+        stats.errors = errors_.load(std::memory_order_relaxed);
+        stats.bytes = bytes_.load(std::memory_order_relaxed);
+        if (stats.frames) {
+            stats.bytes_per_second = stats.fps * stats.bytes / stats.frames;
+        }
+        stats.wait = wait.Summarize();
+        stats.hold = hold.Summarize();
+        stats.latency = latency.Summarize();
+        // every requeue of a dequeued buffer records its hold
+        if (stats.frames > stats.hold.count) {
+            stats.buffers_out = stats.frames - stats.hold.count;
+        }
+        return stats;
+    }
+
+    LatencyHistogram wait;
+    LatencyHistogram hold;
+    LatencyHistogram latency;
+
+private:
+    std::atomic<uint64_t> frames_;
+    std::atomic<uint64_t> bytes_;
+    std::atomic<uint64_t> dropped_;
+    std::atomic<uint64_t> errors_;
+    std::atomic<uint64_t> first_ts_us_;
+    std::atomic<uint64_t> last_ts_us_;
+    // jitter times 16, kept in integers
+    std::atomic<uint64_t> jitter16_;
+    // writer only
+    int64_t last_interval_;
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __STREAM_STATS_H_ */
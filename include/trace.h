@@ -0,0 +1,94 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace noevil {
+namespace util {
+
+// Begin and end events of the frame pipeline in the Chrome trace event
+// format, for chrome://tracing or ui.perfetto.dev. Off by default, then a
+// scope costs one predictable branch. Every thread records into a ring of
+// its own without locks, the oldest events are overwritten when it is full.
+//
+// Events carry a frame sequence number: the one given, or the last one
+// SetTraceFrame gave on the thread. Capture sets it right after VIDIOC_DQBUF,
+// so later stages on the same thread, e.g. a JPEG transform or a file write,
+// are tagged without knowing the frame.
+//
+// Names are kept as pointers, pass string literals only.
+
+namespace detail {
+extern std::atomic<bool> trace_on;
+void TraceEvent(const char *name, int64_t frame, bool end);
+void SetTraceFrame(int64_t frame);
+int64_t TraceFrame();
+} // namespace detail
+
+const int64_t kTraceNoFrame = -1;
+
+// events per thread, for threads that record their first event afterwards
+void EnableTrace(bool enable, size_t events_per_thread = 1 << 16);
+
+inline bool TraceEnabled() {
+    return detail::trace_on.load(std::memory_order_relaxed);
+}
+
+// frame of the events to come on this thread, kTraceNoFrame for none
+inline void SetTraceFrame(int64_t frame) {
+    if (TraceEnabled()) {
+        detail::SetTraceFrame(frame);
+    }
+}
+
+// shown instead of the tid, a string literal as well
+void SetTraceThreadName(const char *name);
+
+// trace event JSON of all threads, what is recorded so far
+std::string TraceJson();
+bool DumpTrace(const std::string &path);
+// forget the events recorded so far
+void ClearTrace();
+
+class TraceScope final {
+public:
+    explicit TraceScope(const char *name) : name_(nullptr) {
+        if (TraceEnabled()) {
+            name_ = name;
+            frame_ = detail::TraceFrame();
+            detail::TraceEvent(name_, frame_, false);
+        }
+    }
+
+    TraceScope(const char *name, int64_t frame) : name_(nullptr) {
+        if (TraceEnabled()) {
+            name_ = name;
+            frame_ = frame;
+            detail::TraceEvent(name_, frame_, false);
+        }
+    }
+
+    ~TraceScope() {
+        if (name_) {
+            detail::TraceEvent(name_, frame_, true);
+        }
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    // for the end event, when the frame is known only inside the scope
+    void SetFrame(int64_t frame) { frame_ = frame; }
+
+private:
+    const char *name_;
+    int64_t frame_;
+};
+
+} // namespace util
+} // namespace noevil
+
+#endif /* __TRACE_H_ */
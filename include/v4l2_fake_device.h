@@ -0,0 +1,218 @@
+#ifndef __V4L2_FAKE_DEVICE_H_
+#define __V4L2_FAKE_DEVICE_H_
+
+#include "v4l2_io.h"
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <linux/videodev2.h>
+
+namespace noevil {
+namespace webcam {
+
+struct V4l2FakeMode {
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps;
+};
+
+// An in-process V4L2 capture device implementing the ioctl subset used by
+// WebcamV4l2. Frames are only produced when Produce() is called, so the test
+// or benchmark controls timing. MMAP buffers are memfd backed, hence they can
+// be mmap'd and exported as real file descriptors. USERPTR is supported too.
+// In multi-planar mode every plane of NV12M and YUV420M gets its own memfd.
+//
+// The device fd is an eventfd, readable while frames are done. With control
+// events on it is one end of a loopback TCP connection instead: a byte of
+// normal data makes it readable, an urgent byte raises POLLPRI while control
+// events are pending, like a V4L2 fd. That costs a few syscalls per frame.
+//
+// Unplug and Replug simulate a USB reset. A plain file may stand in for the
+// device node so inotify based monitors see it go and come back.
+//
+// Built into the webcam_fake library, not into libwebcam itself.
+//
+//   auto dev = std::make_shared<V4l2FakeDevice>();
+//   WebcamV4l2 cam("/dev/video-fake");
+//   cam.SetIo(dev);
+//   cam.Open(); cam.Init(); ...; cam.Start();
+//   dev->Produce();
+//   cam.Grab(lease);
+class V4l2FakeDevice : public V4l2Io {
+public:
+    V4l2FakeDevice();
+    ~V4l2FakeDevice();
+
+    // configuration, call before the device is opened
+    void SetCard(const std::string &card) { card_ = card; }
+    void SetBusInfo(const std::string &bus_info) { bus_info_ = bus_info; }
+    void SetModes(const std::vector<V4l2FakeMode> &modes) { modes_ = modes; }
+    // drivers without VIDIOC_EXPBUF
+    void SetExportSupported(bool supported) { expbuf_ = supported; }
+    // V4L2_EVENT_CTRL subscriptions, drivers without answer ENOTTY
+    void SetControlEvents(bool enable) { ctrl_events_ = enable; }
+    // VIDEO_CAPTURE_MPLANE instead of VIDEO_CAPTURE
+    void SetMultiPlanar(bool mplane) {
+        type_ = mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+                       : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    }
+    // delay of every VIDIOC_ENUM* answer, some UVC cameras are that slow
+    void SetEnumDelay(uint32_t delay_us) { enum_delay_us_ = delay_us; }
+    // Shift every frame timestamp by offset and a random amount within
+    // +-jitter microseconds, reproducible for a given seed.
+    void SetTimestampSkew(int64_t offset_us, uint32_t jitter_us,
+                          unsigned int seed = 1) {
+        ts_offset_us_ = offset_us;
+        ts_jitter_us_ = jitter_us;
+        ts_seed_ = seed;
+    }
+
+    // Fill the next queued buffer and mark it done. A frame produced while
+    // no buffer is queued is dropped but still consumes a sequence number.
+    // @return frames delivered to the done queue
+    int Produce(int count = 1);
+
+    uint32_t dropped() const { return dropped_; }
+    // VIDIOC_G/S_CTRL and VIDIOC_G/S/TRY_EXT_CTRLS answered so far
+    uint32_t control_ioctls() const { return control_ioctls_; }
+    // A control change from outside, e.g. another application or the
+    // camera itself. Subscribers of the control get a V4L2_EVENT_CTRL.
+    bool ChangeControl(uint32_t id, int64_t value);
+
+    // created now and by Replug, removed by Unplug, from now on the device
+    // opens under this path only, like a real node
+    bool SetNode(const std::string &path);
+    // The device goes away: the node is gone, every call on the open fd
+    // but Close fails with ENODEV and the fd turns readable to wake the
+    // waiters. The stale fd has to be closed before the device is opened
+    // again.
+    void Unplug();
+    // back with the state of a fresh device, controls at their defaults
+    void Replug();
+    bool present() const { return present_; }
+
+    // V4l2Io
+    int Stat(const char *path, struct stat *st) override;
+    int Open(const char *path, int flags) override;
+    int Close(int fd) override;
+    int Ioctl(int fd, unsigned long request, void *arg) override;
+    void *MMap(size_t length, int prot, int flags, int fd,
+               off_t offset) override;
+    int MUnmap(void *addr, size_t length) override;
+
+private:
+    struct Plane {
+        int memfd = -1;
+        // driver memory for mmap, the queued user pointer for userptr
+        void *mem = nullptr;
+        uint32_t length = 0;
+        uint32_t offset = 0;
+    };
+
+    struct Control {
+        struct v4l2_queryctrl queryctrl;
+        int64_t value;
+    };
+
+    struct Buffer {
+        Plane plane[VIDEO_MAX_PLANES];
+        uint32_t num_planes = 1;
+
+        bool queued = false;
+        struct v4l2_buffer buf;
+        // buf.m.planes of the multi-planar API
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    };
+
+    int DoIoctl(unsigned long request, void *arg);
+
+    int QueryCap(struct v4l2_capability *cap);
+    int EnumFmt(struct v4l2_fmtdesc *desc);
+    int EnumFrameSizes(struct v4l2_frmsizeenum *frmsize);
+    int EnumFrameIntervals(struct v4l2_frmivalenum *frmival);
+    int TryFmt(struct v4l2_format *fmt);
+    int ReqBufs(struct v4l2_requestbuffers *req);
+    int QueryBuf(struct v4l2_buffer *buf);
+    int QBuf(struct v4l2_buffer *buf);
+    int DQBuf(struct v4l2_buffer *buf);
+    int StreamOff();
+    int ExpBuf(struct v4l2_exportbuffer *exp);
+    int QueryCtrl(struct v4l2_queryctrl *queryctrl);
+    int QueryMenu(struct v4l2_querymenu *querymenu);
+    int ExtCtrls(unsigned long request, struct v4l2_ext_controls *ext);
+    int SubscribeEvent(unsigned long request,
+                       struct v4l2_event_subscription *sub);
+    int DQEvent(struct v4l2_event *ev);
+    // merged into a pending event of the same control, like the kernel's
+    // one element control event queue
+    void QueueEvent(const Control &ctrl, uint32_t changes);
+
+    Control *FindControl(uint32_t id);
+    // errno if the value can not be written
+    int CheckControl(const Control &ctrl, int64_t value) const;
+
+    bool IsMultiPlanar() const { return V4L2_TYPE_IS_MULTIPLANAR(type_); }
+    void GetFmt(struct v4l2_format *fmt) const;
+    // copy out the state of a buffer, planes included
+    void CopyBuffer(const Buffer &buffer, struct v4l2_buffer *buf) const;
+
+    void FreeBuffers();
+    bool CreateNode();
+    void SetReadable(bool readable);
+    void SetPriority(bool priority);
+    // the loopback pair, false if there is no loopback
+    bool OpenSocket();
+
+    std::mutex mutex_;
+
+    std::string card_;
+    std::string bus_info_;
+    std::vector<V4l2FakeMode> modes_;
+    bool expbuf_;
+    uint32_t enum_delay_us_;
+    bool ctrl_events_;
+    uint32_t type_; // enum v4l2_buf_type
+    std::string node_;
+    bool present_;
+
+    int fd_;
+    // the other end of fd_, -1 for an eventfd
+    int peer_fd_;
+    bool readable_;
+    bool priority_;
+    bool streaming_;
+    uint32_t input_;
+    // sizeimage of pix_ covers all planes
+    struct v4l2_pix_format pix_;
+    uint32_t num_planes_;
+    struct v4l2_plane_pix_format plane_fmt_[VIDEO_MAX_PLANES];
+    struct v4l2_fract timeperframe_;
+
+    std::vector<Buffer> buffers_;
+    std::deque<uint32_t> queued_;
+    std::deque<uint32_t> done_;
+
+    uint32_t memory_; // enum v4l2_memory of the allocated buffers
+    uint32_t sequence_;
+    uint32_t dropped_;
+
+    // a UVC camera like set, sorted by id
+    std::vector<Control> controls_;
+    uint32_t control_ioctls_;
+    std::vector<uint32_t> subscribed_;
+    std::deque<struct v4l2_event> events_;
+    uint32_t event_sequence_;
+
+    int64_t ts_offset_us_;
+    uint32_t ts_jitter_us_;
+    unsigned int ts_seed_;
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __V4L2_FAKE_DEVICE_H_ */
@@ -0,0 +1,35 @@
+#ifndef __V4L2_IO_H_
+#define __V4L2_IO_H_
+
+#include <memory>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+namespace noevil {
+namespace webcam {
+
+// The system calls WebcamV4l2 issues against a device node. The default
+// implementation forwards to the kernel, tests and benchmarks may replace it
+// with an in-process device (see V4l2FakeDevice). The fd returned by Open must
+// be usable with select/poll/epoll.
+class V4l2Io {
+public:
+    virtual ~V4l2Io() {}
+
+    virtual int Stat(const char *path, struct stat *st);
+    virtual int Open(const char *path, int flags);
+    virtual int Close(int fd);
+    virtual int Ioctl(int fd, unsigned long request, void *arg);
+    virtual void *MMap(size_t length, int prot, int flags, int fd,
+                       off_t offset);
+    virtual int MUnmap(void *addr, size_t length);
+
+    // shared kernel backend
+    static std::shared_ptr<V4l2Io> System();
+};
+
+} // namespace webcam
+} // namespace noevil
+
+#endif /* __V4L2_IO_H_ */
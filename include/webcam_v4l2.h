@@ -10,11 +10,16 @@
 #define __WEBCAM_V4L2_H_
 
 #include "log.h"
+#include "stream_stats.h"
+#include "v4l2_io.h"
 
 #include <functional>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <linux/videodev2.h>
 
@@ -24,22 +29,160 @@ namespace webcam {
 enum class WebcamFormat {
     kFmtNone,
     kFmtMJPG, // Motion-JPEG
-    kFmtYUYV  // YUYV422
+    kFmtYUYV,  // YUYV422
+    kFmtNV12M, // NV12, Y and CbCr in separate planes
+    kFmtNV12,  // Y plane, then interleaved CbCr at half resolution
+    kFmtYU12,  // I420, Y, Cb and Cr planes at half resolution
+    kFmtGREY,  // 8 bit luma
+    kFmtY16,   // 16 bit luma, little endian
+    kFmtRGB24,
+    kFmtBGR24,
+    kFmtH264 // H.264 elementary stream
 };
 
-struct V4l2BufUnit {
-    int index = 0;
-    uint32_t length = 0;
+// where a color plane of a frame lies in the capture buffers
+struct WebcamPlaneLayout {
+    // buffer plane holding it, always 0 for single-planar buffers
+    uint32_t plane = 0;
+    // from the start of that buffer plane
     uint32_t offset = 0;
+    // 0 for compressed formats
+    uint32_t bytesperline = 0;
+    // 0 for compressed formats, whose size is the payload
+    uint32_t size = 0;
+};
+
+// a frame size of a pixel format and its frame intervals
+struct WebcamMode {
+    uint32_t fourcc = 0;
+    std::string description;
+    // the largest size for stepwise or continuous drivers
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // discrete intervals, or the fastest and slowest if stepwise
+    std::vector<struct v4l2_fract> intervals;
+    // intervals is a stepwise or continuous range
+    bool stepwise = false;
+};
+
+// what NegotiateMode optimizes once the minimums are met
+enum class ModeGoal {
+    kThroughput, // most pixels per second, then the lowest latency
+    kLatency     // lowest latency, then the most pixels per second
+};
+
+enum class ModePreference { kAny, kRaw, kCompressed };
+
+struct ModeConstraints {
+    uint32_t min_width = 0;
+    uint32_t min_height = 0;
+    uint32_t min_fps = 0;
+    ModeGoal goal = ModeGoal::kThroughput;
+    // soft, the other kind is only taken if none of this kind fits
+    ModePreference preference = ModePreference::kAny;
+    // bytes per second the camera may use on the bus, by default the
+    // isochronous limit of USB 2.0 high speed, 3 x 1024 bytes per microframe
+    uint64_t bus_bandwidth = 24576000;
+};
 
+// the mode NegotiateMode applied and the estimates it was chosen by
+struct NegotiatedMode {
+    uint32_t fourcc = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    struct v4l2_fract interval = {0, 0};
+    // bytes per second on the bus
+    uint64_t bandwidth = 0;
+    // host decode time per frame, 0 for raw formats
+    uint64_t decode_us = 0;
+    // readout of one frame interval, bus transfer and decode
+    uint64_t latency_us = 0;
+    std::string rationale;
+};
+
+struct V4l2PlaneUnit {
     void *start = nullptr;
+    uint32_t length = 0;
+    uint32_t offset = 0;
+
+    // exported by VIDIOC_EXPBUF, -1 if not exported
+    int dmabuf_fd = -1;
+};
+
+struct V4l2BufUnit {
+    int index = 0;
     uint32_t bytes = 0;
+
+    uint32_t num_planes = 1;
+    V4l2PlaneUnit plane[VIDEO_MAX_PLANES];
+    // m.planes of the v4l2_buffer of this index, multi-planar api only
+    struct v4l2_plane v4l2_planes[VIDEO_MAX_PLANES];
+
+    // monotonic time of the last DQBUF, 0 while queued
+    uint64_t dequeued_us = 0;
+};
+
+// counters and buffer usage of one streaming session
+struct BufferUsage {
+    uint32_t frames = 0;
+    // sequence numbers skipped by the driver, it ran out of buffers
+    uint32_t dropped = 0;
+    // frames flagged V4L2_BUF_FLAG_ERROR
+    uint32_t errors = 0;
+    // dequeue to requeue time
+    uint64_t max_hold_us = 0;
+    uint64_t total_hold_us = 0;
+
+    // stale frames requeued unseen in latest-frame mode
+    uint32_t skipped = 0;
+
+    uint32_t first_sequence = 0;
+    uint32_t last_sequence = 0;
+    uint64_t first_ts_us = 0;
+    uint64_t last_ts_us = 0;
+};
+
+// pause/resume cycles of one streaming session
+struct ResumeStats {
+    uint32_t resumes = 0;
+    // requeue and stream on
+    uint64_t last_resume_us = 0;
+    uint64_t max_resume_us = 0;
+    uint64_t total_resume_us = 0;
+    // Resume call to the first frame dequeued
+    uint64_t last_first_frame_us = 0;
+    uint64_t max_first_frame_us = 0;
+};
+
+// Why the last grab or retrieve failed. Recorded as a code and the errno
+// without allocating, GetError formats the message only when asked.
+enum class CaptureError {
+    kNone,
+    // no frame within the timeout, nothing wrong with the device
+    kTimeout,
+    kNotStarted,
+    kNoBuffers,
+    kThreadRunning, // use PopFrame
+    kNoCallback,
+    kLeaseLimit,
+    kPoll,
+    kDequeue,
+    kQueue
+};
+
+// caller owned, page aligned capture memory for V4L2_MEMORY_USERPTR
+struct UserBuffer {
+    void *start;
+    uint32_t length;
 };
 
 struct V4l2BufStat {
     // for preparation
     int count = 0;     // mapped count
     uint32_t type = 0; // enum v4l2_buf_type
+    uint32_t memory = V4L2_MEMORY_MMAP; // enum v4l2_memory
+    uint32_t num_planes = 1;
+    V4l2Io *io = nullptr;
     struct V4l2BufUnit *buffer = nullptr;
 
     // tmp
@@ -51,9 +194,200 @@ public:
     void operator()(V4l2BufStat *stat);
 };
 
+// Negotiated state of a device to restart it without enumeration or
+// negotiation, see TakeSnapshot and RestoreFrom
+struct WebcamSnapshot {
+    std::string card;
+    std::string bus_info;
+    uint32_t input = 0;
+    uint32_t fourcc = 0;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    struct v4l2_fract timeperframe = {0, 0};
+    uint32_t buffer_count = 0;
+    // control id and value
+    std::vector<std::pair<uint32_t, int32_t>> controls;
+    // open to stream on of the start it was taken from, microseconds
+    uint64_t setup_us = 0;
+
+    // one key=value per line
+    std::string Serialize() const;
+    bool Parse(const std::string &text);
+};
+
+// what the driver reported about a frame
+struct FrameMeta {
+    struct timeval timestamp = {0, 0};
+    uint64_t timestamp_us = 0;
+    uint32_t sequence = 0;
+    uint32_t index = 0;
+    // payload of all planes
+    uint32_t bytesused = 0;
+    uint32_t num_planes = 1;
+    // raw v4l2_buffer flags
+    uint32_t flags = 0;
+    // V4L2_BUF_FLAG_ERROR, the data may be corrupted
+    bool error = false;
+    // V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC, _COPY or _UNKNOWN
+    uint32_t timestamp_type = 0;
+    // V4L2_BUF_FLAG_TSTAMP_SRC_EOF or _SOE
+    uint32_t timestamp_source = 0;
+    // frames the driver lost since the previous one
+    uint32_t dropped = 0;
+    // ready frames requeued unseen, latest-frame mode
+    uint32_t skipped = 0;
+};
+
+// one color plane of a frame, in place in the capture buffer
+struct FramePlane {
+    // payload start, after the driver's data offset
+    const char *data = nullptr;
+    uint32_t bytesused = 0;
+    // mapped size of the buffer plane for a single color plane, the size of
+    // the color plane otherwise
+    uint32_t length = 0;
+    uint32_t bytesperline = 0;
+    int dmabuf_fd = -1;
+    // of data from the start of the dmabuf, for importers
+    uint32_t offset = 0;
+};
+
+class WebcamV4l2;
+
+// what the capture thread does when the consumer falls behind
+enum class RingFullPolicy {
+    kDropOldest, // requeue the oldest unconsumed frame
+    kDropNewest, // requeue the frame just captured
+    kBlock       // stop dequeuing until the consumer catches up
+};
+
+struct CaptureThreadOptions {
+    // frames waiting for the consumer, at most buffer count - 1
+    uint32_t capacity = 4;
+    RingFullPolicy policy = RingFullPolicy::kDropOldest;
+    // pin the thread to this cpu, -1 to leave it to the scheduler
+    int cpu = -1;
+    // poll timeout in milliseconds, bounds how fast the thread stops
+    int timeout = 100;
+};
+
+struct CaptureThreadStats {
+    // producer side
+    uint64_t produced = 0;       // frames dequeued from the driver
+    uint64_t published = 0;      // frames pushed into the ring
+    uint64_t dropped_oldest = 0; // unconsumed frames overwritten
+    uint64_t dropped_newest = 0; // captured frames thrown away
+    uint64_t blocked = 0;        // times the producer waited for room
+    uint64_t driver_dropped = 0; // sequence gaps, the driver had no buffer
+    // consumer side
+    uint64_t consumed = 0;
+};
+
+// A dequeued v4l2 buffer handed out without copying. The buffer stays out of
+// the driver queue until the lease is released or destroyed, then it is
+// requeued with VIDIOC_QBUF. The data is only valid while the stream is
+// running, and a lease must not outlive the WebcamV4l2 it comes from.
+class FrameLease {
+public:
+    FrameLease();
+    ~FrameLease();
+
+    FrameLease(FrameLease &&other) noexcept;
+    FrameLease &operator=(FrameLease &&other) noexcept;
+
+    FrameLease(const FrameLease &) = delete;
+    FrameLease &operator=(const FrameLease &) = delete;
+
+    bool valid() const { return owner_ != nullptr; }
+
+    // the first plane, the whole frame of a single plane format
+    const char *data() const { return planes_[0].data; }
+    // mapped size of the buffer
+    uint32_t length() const { return planes_[0].length; }
+    // payload size of the frame
+    uint32_t bytesused() const { return planes_[0].bytesused; }
+    uint32_t index() const { return buf_.index; }
+    uint32_t sequence() const { return buf_.sequence; }
+    const struct timeval &timestamp() const { return buf_.timestamp; }
+    // dmabuf of the buffer, -1 if export is off or unsupported. Owned by
+    // the camera, dup() it to keep it beyond the stream.
+    int dmabuf_fd() const { return planes_[0].dmabuf_fd; }
+    // color planes of the format, e.g. 2 for NV12 and NV12M, 3 for YU12,
+    // 1 for packed and compressed formats
+    uint32_t num_planes() const { return num_planes_; }
+    const FramePlane &plane(uint32_t i) const { return planes_[i]; }
+    const FrameMeta &meta() const { return meta_; }
+    // older ready frames requeued in favour of this one, latest-frame mode
+    uint32_t skipped() const { return meta_.skipped; }
+
+    // requeue the buffer now, the lease becomes invalid
+    bool Release();
+
+private:
+    friend class WebcamV4l2;
+
+    void Reset();
+
+    WebcamV4l2 *owner_;
+    uint32_t generation_;
+    uint32_t num_planes_;
+    FramePlane planes_[VIDEO_MAX_PLANES];
+    FrameMeta meta_;
+    struct v4l2_buffer buf_;
+};
+
 struct V4l2Ctrl {
     struct v4l2_queryctrl queryctrl;
     struct v4l2_control control;
+    // the value is kept current by V4L2_EVENT_CTRL
+    bool cached;
+};
+
+// Control values set or read together in one VIDIOC_S_EXT_CTRLS or
+// VIDIOC_G_EXT_CTRLS, in the order they were added. Reuse a batch across
+// commits to keep them allocation free.
+//
+//   ControlBatch batch;
+//   batch.Set(V4L2_CID_EXPOSURE_ABSOLUTE, 100).Set(V4L2_CID_GAIN, 8);
+//   if (!cam.SetControls(batch)) {
+//       // batch.error_index() names the control that failed
+//   }
+class ControlBatch final {
+public:
+    ControlBatch &Set(uint32_t id, int32_t value) {
+        return Set(id, (int64_t)value);
+    }
+    ControlBatch &Set(uint32_t id, int64_t value) {
+        entries_.push_back({id, value});
+        return *this;
+    }
+    // the value is filled in by GetControls
+    ControlBatch &Get(uint32_t id) { return Set(id, (int64_t)0); }
+
+    void Clear() {
+        entries_.clear();
+        error_index_ = -1;
+    }
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    uint32_t id(size_t i) const { return entries_[i].id; }
+    int64_t value(size_t i) const { return entries_[i].value; }
+    // control rejected by the last commit, -1 if none or if the driver did
+    // not tell which one
+    int error_index() const { return error_index_; }
+
+private:
+    friend class WebcamV4l2;
+
+    struct Entry {
+        uint32_t id;
+        int64_t value;
+    };
+
+    std::vector<Entry> entries_;
+    std::vector<struct v4l2_ext_control> ctrls_;
+    int error_index_ = -1;
 };
 
 class WebcamV4l2 {
@@ -67,6 +401,11 @@ public:
 
     // get error message if any interface returns false
     std::string GetError() const;
+    // of the last grab or retrieve, kNone if it succeeded
+    CaptureError GetCaptureError() const { return capture_fault_.code; }
+
+    // replace the system calls, e.g. with V4l2FakeDevice. Only while closed.
+    bool SetIo(const std::shared_ptr<V4l2Io> &io);
 
     bool Open(bool force = false);
     bool Open(const char *name);
@@ -74,13 +413,127 @@ public:
 
     // settings
     bool Init();
+    // goes straight to VIDIOC_TRY_FMT/S_FMT, unsupported formats fall back
+    // to the first one of the device
     bool SetPixFormat(WebcamFormat fmt, uint32_t width, uint32_t height);
+    // Enumerate formats, frame sizes and intervals. Slow on some UVC cameras,
+    // so the table is cached per device and reused across reopen.
+    bool QueryModes(std::vector<WebcamMode> &modes, bool refresh = false);
     bool SetFps(uint8_t fps);
+    // Pick the best format, size and interval of the enumerated modes that
+    // meets the constraints, by a cost model of bus bandwidth, decode cost
+    // and latency, and apply it with S_FMT and S_PARM. In place of
+    // SetPixFormat and SetFps, while stopped.
+    bool NegotiateMode(const ModeConstraints &constraints,
+                       NegotiatedMode &mode);
+    // export the buffers as dmabuf fds on Start, ignored if the driver lacks
+    // VIDIOC_EXPBUF
+    void SetDmaBufExport(bool enable) { export_dmabuf_ = enable; }
+    bool IsDmaBufExported() const;
+    // Capture straight into caller owned memory (V4L2_MEMORY_USERPTR) from
+    // the next Start. Each buffer must be page aligned and hold sizeimage()
+    // bytes, and stay valid until Stop. An empty pool goes back to mmap.
+    bool SetUserBuffers(const std::vector<UserBuffer> &buffers);
+
+    // buffers requested on Start, 5 by default
+    bool SetBufferCount(uint32_t count);
+    // Grow or shrink the mmap buffer count between streaming sessions from
+    // the dequeue to requeue time and the drops seen in the last session.
+    void SetAdaptiveBufferCount(bool enable, uint32_t min_count = 2,
+                                uint32_t max_count = 16);
+    // buffers granted by the driver on the last REQBUFS
+    uint32_t buffer_count() const { return granted_count_; }
+    // counters of the current or last stream, reset on Start
+    const BufferUsage &buffer_usage() const { return usage_; }
+    // fps, jitter and latency histograms of the current or last stream,
+    // reset on Start and Resume. Safe from any thread, the capture thread
+    // included, and never blocks it.
+    StreamStats GetStreamStats() const { return metrics_.Snapshot(); }
+
+    // Freshest frame mode for closed-loop control, where latency matters more
+    // than completeness. Every grab drains all ready buffers, requeues them
+    // but the newest and delivers only that one.
+    void SetLatestFrameOnly(bool enable) { latest_only_ = enable; }
+    // frames skipped by the last grab in latest-frame mode
+    uint32_t last_skipped() const { return frame_meta_.skipped; }
+    // metadata of the last frame from any grab path
+    const FrameMeta &last_frame_meta() const { return frame_meta_; }
+
+    // bytes of a frame in the negotiated format, all planes
+    uint32_t sizeimage() const { return sizeimage_; }
+    // V4L2_BUF_TYPE_VIDEO_CAPTURE or _MPLANE for multi-planar only devices
+    uint32_t buf_type() const { return buf_type_; }
+    // buffer planes, more than 1 only for multi-planar formats like NV12M
+    uint32_t num_planes() const { return num_planes_; }
+    const struct v4l2_plane_pix_format &plane_format(uint32_t i) const {
+        return plane_fmt_[i];
+    }
+    // color planes of the negotiated format, as the frames expose them
+    uint32_t num_color_planes() const { return color_planes_; }
+    const WebcamPlaneLayout &plane_layout(uint32_t i) const {
+        return plane_layout_[i];
+    }
+
+    // Color planes of a format packed into one buffer, from the bytes per
+    // line of the first plane, or the minimum if 0. Unknown formats are
+    // taken as one plane of height lines.
+    // @return number of color planes, 1 with no sizes for compressed formats
+    static uint32_t FormatLayout(uint32_t fourcc, uint32_t width,
+                                 uint32_t height, uint32_t bytesperline,
+                                 WebcamPlaneLayout *layout);
+
+    // Record input, format, fps, buffer count and control values, best after
+    // Start so the setup time of this cold start is kept as well.
+    bool TakeSnapshot(WebcamSnapshot &snapshot);
+    // Warm start, in place of Init, SetPixFormat and SetFps. Opens the device
+    // if needed and applies a snapshot of the same card and bus with as few
+    // ioctls as possible. Start as usual afterwards.
+    bool RestoreFrom(const WebcamSnapshot &snapshot);
+    // Back to a device that was lost, e.g. by a USB reset, and reappeared as
+    // name, possibly another node than before: drops the stale fd and
+    // buffers, restores the snapshot and streams again if start. On a node
+    // of another device the camera stays closed under its old name.
+    bool Reconnect(const char *name, const WebcamSnapshot &snapshot,
+                   bool start);
+    // VIDIOC_QUERYCAP bus of the device behind name, opened through the same
+    // V4l2Io and closed again, this camera is left as it is
+    bool QueryBusInfo(const char *name, std::string &bus_info);
+    // open to stream on of the last start, microseconds
+    uint64_t setup_us() const { return setup_us_; }
+    // cold start setup time of the restored snapshot minus setup_us
+    int64_t setup_saved_us() const {
+        return cold_setup_us_ ? (int64_t)cold_setup_us_ - (int64_t)setup_us_
+                              : 0;
+    }
 
     // sync mode
     bool Start();
     bool Stop();
 
+    // Stream off but keep the buffers allocated and mapped, Resume requeues
+    // them and streams on again. Leases taken before the pause become stale.
+    // A running capture thread is stopped and started again by Resume with
+    // the same options. If requeueing or STREAMON fails the stream stays
+    // paused and may be resumed again. Stop still frees everything.
+    bool Pause();
+    bool Resume();
+    bool IsPaused() const { return paused_; }
+
+    // Change format, size and fps of a running stream with only STREAMOFF,
+    // REQBUFS(0), S_FMT, S_PARM, REQBUFS, STREAMON, e.g. for a full
+    // resolution still out of a preview. kFmtNone keeps the format, fps 0
+    // the frame interval the driver picks. The first warmup frames are
+    // discarded before returning. A running capture thread is started again
+    // with the same options. The stream is left stopped, buffers freed and
+    // no capture thread, if the new mode can not be applied.
+    bool SwitchMode(WebcamFormat fmt, uint32_t width, uint32_t height,
+                    uint8_t fps = 0, uint32_t warmup = 0,
+                    uint32_t timeout = 1000);
+    // stream off to ready again of the last SwitchMode, warm-up included
+    double switch_gap_ms() const { return switch_gap_us_ / 1000.0; }
+    // reset on Start
+    const ResumeStats &resume_stats() const { return resume_stats_; }
+
     // block, select and grab
     // @timeout milliseconds
     bool Grab(std::string &out, uint32_t timeout = 100);
@@ -97,28 +550,114 @@ public:
     SetFrameCallback(const std::function<void(const char *const, uint32_t)> &cb) {
         frame_cb_ = cb;
     }
+    // takes precedence over the plain frame callback
+    void SetFrameMetaCallback(
+        const std::function<void(const char *const, uint32_t,
+                                 const FrameMeta &)> &cb) {
+        frame_meta_cb_ = cb;
+    }
+    // every plane in place, takes precedence over the callbacks above,
+    // which only get the first plane
+    void SetFramePlanesCallback(
+        const std::function<void(const FramePlane *, uint32_t,
+                                 const FrameMeta &)> &cb) {
+        frame_planes_cb_ = cb;
+    }
 
     // block
     bool Grab(uint32_t timeout = 100);
-    // non-block
+    // non-block, discard needs no callback
     bool Retrieve(bool discard = false);
 
+    // zero-copy, the frame stays dequeued until the lease is released. Fails
+    // if leasing one more buffer would leave none queued in the driver.
+    // block
+    bool Grab(FrameLease &lease, uint32_t timeout = 100);
+    // non-block
+    bool Retrieve(FrameLease &lease);
+
+    // Opt-in background capture. A thread dequeues frames continuously and
+    // publishes them into a lock-free ring, PopFrame takes them out without
+    // any mutex. Only one consumer thread may pop and release the leases,
+    // and Grab/Retrieve must not be used meanwhile. Stop ends the thread.
+    bool StartCaptureThread(
+        const CaptureThreadOptions &options = CaptureThreadOptions());
+    bool StopCaptureThread();
+    // non-block, false if no frame is waiting
+    bool PopFrame(FrameLease &lease);
+    CaptureThreadStats GetCaptureThreadStats() const;
+
     // query util
     bool GetControl();
+
+    // Typed access by control id. Values are checked against the range of
+    // the control first, the ranges are queried at Open. Reads of controls
+    // kept current by events are served from the cache without a syscall.
+    bool GetControl(uint32_t id, int32_t &value);
+    bool IsControlCached(uint32_t id) const;
+    bool SetControl(uint32_t id, int32_t value);
+    // all values in one VIDIOC_S_EXT_CTRLS, none is applied if one is out of
+    // range or the driver rejects the batch as a whole
+    bool SetControls(ControlBatch &batch);
+    bool GetControls(ControlBatch &batch);
+    // manual exposure in 100 us units, 0 for auto (aperture priority)
+    bool SetExposure(int32_t exposure);
+    // the old query util, only logs the exposure mode and returns false as
+    // it always did
     bool SetExposure();
 
+    // control id, new value and V4L2_EVENT_CTRL_CH_* flags of what changed
+    using ControlCallback =
+        std::function<void(uint32_t id, int64_t value, uint32_t changes)>;
+    // Called for every control event, the initial values at Open included,
+    // from the thread draining them. Register while no capture runs.
+    // @return handle to remove it
+    uint32_t AddControlCallback(const ControlCallback &cb);
+    bool RemoveControlCallback(uint32_t handle);
+    // Drain pending control events into the cache and the callbacks. The
+    // grab paths, the capture thread and the reactors do so on POLLPRI, own
+    // event loops call it when the fd raises POLLPRI.
+    // @return events drained
+    int ProcessEvents();
+
     int fd() const {
         return cam_fd_;
     }
+    const std::string &dev_name() const { return dev_name_; }
+    // VIDIOC_QUERYCAP bus of the last device opened, kept while closed
+    const std::string &bus_info() const { return bus_info_; }
+    bool IsWorking() const { return working_; }
 
 private:
     bool IsV4l2VideoDevice();
 
-    bool QueryCapability();
+    bool QueryCapability(struct v4l2_capability *cap = nullptr);
+    bool EnumerateModes(std::vector<WebcamMode> &modes);
+    bool RestoreControls(const WebcamSnapshot &snapshot);
+    void InitFormat(uint32_t fourcc, uint32_t width, uint32_t height,
+                    struct v4l2_format &v4l2_fmt) const;
+    bool TryPixFormat(uint32_t fourcc, uint32_t width, uint32_t height,
+                      struct v4l2_format &v4l2_fmt);
+    // keep what S_FMT granted
+    void ApplyFormat(const struct v4l2_format &v4l2_fmt);
     bool SetInput(const char *name = nullptr);
 
+    bool SetBuffers();
     bool SetMMap();
-    bool FreeMMap();
+    bool SetUserPtr();
+    bool FreeBuffers();
+    void ExportDmaBuf(V4l2BufStat *buf_stat);
+    // type, memory, index and the planes or user pointer for QBUF
+    static void PrepareBuffer(V4l2BufStat *buf_stat, uint32_t index,
+                              struct v4l2_buffer &buf);
+    void AdaptBufferCount();
+
+    // every DQBUF/QBUF of a frame goes through these for the bookkeeping,
+    // errno is left to the caller
+    bool DequeueBuffer(struct v4l2_buffer &buf);
+    bool QueueBuffer(struct v4l2_buffer &buf);
+    // DequeueBuffer for the grab paths, honours latest-frame mode
+    bool DequeueFrame(struct v4l2_buffer &buf);
 
     bool StreamOn();
     bool StreamOff();
@@ -128,8 +667,27 @@ private:
 
     static std::string FormatErrno();
     static std::string PixFormatName(uint32_t format);
-    // TODO:
-    bool SetExtControl();
+
+    // query the control ranges into ctrl_ unless done already, and subscribe
+    // to their events
+    bool LoadControls();
+    void SubscribeControls();
+    // a value this handle set, its own changes raise no event
+    void CacheControl(uint32_t id, int32_t value);
+    // poll until a frame is ready, draining control events on the way
+    bool WaitReadable(uint32_t timeout);
+    // record a capture fault in place of error_, logged unless a timeout
+    bool FailCapture(CaptureError code, int sys_errno = 0, uint32_t arg0 = 0,
+                     uint32_t arg1 = 0);
+    std::string FormatCaptureFault() const;
+    // a failed grab or retrieve, a few per second at most
+    void LogGrabError();
+    // known, writable or readable, and the value within range
+    bool CheckControl(uint32_t id, int64_t value, bool write);
+    // for messages, copied under the lock
+    std::string ControlName(uint32_t id);
+    // S or G_EXT_CTRLS of a checked batch
+    bool CommitControls(unsigned long request, ControlBatch &batch);
 
     bool ShowCtrlMenu(struct v4l2_queryctrl *queryctrl);
     bool ShowCtrlInt(struct v4l2_queryctrl *queryctrl);
@@ -137,21 +695,117 @@ private:
 
     void Release();
 
-    bool GrabFrame(std::string &img, uint32_t timeout = 100);
+    // Sinks of CaptureFrame, each takes the dequeued buffer one way
+    struct CopySink;
+    struct DiscardSink;
+    struct CallbackSink;
+    struct LeaseSink;
+    // The one grab and retrieve path: state checks, the wait if block,
+    // DQBUF, the sink and QBUF unless the sink keeps the buffer. Specialized
+    // per sink, so the sink is called directly.
+    template <typename Sink>
+    bool CaptureFrame(Sink &sink, bool block, uint32_t timeout);
+    void FillLease(FrameLease &lease, const struct v4l2_buffer &buf,
+                   const FrameMeta &meta);
+    void DeliverFrame(const struct v4l2_buffer &buf);
+    uint32_t MakePlanes(const struct v4l2_buffer &buf,
+                        FramePlane *planes) const;
+    // planes one after another
+    void CopyFrame(const struct v4l2_buffer &buf, std::string &out) const;
+    static void MakeFrameMeta(const struct v4l2_buffer &buf, uint32_t dropped,
+                              uint32_t skipped, FrameMeta &meta);
+    // capture timestamp to now, the moment the frame is handed out
+    void RecordLatency(const FrameMeta &meta, uint64_t now);
+    bool ReleaseLease(FrameLease &lease);
+
+    struct CaptureThreadState;
+    void CaptureLoop();
+    bool HasRingRoom();
+    void DrainReturns();
 
 private:
+    friend class FrameLease;
+
     bool working_;
+    bool paused_;
     int cam_fd_;
     uint32_t capabilities_;
     uint32_t format_;
 
+    // buffers currently held by leases
+    int leases_;
+    // bumped on every buffer reallocation, stale leases are ignored
+    uint32_t generation_;
+    bool export_dmabuf_;
+    uint32_t memory_; // enum v4l2_memory
+    uint32_t buf_type_; // enum v4l2_buf_type
+    uint32_t sizeimage_;
+    uint32_t num_planes_;
+    struct v4l2_plane_pix_format plane_fmt_[VIDEO_MAX_PLANES];
+    uint32_t color_planes_;
+    WebcamPlaneLayout plane_layout_[VIDEO_MAX_PLANES];
+    std::vector<UserBuffer> user_buffers_;
+
+    uint32_t buffer_count_;
+    uint32_t granted_count_;
+    bool adaptive_buffers_;
+    uint32_t min_buffers_;
+    uint32_t max_buffers_;
+    BufferUsage usage_;
+    StreamMetrics metrics_;
+    // the grab or capture thread poll began, 0 if nobody waits
+    uint64_t wait_begin_us_;
+    bool latest_only_;
+    // drops seen by the last DequeueBuffer
+    uint32_t frame_dropped_;
+    FrameMeta frame_meta_;
+    std::unique_ptr<CaptureThreadState> capture_;
+    // options of the capture thread Pause stopped, for Resume
+    std::unique_ptr<CaptureThreadOptions> paused_capture_;
+
+    // open time, cleared once the stream is on
+    uint64_t setup_begin_us_;
+    uint64_t setup_us_;
+    // setup time of the snapshot restored since the last open
+    uint64_t cold_setup_us_;
+
+    ResumeStats resume_stats_;
+    // time of the last Resume until its first frame
+    uint64_t resume_begin_us_;
+    uint64_t switch_gap_us_;
+
     std::string error_;
+    // the last grab or retrieve, its message is error_ while that is empty
+    struct CaptureFault {
+        CaptureError code = CaptureError::kNone;
+        int sys_errno = 0;
+        // grab, otherwise retrieve
+        bool block = false;
+        // timeout, or leases and buffer count
+        uint32_t args[2] = {0, 0};
+    } capture_fault_;
     std::string dev_name_;
+    // identifies the device in the mode cache
+    std::string device_key_;
+    std::string bus_info_;
     std::shared_ptr<spdlog::logger> logger_;
+    util::LogRateLimit grab_log_;
 
+    // filled at Open, afterwards the capture thread may update the values
+    // and ranges under ctrl_mutex_
     std::map<decltype(V4l2Ctrl::queryctrl.id), V4l2Ctrl> ctrl_;
+    mutable std::mutex ctrl_mutex_;
+    bool ctrl_loaded_;
+    bool ctrl_events_;
+    std::vector<std::pair<uint32_t, ControlCallback>> ctrl_cbs_;
+    uint32_t next_ctrl_cb_;
     std::unique_ptr<V4l2BufStat, V4l2BufStatDeleter> buf_stat_;
     std::function<void(const char *const, uint32_t)> frame_cb_;
+    std::function<void(const char *const, uint32_t, const FrameMeta &)>
+        frame_meta_cb_;
+    std::function<void(const FramePlane *, uint32_t, const FrameMeta &)>
+        frame_planes_cb_;
+    std::shared_ptr<V4l2Io> io_;
 };
 
 } // namespace webcam
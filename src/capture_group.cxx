@@ -0,0 +1,271 @@
+#include "capture_group.h"
+
+#include "spdlog/fmt/bundled/format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace noevil {
+namespace webcam {
+
+CaptureGroup::CaptureGroup(const CaptureGroupOptions &options)
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      running_(false),
+      options_(options),
+      sets_(0),
+      max_spread_us_(0) {
+    if (epoll_fd_ == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    if (options_.max_pending == 0) {
+        close(epoll_fd_);
+        throw std::invalid_argument("max_pending must be at least 1");
+    }
+}
+
+CaptureGroup::~CaptureGroup() {
+    Stop();
+    close(epoll_fd_);
+}
+
+bool CaptureGroup::Add(WebcamV4l2 *cam) {
+    if (running_) {
+        error_ = "can not add a camera while running";
+        return false;
+    }
+
+    if (!cam) {
+        error_ = "camera is required";
+        return false;
+    }
+
+    int fd = cam->fd();
+    if (fd == -1) {
+        error_ = "camera is not open";
+        return false;
+    }
+
+    if (index_.count(fd)) {
+        error_ = fmt::format("fd {} is already added", fd);
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // EPOLLPRI for control events
+    ev.events = EPOLLIN | EPOLLPRI;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        error_ = fmt::format("add fd {} to epoll failure, {} - {}", fd, errno,
+                             strerror(errno));
+        return false;
+    }
+
+    std::unique_ptr<Member> member(new Member);
+    member->cam = cam;
+    index_[fd] = members_.size();
+    members_.push_back(std::move(member));
+    return true;
+}
+
+bool CaptureGroup::Start() {
+    if (running_) {
+        return true;
+    }
+
+    if (members_.empty()) {
+        error_ = "no camera is added";
+        return false;
+    }
+
+    for (size_t i = 0; i < members_.size(); ++i) {
+        auto cam = members_[i]->cam;
+        if (!cam->Start()) {
+            error_ = fmt::format("start camera {} failure, {}", i,
+                                 cam->GetError());
+        } else if (options_.max_pending + 2 > cam->buffer_count()) {
+            // one more lease for the frame retrieved before the oldest is
+            // dropped, and one buffer left in the driver queue
+            error_ = fmt::format("max_pending {} needs {} buffers, camera {} "
+                                 "got {}",
+                                 options_.max_pending,
+                                 options_.max_pending + 2, i,
+                                 cam->buffer_count());
+            cam->Stop();
+        } else {
+            continue;
+        }
+
+        for (size_t j = 0; j < i; ++j) {
+            members_[j]->cam->Stop();
+        }
+        return false;
+    }
+
+    for (auto &member : members_) {
+        member->stats = CameraSkewStats();
+    }
+    sets_ = 0;
+    max_spread_us_ = 0;
+    running_ = true;
+    return true;
+}
+
+bool CaptureGroup::Stop() {
+    if (!running_) {
+        return false;
+    }
+
+    // give the held frames back before the buffers are freed
+    set_.clear();
+    for (auto &member : members_) {
+        member->pending.clear();
+        member->cam->Stop();
+    }
+
+    running_ = false;
+    return true;
+}
+
+int CaptureGroup::Poll(int timeout) {
+    if (!running_) {
+        error_ = "group is not started";
+        return -1;
+    }
+
+    struct epoll_event events[kMaxEvents];
+
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        error_ = fmt::format("epoll_wait failure, {} - {}", errno,
+                             strerror(errno));
+        return -1;
+    }
+
+    for (int i = 0; i < n; ++i) {
+        auto it = index_.find(events[i].data.fd);
+        if (it == index_.end()) {
+            continue;
+        }
+
+        auto &member = *members_[it->second];
+        if (events[i].events & EPOLLPRI) {
+            member.cam->ProcessEvents();
+            if (!(events[i].events & ~EPOLLPRI)) {
+                continue;
+            }
+        }
+
+        FrameLease lease;
+        if (!member.cam->Retrieve(lease)) {
+            continue;
+        }
+
+        ++member.stats.frames;
+        member.pending.push_back(std::move(lease));
+    }
+
+    int sets = Match();
+
+    // the others are lagging too far behind, the oldest frames unmatched
+    // even with this round give way
+    for (auto &member : members_) {
+        while (member->pending.size() > options_.max_pending) {
+            member->pending.pop_front();
+            ++member->stats.dropped;
+        }
+    }
+    return sets;
+}
+
+int CaptureGroup::Match() {
+    int sets = 0;
+    for (;;) {
+        uint64_t newest = 0;
+        for (auto &member : members_) {
+            if (member->pending.empty()) {
+                return sets;
+            }
+            newest = std::max(newest,
+                              member->pending.front().meta().timestamp_us);
+        }
+
+        // a head older than the newest head by more than the tolerance can
+        // never be matched, the frames behind it are only newer
+        bool aligned = true;
+        for (auto &member : members_) {
+            if (member->pending.front().meta().timestamp_us +
+                    options_.tolerance_us <
+                newest) {
+                member->pending.pop_front();
+                ++member->stats.dropped;
+                aligned = false;
+            }
+        }
+
+        if (aligned) {
+            Deliver();
+            ++sets;
+        }
+    }
+}
+
+void CaptureGroup::Deliver() {
+    set_.clear();
+    for (auto &member : members_) {
+        set_.push_back(std::move(member->pending.front()));
+        member->pending.pop_front();
+    }
+
+    int64_t reference = set_[0].meta().timestamp_us;
+    uint64_t oldest = reference;
+    uint64_t newest = reference;
+    for (size_t i = 0; i < set_.size(); ++i) {
+        uint64_t ts = set_[i].meta().timestamp_us;
+        oldest = std::min(oldest, ts);
+        newest = std::max(newest, ts);
+
+        auto &stats = members_[i]->stats;
+        int64_t skew = (int64_t)ts - reference;
+        stats.last_skew_us = skew;
+        if (!stats.matched) {
+            stats.min_skew_us = skew;
+            stats.max_skew_us = skew;
+        } else {
+            stats.min_skew_us = std::min(stats.min_skew_us, skew);
+            stats.max_skew_us = std::max(stats.max_skew_us, skew);
+        }
+        stats.total_skew_us += skew;
+        ++stats.matched;
+    }
+
+    ++sets_;
+    max_spread_us_ = std::max(max_spread_us_, newest - oldest);
+
+    if (handler_) {
+        handler_(set_);
+    }
+    set_.clear();
+}
+
+CaptureGroupStats CaptureGroup::GetStats() const {
+    CaptureGroupStats stats;
+    stats.sets = sets_;
+    stats.max_spread_us = max_spread_us_;
+    for (auto &member : members_) {
+        stats.cameras.push_back(member->stats);
+    }
+    return stats;
+}
+
+} // namespace webcam
+} // namespace noevil
@@ -0,0 +1,172 @@
+#include "capture_reactor.h"
+
+#include "spdlog/fmt/bundled/format.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace noevil {
+namespace webcam {
+
+CaptureReactor::CaptureReactor()
+    : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+      wakeup_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+      stop_(false) {
+    if (epoll_fd_ == -1 || wakeup_fd_ == -1) {
+        std::string err = strerror(errno);
+        if (epoll_fd_ != -1) {
+            close(epoll_fd_);
+        }
+        if (wakeup_fd_ != -1) {
+            close(wakeup_fd_);
+        }
+        throw std::runtime_error(err);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = wakeup_fd_;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &ev);
+}
+
+CaptureReactor::~CaptureReactor() {
+    close(wakeup_fd_);
+    close(epoll_fd_);
+}
+
+bool CaptureReactor::Add(WebcamV4l2 *cam, const FrameHandler &handler,
+                         const DropHandler &on_drop) {
+    if (!cam || !handler) {
+        error_ = "camera and handler are required";
+        return false;
+    }
+
+    int fd = cam->fd();
+    if (fd == -1) {
+        error_ = "camera is not open";
+        return false;
+    }
+
+    if (entries_.count(fd)) {
+        error_ = fmt::format("fd {} is already added", fd);
+        return false;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    // EPOLLPRI for control events
+    ev.events = EPOLLIN | EPOLLPRI;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        error_ = fmt::format("add fd {} to epoll failure, {} - {}", fd, errno,
+                             strerror(errno));
+        return false;
+    }
+
+    entries_[fd] = std::make_shared<Entry>(Entry{cam, handler, on_drop});
+    return true;
+}
+
+bool CaptureReactor::Remove(WebcamV4l2 *cam) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if (it->second->cam == cam) {
+            // the fd may be closed already, which removed it from epoll
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, it->first, nullptr);
+            entries_.erase(it);
+            return true;
+        }
+    }
+
+    error_ = "camera is not added";
+    return false;
+}
+
+int CaptureReactor::Poll(int timeout) {
+    struct epoll_event events[kMaxEvents];
+
+    int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        error_ = fmt::format("epoll_wait failure, {} - {}", errno,
+                             strerror(errno));
+        return -1;
+    }
+
+    int dispatched = 0;
+    FrameLease lease;
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == wakeup_fd_) {
+            uint64_t value;
+            ssize_t r = read(wakeup_fd_, &value, sizeof(value));
+            (void)r;
+            continue;
+        }
+
+        auto it = entries_.find(fd);
+        if (it == entries_.end()) {
+            // removed by an earlier handler of this round
+            continue;
+        }
+
+        // keep the entry alive even if the handler removes it
+        std::shared_ptr<Entry> entry = it->second;
+
+        // level triggered, a broken fd would be reported for ever
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+            entries_.erase(it);
+            if (entry->on_drop) {
+                entry->on_drop(*entry->cam);
+            }
+            continue;
+        }
+
+        if (events[i].events & EPOLLPRI) {
+            entry->cam->ProcessEvents();
+            if (!(events[i].events & ~EPOLLPRI)) {
+                continue;
+            }
+        }
+
+        // level triggered, one frame per camera per round keeps it fair and
+        // a camera with more frames ready is reported again
+        if (!entry->cam->Retrieve(lease)) {
+            continue;
+        }
+
+        entry->handler(*entry->cam, lease);
+        lease.Release();
+        ++dispatched;
+    }
+
+    return dispatched;
+}
+
+void CaptureReactor::Run(int timeout) {
+    while (!stop_) {
+        if (Poll(timeout) == -1) {
+            break;
+        }
+    }
+    stop_ = false;
+}
+
+void CaptureReactor::Stop() {
+    stop_ = true;
+
+    uint64_t value = 1;
+    ssize_t r = write(wakeup_fd_, &value, sizeof(value));
+    (void)r;
+}
+
+} // namespace webcam
+} // namespace noevil
@@ -0,0 +1,288 @@
+#include "device_monitor.h"
+
+#include "spdlog/fmt/bundled/format.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace noevil {
+namespace webcam {
+
+static uint64_t NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static bool IsVideoNode(const char *name) {
+    return strncmp(name, "video", 5) == 0;
+}
+
+DeviceMonitor::DeviceMonitor(const std::string &dir)
+    : inotify_fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+      watch_(-1),
+      dir_(dir) {
+    if (inotify_fd_ == -1) {
+        throw std::runtime_error(strerror(errno));
+    }
+
+    while (dir_.size() > 1 && dir_.back() == '/') {
+        dir_.pop_back();
+    }
+
+    // udev creates the node first and sets its owner and mode afterwards
+    watch_ = inotify_add_watch(inotify_fd_, dir_.data(),
+                               IN_CREATE | IN_ATTRIB | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO);
+    if (watch_ == -1) {
+        std::string err = fmt::format("watch {} failure, {}", dir_,
+                                      strerror(errno));
+        close(inotify_fd_);
+        throw std::runtime_error(err);
+    }
+}
+
+DeviceMonitor::~DeviceMonitor() { close(inotify_fd_); }
+
+bool DeviceMonitor::Add(WebcamV4l2 *cam) {
+    if (!cam) {
+        error_ = "camera is required";
+        return false;
+    }
+
+    if (Find(cam)) {
+        error_ = fmt::format("{} is already added", cam->dev_name());
+        return false;
+    }
+
+    const std::string &name = cam->dev_name();
+    if (name.size() <= dir_.size() + 1 || name.compare(0, dir_.size(), dir_) ||
+        name[dir_.size()] != '/' ||
+        name.find('/', dir_.size() + 1) != std::string::npos) {
+        error_ = fmt::format("{} is not a node in {}", name, dir_);
+        return false;
+    }
+
+    std::unique_ptr<Entry> entry(new Entry);
+    if (!cam->TakeSnapshot(entry->snapshot)) {
+        error_ = fmt::format("snapshot of {} failure, {}", name,
+                             cam->GetError());
+        return false;
+    }
+
+    entry->cam = cam;
+    entry->node = name.substr(dir_.size() + 1);
+    entry->connected = true;
+    entry->streaming = false;
+    entry->lost_us = 0;
+    entries_.push_back(std::move(entry));
+    return true;
+}
+
+bool DeviceMonitor::Update(WebcamV4l2 *cam) {
+    Entry *entry = Find(cam);
+    if (!entry) {
+        error_ = "camera is not added";
+        return false;
+    }
+
+    if (!entry->connected) {
+        error_ = fmt::format("{} is disconnected", cam->dev_name());
+        return false;
+    }
+
+    if (!cam->TakeSnapshot(entry->snapshot)) {
+        error_ = fmt::format("snapshot of {} failure, {}", cam->dev_name(),
+                             cam->GetError());
+        return false;
+    }
+    return true;
+}
+
+bool DeviceMonitor::Remove(WebcamV4l2 *cam) {
+    for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+        if ((*it)->cam == cam) {
+            entries_.erase(it);
+            return true;
+        }
+    }
+
+    error_ = "camera is not added";
+    return false;
+}
+
+int DeviceMonitor::Poll(int timeout) {
+    struct pollfd pfd;
+    pfd.fd = inotify_fd_;
+    pfd.events = POLLIN;
+
+    int r = poll(&pfd, 1, timeout);
+    if (r == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        error_ = fmt::format("poll failure, {} - {}", errno, strerror(errno));
+        return -1;
+    }
+    if (!r) {
+        return 0;
+    }
+
+    // video nodes created or changed, in order of appearance
+    std::vector<std::string> nodes;
+    bool overflow = false;
+
+    alignas(struct inotify_event) char buf[4096];
+    for (;;) {
+        ssize_t len = read(inotify_fd_, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+
+        for (char *p = buf; p < buf + len;) {
+            auto ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+            if (!ev->len || !IsVideoNode(ev->name)) {
+                continue;
+            }
+
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                for (auto &entry : entries_) {
+                    if (entry->connected && entry->node == ev->name) {
+                        Lost(*entry);
+                    }
+                }
+            } else if (std::find(nodes.begin(), nodes.end(), ev->name) ==
+                       nodes.end()) {
+                nodes.push_back(ev->name);
+            }
+        }
+    }
+
+    // events were lost, any node may be new
+    if (overflow) {
+        DIR *d = opendir(dir_.data());
+        if (d) {
+            while (struct dirent *de = readdir(d)) {
+                if (IsVideoNode(de->d_name) &&
+                    std::find(nodes.begin(), nodes.end(), de->d_name) ==
+                        nodes.end()) {
+                    nodes.push_back(de->d_name);
+                }
+            }
+            closedir(d);
+        }
+    }
+
+    int reconnected = 0;
+    for (auto &entry : entries_) {
+        if (entry->connected) {
+            continue;
+        }
+        for (auto &node : nodes) {
+            if (TryReconnect(*entry, node)) {
+                ++reconnected;
+                break;
+            }
+        }
+    }
+    return reconnected;
+}
+
+void DeviceMonitor::Lost(Entry &entry) {
+    entry.connected = false;
+    entry.streaming = entry.cam->IsWorking();
+    entry.lost_us = NowUs();
+    ++entry.stats.removals;
+
+    // the device is gone, what changed since the snapshot is only known
+    // from the event-kept cache, which Close drops
+    for (auto &ctrl : entry.snapshot.controls) {
+        if (entry.cam->IsControlCached(ctrl.first)) {
+            entry.cam->GetControl(ctrl.first, ctrl.second);
+        }
+    }
+
+    // give the stale buffers and fd back right away
+    entry.cam->Stop();
+    entry.cam->Close();
+
+    if (handler_) {
+        handler_(*entry.cam, false);
+    }
+}
+
+bool DeviceMonitor::TryReconnect(Entry &entry, const std::string &node) {
+    // the node of another camera still in use
+    for (auto &other : entries_) {
+        if (other->connected && other->node == node) {
+            return false;
+        }
+    }
+
+    // nodes of other devices plugged in meanwhile are no attempt
+    std::string path = dir_ + "/" + node;
+    std::string bus_info;
+    if (!entry.cam->QueryBusInfo(path.data(), bus_info) ||
+        bus_info != entry.snapshot.bus_info) {
+        return false;
+    }
+
+    if (!entry.cam->Reconnect(path.data(), entry.snapshot, entry.streaming)) {
+        ++entry.stats.failures;
+        error_ = fmt::format("reconnect {} on {} failure, {}",
+                             entry.snapshot.bus_info, path,
+                             entry.cam->GetError());
+        return false;
+    }
+
+    auto &stats = entry.stats;
+    uint64_t recovery = NowUs() - entry.lost_us;
+    ++stats.reconnects;
+    stats.last_recovery_us = recovery;
+    stats.max_recovery_us = std::max(stats.max_recovery_us, recovery);
+    stats.total_recovery_us += recovery;
+
+    entry.node = node;
+    entry.connected = true;
+
+    if (handler_) {
+        handler_(*entry.cam, true);
+    }
+    return true;
+}
+
+bool DeviceMonitor::IsConnected(const WebcamV4l2 *cam) const {
+    Entry *entry = Find(cam);
+    return entry && entry->connected;
+}
+
+ReconnectStats DeviceMonitor::GetStats(const WebcamV4l2 *cam) const {
+    Entry *entry = Find(cam);
+    return entry ? entry->stats : ReconnectStats();
+}
+
+DeviceMonitor::Entry *DeviceMonitor::Find(const WebcamV4l2 *cam) const {
+    for (auto &entry : entries_) {
+        if (entry->cam == cam) {
+            return entry.get();
+        }
+    }
+    return nullptr;
+}
+
+} // namespace webcam
+} // namespace noevil
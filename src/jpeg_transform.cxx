@@ -1,4 +1,5 @@
 #include "jpeg_transform.h"
+#include "trace.h"
 
 #include <cstring>
 #include <stdexcept>
@@ -42,6 +43,7 @@ JpegTransform::~JpegTransform() {
 
 bool JpegTransform::Transform(unsigned char *jpeg_buf, unsigned long jpeg_size,
                               std::string &out) {
+    util::TraceScope trace("jpeg transform");
     if (xtrans_.op == TJXOP_NONE) {
         return false;
     }
@@ -29,8 +29,10 @@
  * SOFTWARE.
  */
 #include "log.h"
+#include "spdlog/async.h"
 #include "spdlog/sinks/rotating_file_sink.h"
 
+#include <chrono>
 #include <iostream>
 #include <string>
 
@@ -40,11 +42,17 @@ namespace util {
 static std::shared_ptr<spdlog::sinks::rotating_file_sink_mt> log_sink_ =
     nullptr;
 static spdlog::level::level_enum level_ = spdlog::level::info;
+static bool async_ = false;
 
-void Init(const std::string &log_path, int size, int count) {
+void Init(const std::string &log_path, int size, int count, bool async,
+          size_t queue_size) {
     if (!log_sink_) {
         log_sink_ = std::make_shared<spdlog::sinks::rotating_file_sink_mt>(
             log_path, size, count);
+        if (async) {
+            spdlog::init_thread_pool(queue_size, 1);
+            async_ = true;
+        }
     }
 }
 
@@ -60,7 +68,14 @@ Logger GetLogger(const std::string &name) {
 
     auto logger = spdlog::get(name);
     if (!logger) {
-        logger = std::make_shared<spdlog::logger>(name, log_sink_);
+        if (async_) {
+            // flushes run on the pool thread as well
+            logger = std::make_shared<spdlog::async_logger>(
+                name, log_sink_, spdlog::thread_pool(),
+                spdlog::async_overflow_policy::overrun_oldest);
+        } else {
+            logger = std::make_shared<spdlog::logger>(name, log_sink_);
+        }
         logger->set_pattern("%Y-%m-%d %T.%e %P.%t [%l] %n - %v");
         logger->set_level(level_);
         logger->flush_on(level_);
@@ -69,5 +84,36 @@ Logger GetLogger(const std::string &name) {
     return logger;
 }
 
+static uint64_t NowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+LogRateLimit::LogRateLimit(uint32_t burst, uint32_t interval_ms)
+    : burst_(burst),
+      interval_us_(interval_ms * 1000ull),
+      window_us_(0),
+      passed_(0),
+      suppressed_(0) {}
+
+bool LogRateLimit::Allow(uint32_t &suppressed) {
+    uint64_t now = NowUs();
+    if (!window_us_ || now - window_us_ >= interval_us_) {
+        window_us_ = now;
+        passed_ = 0;
+    }
+
+    if (passed_ >= burst_) {
+        ++suppressed_;
+        return false;
+    }
+
+    ++passed_;
+    suppressed = suppressed_;
+    suppressed_ = 0;
+    return true;
+}
+
 } // namespace util
 } // namespace noevil
@@ -0,0 +1,377 @@
+#include "metrics_exporter.h"
+
+#include "device_monitor.h"
+#include "spdlog/fmt/bundled/format.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace noevil {
+namespace webcam {
+
+namespace {
+
+// for a whole request, reading it and sending the response
+const int kServeTimeoutMs = 200;
+// so a burst of scrapes does not hold up the cameras either
+const int kMaxServedPerPoll = 8;
+
+uint64_t NowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+// false once the deadline has passed
+bool WaitFor(int fd, short events, uint64_t deadline) {
+    uint64_t now = NowMs();
+    if (now >= deadline) {
+        return false;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    int r = poll(&pfd, 1, deadline - now);
+    return r > 0 || (r == -1 && errno == EINTR);
+}
+
+struct Sample {
+    std::string labels;
+    bool up;
+    uint32_t buffers;
+    StreamStats stats;
+    ReconnectStats reconnect;
+};
+
+std::string EscapeLabel(const std::string &value) {
+    std::string out;
+    out.reserve(value.size());
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+void Family(std::string &out, const char *name, const char *type,
+            const char *help) {
+    out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+// one line per camera
+template <typename Value>
+void Metric(std::string &out, const std::vector<Sample> &samples,
+            const char *name, const char *type, const char *help,
+            Value value) {
+    Family(out, name, type, help);
+    for (auto &sample : samples) {
+        out += fmt::format("{}{{{}}} {}\n", name, sample.labels,
+                           value(sample));
+    }
+}
+
+template <typename Summary>
+void Quantiles(std::string &out, const std::vector<Sample> &samples,
+               const char *name, const char *help, Summary summary) {
+    Family(out, name, "summary", help);
+    for (auto &sample : samples) {
+        const LatencySummary &s = summary(sample);
+        const std::pair<const char *, uint64_t> quantiles[] = {
+            {"0.5", s.p50_us}, {"0.99", s.p99_us}, {"0.999", s.p999_us}};
+        for (auto &q : quantiles) {
+            out += fmt::format("{}{{{},quantile=\"{}\"}} {}\n", name,
+                               sample.labels, q.first, q.second / 1e6);
+        }
+        out += fmt::format("{}_sum{{{}}} {}\n", name, sample.labels,
+                           s.sum_us / 1e6);
+        out += fmt::format("{}_count{{{}}} {}\n", name, sample.labels,
+                           s.count);
+    }
+}
+
+} // namespace
+
+MetricsExporter::MetricsExporter()
+    : listen_fd_(-1), port_(0), monitor_(nullptr) {}
+
+MetricsExporter::~MetricsExporter() {
+    if (listen_fd_ != -1) {
+        close(listen_fd_);
+    }
+}
+
+bool MetricsExporter::Add(WebcamV4l2 *cam) {
+    if (!cam) {
+        error_ = "camera is required";
+        return false;
+    }
+
+    for (auto added : cams_) {
+        if (added == cam) {
+            error_ = fmt::format("{} is already added", cam->dev_name());
+            return false;
+        }
+    }
+
+    cams_.push_back(cam);
+    return true;
+}
+
+bool MetricsExporter::Remove(WebcamV4l2 *cam) {
+    for (auto it = cams_.begin(); it != cams_.end(); ++it) {
+        if (*it == cam) {
+            cams_.erase(it);
+            return true;
+        }
+    }
+
+    error_ = "camera is not added";
+    return false;
+}
+
+std::string MetricsExporter::Render() const {
+    std::vector<Sample> samples;
+    samples.reserve(cams_.size());
+    for (auto cam : cams_) {
+        Sample sample;
+        // the node changes on reconnect, the bus stays
+        sample.labels = fmt::format("device=\"{}\",bus_info=\"{}\"",
+                                    EscapeLabel(cam->dev_name()),
+                                    EscapeLabel(cam->bus_info()));
+        sample.up = cam->IsWorking();
+        sample.buffers = cam->buffer_count();
+        sample.stats = cam->GetStreamStats();
+        if (monitor_) {
+            sample.reconnect = monitor_->GetStats(cam);
+        }
+        samples.push_back(std::move(sample));
+    }
+
+    std::string out;
+    Metric(out, samples, "webcam_up", "gauge", "Whether the camera streams.",
+           [](const Sample &s) { return s.up ? 1 : 0; });
+    Metric(out, samples, "webcam_frames_total", "counter",
+           "Frames dequeued since the stream started.",
+           [](const Sample &s) { return s.stats.frames; });
+    Metric(out, samples, "webcam_fps", "gauge",
+           "Frame rate measured from the capture timestamps.",
+           [](const Sample &s) { return s.stats.fps; });
+    Metric(out, samples, "webcam_jitter_seconds", "gauge",
+           "Smoothed deviation of one frame interval from the one before.",
+           [](const Sample &s) { return s.stats.jitter_us / 1e6; });
+    Metric(out, samples, "webcam_dropped_frames_total", "counter",
+           "Sequence gaps, frames the driver had no buffer for.",
+           [](const Sample &s) { return s.stats.dropped; });
+    Metric(out, samples, "webcam_error_frames_total", "counter",
+           "Buffers flagged V4L2_BUF_FLAG_ERROR.",
+           [](const Sample &s) { return s.stats.errors; });
+    Metric(out, samples, "webcam_bytes_total", "counter",
+           "Payload dequeued since the stream started.",
+           [](const Sample &s) { return s.stats.bytes; });
+    Metric(out, samples, "webcam_bytes_per_second", "gauge",
+           "Payload rate, the mean frame size times fps.",
+           [](const Sample &s) { return s.stats.bytes_per_second; });
+    Metric(out, samples, "webcam_buffers", "gauge",
+           "Buffers granted by the driver.",
+           [](const Sample &s) { return s.buffers; });
+    Metric(out, samples, "webcam_buffers_out", "gauge",
+           "Buffers dequeued and not requeued yet.",
+           [](const Sample &s) { return s.stats.buffers_out; });
+    Quantiles(out, samples, "webcam_frame_latency_seconds",
+              "Capture timestamp until the frame is handed out.",
+              [](const Sample &s) -> const LatencySummary & {
+                  return s.stats.latency;
+              });
+    Quantiles(out, samples, "webcam_poll_wait_seconds",
+              "Poll until a frame is ready.",
+              [](const Sample &s) -> const LatencySummary & {
+                  return s.stats.wait;
+              });
+    Quantiles(out, samples, "webcam_buffer_hold_seconds",
+              "VIDIOC_DQBUF until VIDIOC_QBUF.",
+              [](const Sample &s) -> const LatencySummary & {
+                  return s.stats.hold;
+              });
+
+    if (monitor_) {
+        Metric(out, samples, "webcam_removals_total", "counter",
+               "Times the device node went away.",
+               [](const Sample &s) { return s.reconnect.removals; });
+        Metric(out, samples, "webcam_reconnects_total", "counter",
+               "Times the camera was brought back.",
+               [](const Sample &s) { return s.reconnect.reconnects; });
+        Metric(out, samples, "webcam_reconnect_failures_total", "counter",
+               "Reconnect attempts that failed.",
+               [](const Sample &s) { return s.reconnect.failures; });
+    }
+    return out;
+}
+
+bool MetricsExporter::WriteTextfile(const std::string &path) {
+    std::string text = Render();
+    std::string tmp = path + ".tmp";
+
+    FILE *fp = fopen(tmp.data(), "w");
+    if (!fp) {
+        error_ = fmt::format("open {} failure, {} - {}", tmp, errno,
+                             strerror(errno));
+        return false;
+    }
+
+    bool ok = fwrite(text.data(), 1, text.size(), fp) == text.size();
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp.data(), path.data()) == -1) {
+        error_ = fmt::format("write {} failure, {} - {}", path, errno,
+                             strerror(errno));
+        unlink(tmp.data());
+        return false;
+    }
+    return true;
+}
+
+bool MetricsExporter::Listen(const std::string &address, uint16_t port) {
+    if (listen_fd_ != -1) {
+        error_ = fmt::format("already listening on port {}", port_);
+        return false;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.data(), &addr.sin_addr) != 1) {
+        error_ = fmt::format("{} is no IPv4 address", address);
+        return false;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        error_ = fmt::format("socket failure, {} - {}", errno, strerror(errno));
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, 16) == -1 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) == -1) {
+        error_ = fmt::format("listen on {}:{} failure, {} - {}", address,
+                             port, errno, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    listen_fd_ = fd;
+    port_ = ntohs(addr.sin_port);
+    return true;
+}
+
+int MetricsExporter::Poll(int timeout) {
+    if (listen_fd_ == -1) {
+        error_ = "not listening";
+        return -1;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = listen_fd_;
+    pfd.events = POLLIN;
+
+    int r = poll(&pfd, 1, timeout);
+    if (r == -1) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        error_ = fmt::format("poll failure, {} - {}", errno, strerror(errno));
+        return -1;
+    }
+
+    int served = 0;
+    while (r && served < kMaxServedPerPoll) {
+        int fd = accept4(listen_fd_, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            break;
+        }
+        Serve(fd);
+        close(fd);
+        ++served;
+    }
+    return served;
+}
+
+void MetricsExporter::Serve(int fd) {
+    // one deadline for the whole exchange, a client trickling bytes must
+    // not hold up the cameras either
+    uint64_t deadline = NowMs() + kServeTimeoutMs;
+
+    // only the request line and the end of the header matter
+    char buf[2048];
+    size_t len = 0;
+    while (len < sizeof(buf) - 1 && WaitFor(fd, POLLIN, deadline)) {
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "\r\n\r\n") || strstr(buf, "\n\n")) {
+            break;
+        }
+    }
+    buf[len] = '\0';
+
+    const char *status = "404 Not Found";
+    std::string body = "not found\n";
+    if (strncmp(buf, "GET ", 4) != 0) {
+        status = "405 Method Not Allowed";
+        body = "method not allowed\n";
+    } else if (strncmp(buf + 4, "/metrics", 8) == 0 &&
+               (buf[12] == ' ' || buf[12] == '?')) {
+        status = "200 OK";
+        body = Render();
+    }
+
+    std::string response = fmt::format(
+        "HTTP/1.1 {}\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: {}\r\n"
+        "Connection: close\r\n\r\n",
+        status, body.size());
+    response += body;
+
+    for (size_t sent = 0;
+         sent < response.size() && WaitFor(fd, POLLOUT, deadline);) {
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+}
+
+} // namespace webcam
+} // namespace noevil
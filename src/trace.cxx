@@ -0,0 +1,208 @@
+#include "trace.h"
+
+#include "spdlog/fmt/fmt.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace noevil {
+namespace util {
+
+namespace {
+
+// Fields are relaxed atomics, so TraceJson may read a slot the owner is
+// overwriting. Slots older than the position read afterwards minus the
+// capacity are not trusted.
+struct TraceSlot {
+    // nanoseconds << 1 | end
+    std::atomic<uint64_t> ts_end;
+    std::atomic<const char *> name;
+    std::atomic<int64_t> frame;
+};
+
+struct TraceBuffer {
+    explicit TraceBuffer(size_t capacity)
+        : slots(new TraceSlot[capacity]),
+          mask(capacity - 1),
+          pos(0),
+          begin(0),
+          tid(syscall(SYS_gettid)),
+          thread_name(nullptr),
+          frame(kTraceNoFrame) {}
+
+    std::unique_ptr<TraceSlot[]> slots;
+    size_t mask;
+    // written by the owner thread only
+    std::atomic<uint64_t> pos;
+    // first position not cleared
+    std::atomic<uint64_t> begin;
+    long tid;
+    std::atomic<const char *> thread_name;
+    // owner thread only
+    int64_t frame;
+};
+
+std::mutex buffers_mutex;
+std::vector<std::shared_ptr<TraceBuffer>> buffers;
+size_t buffer_capacity = 1 << 16;
+
+thread_local std::shared_ptr<TraceBuffer> thread_buffer;
+
+TraceBuffer &ThreadBuffer() {
+    if (!thread_buffer) {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        thread_buffer = std::make_shared<TraceBuffer>(buffer_capacity);
+        buffers.push_back(thread_buffer);
+    }
+    return *thread_buffer;
+}
+
+uint64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+size_t RoundUp(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+} // namespace
+
+namespace detail {
+
+std::atomic<bool> trace_on(false);
+
+void TraceEvent(const char *name, int64_t frame, bool end) {
+    TraceBuffer &buf = ThreadBuffer();
+    uint64_t pos = buf.pos.load(std::memory_order_relaxed);
+    TraceSlot &slot = buf.slots[pos & buf.mask];
+    slot.ts_end.store(NowNs() << 1 | end, std::memory_order_relaxed);
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.frame.store(frame, std::memory_order_relaxed);
+    buf.pos.store(pos + 1, std::memory_order_release);
+}
+
+void SetTraceFrame(int64_t frame) { ThreadBuffer().frame = frame; }
+
+int64_t TraceFrame() { return ThreadBuffer().frame; }
+
+} // namespace detail
+
+void EnableTrace(bool enable, size_t events_per_thread) {
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        buffer_capacity = RoundUp(std::max<size_t>(events_per_thread, 2));
+    }
+    detail::trace_on.store(enable, std::memory_order_relaxed);
+}
+
+void SetTraceThreadName(const char *name) {
+    if (TraceEnabled()) {
+        ThreadBuffer().thread_name.store(name, std::memory_order_relaxed);
+    }
+}
+
+std::string TraceJson() {
+    std::vector<std::shared_ptr<TraceBuffer>> copy;
+    {
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        copy = buffers;
+    }
+
+    long pid = getpid();
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (auto &buf : copy) {
+        if (const char *name =
+                buf->thread_name.load(std::memory_order_relaxed)) {
+            out += fmt::format("{}{{\"name\":\"thread_name\",\"ph\":\"M\","
+                               "\"pid\":{},\"tid\":{},\"args\":{{\"name\":"
+                               "\"{}\"}}}}",
+                               first ? "" : ",\n", pid, buf->tid, name);
+            first = false;
+        }
+
+        uint64_t end = buf->pos.load(std::memory_order_acquire);
+        uint64_t capacity = buf->mask + 1;
+        uint64_t begin = std::max(buf->begin.load(std::memory_order_relaxed),
+                                  end > capacity ? end - capacity : 0);
+
+        struct Event {
+            uint64_t ts_end;
+            const char *name;
+            int64_t frame;
+        };
+        std::vector<Event> events;
+        events.reserve(end > begin ? end - begin : 0);
+        for (uint64_t pos = begin; pos < end; ++pos) {
+            TraceSlot &slot = buf->slots[pos & buf->mask];
+            events.push_back({slot.ts_end.load(std::memory_order_relaxed),
+                              slot.name.load(std::memory_order_relaxed),
+                              slot.frame.load(std::memory_order_relaxed)});
+        }
+
+        // drop the slots the owner may have overwritten meanwhile
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t now = buf->pos.load(std::memory_order_relaxed);
+        uint64_t valid = now > capacity ? now - capacity : 0;
+        size_t skip = valid > begin ? std::min<uint64_t>(valid - begin,
+                                                         events.size())
+                                    : 0;
+
+        for (size_t i = skip; i < events.size(); ++i) {
+            auto &ev = events[i];
+            out += fmt::format("{}{{\"name\":\"{}\",\"ph\":\"{}\","
+                               "\"ts\":{:.3f},\"pid\":{},\"tid\":{}",
+                               first ? "" : ",\n", ev.name,
+                               ev.ts_end & 1 ? 'E' : 'B',
+                               (ev.ts_end >> 1) / 1000.0, pid, buf->tid);
+            if (ev.frame != kTraceNoFrame) {
+                out += fmt::format(",\"args\":{{\"frame\":{}}}", ev.frame);
+            }
+            out += '}';
+            first = false;
+        }
+    }
+    out += "]}\n";
+    return out;
+}
+
+bool DumpTrace(const std::string &path) {
+    std::string json = TraceJson();
+    FILE *fp = fopen(path.data(), "w");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fwrite(json.data(), 1, json.size(), fp) == json.size();
+    return fclose(fp) == 0 && ok;
+}
+
+void ClearTrace() {
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    for (auto it = buffers.begin(); it != buffers.end();) {
+        // the thread is gone
+        if (it->use_count() == 1) {
+            it = buffers.erase(it);
+            continue;
+        }
+        auto &buf = **it;
+        buf.begin.store(buf.pos.load(std::memory_order_acquire),
+                        std::memory_order_relaxed);
+        ++it;
+    }
+}
+
+} // namespace util
+} // namespace noevil
@@ -0,0 +1,1250 @@
+#include "v4l2_fake_device.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace noevil {
+namespace webcam {
+
+static constexpr uint32_t FAKE_MAX_BUFFERS = 32;
+static constexpr uint32_t FAKE_PAGE_SIZE = 4096;
+
+// @return planes, each with its own memory
+static uint32_t PlaneSizes(uint32_t fourcc, uint32_t width, uint32_t height,
+                           struct v4l2_plane_pix_format *planes) {
+    switch (fourcc) {
+    case V4L2_PIX_FMT_GREY:
+        planes[0].bytesperline = width;
+        planes[0].sizeimage = width * height;
+        return 1;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_Y16:
+        planes[0].bytesperline = width * 2;
+        planes[0].sizeimage = width * height * 2;
+        return 1;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+        planes[0].bytesperline = width * 3;
+        planes[0].sizeimage = width * height * 3;
+        return 1;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        planes[0].bytesperline = width;
+        planes[0].sizeimage = width * height * 3 / 2;
+        return 1;
+    case V4L2_PIX_FMT_NV12M:
+        planes[0].bytesperline = width;
+        planes[0].sizeimage = width * height;
+        planes[1].bytesperline = width;
+        planes[1].sizeimage = width * height / 2;
+        return 2;
+    case V4L2_PIX_FMT_YUV420M:
+        planes[0].bytesperline = width;
+        planes[0].sizeimage = width * height;
+        planes[1].bytesperline = width / 2;
+        planes[1].sizeimage = width * height / 4;
+        planes[2].bytesperline = width / 2;
+        planes[2].sizeimage = width * height / 4;
+        return 3;
+    default:
+        // compressed
+        planes[0].bytesperline = 0;
+        planes[0].sizeimage = width * height * 2;
+        return 1;
+    }
+}
+
+static uint32_t PageAlign(uint32_t size) {
+    return (size + FAKE_PAGE_SIZE - 1) / FAKE_PAGE_SIZE * FAKE_PAGE_SIZE;
+}
+
+static const char *const kExposureMenu[] = {"Auto Mode", "Manual Mode",
+                                           "Shutter Priority Mode",
+                                           "Aperture Priority Mode"};
+
+static struct v4l2_queryctrl MakeQueryCtrl(uint32_t id, uint32_t type,
+                                           const char *name, int32_t minimum,
+                                           int32_t maximum, int32_t step,
+                                           int32_t default_value) {
+    struct v4l2_queryctrl queryctrl;
+    memset(&queryctrl, 0, sizeof(queryctrl));
+    queryctrl.id = id;
+    queryctrl.type = type;
+    strncpy((char *)queryctrl.name, name, sizeof(queryctrl.name) - 1);
+    queryctrl.minimum = minimum;
+    queryctrl.maximum = maximum;
+    queryctrl.step = step;
+    queryctrl.default_value = default_value;
+    return queryctrl;
+}
+
+static bool IsCompressed(uint32_t fourcc) {
+    return fourcc == V4L2_PIX_FMT_MJPEG || fourcc == V4L2_PIX_FMT_H264;
+}
+
+V4l2FakeDevice::V4l2FakeDevice()
+    : card_("Fake Camera"),
+      bus_info_("fake:0"),
+      modes_({{V4L2_PIX_FMT_YUYV, 640, 480, 30},
+              {V4L2_PIX_FMT_YUYV, 1280, 720, 10},
+              {V4L2_PIX_FMT_MJPEG, 640, 480, 30},
+              {V4L2_PIX_FMT_MJPEG, 1920, 1080, 30}}),
+      expbuf_(true),
+      enum_delay_us_(0),
+      ctrl_events_(false),
+      type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+      present_(true),
+      fd_(-1),
+      peer_fd_(-1),
+      readable_(false),
+      priority_(false),
+      streaming_(false),
+      input_(0),
+      num_planes_(1),
+      memory_(V4L2_MEMORY_MMAP),
+      sequence_(0),
+      dropped_(0),
+      control_ioctls_(0),
+      event_sequence_(0),
+      ts_offset_us_(0),
+      ts_jitter_us_(0),
+      ts_seed_(1) {
+    memset(&pix_, 0, sizeof(pix_));
+    memset(plane_fmt_, 0, sizeof(plane_fmt_));
+    timeperframe_.numerator = 1;
+    timeperframe_.denominator = 30;
+
+    struct v4l2_queryctrl ctrls[] = {
+        MakeQueryCtrl(V4L2_CID_BRIGHTNESS, V4L2_CTRL_TYPE_INTEGER,
+                      "Brightness", -64, 64, 1, 0),
+        MakeQueryCtrl(V4L2_CID_CONTRAST, V4L2_CTRL_TYPE_INTEGER, "Contrast",
+                      0, 100, 1, 50),
+        MakeQueryCtrl(V4L2_CID_AUTO_WHITE_BALANCE, V4L2_CTRL_TYPE_BOOLEAN,
+                      "White Balance Temperature, Auto", 0, 1, 1, 1),
+        MakeQueryCtrl(V4L2_CID_GAIN, V4L2_CTRL_TYPE_INTEGER, "Gain", 0, 100,
+                      1, 0),
+        MakeQueryCtrl(V4L2_CID_WHITE_BALANCE_TEMPERATURE,
+                      V4L2_CTRL_TYPE_INTEGER, "White Balance Temperature",
+                      2800, 6500, 10, 4600),
+        MakeQueryCtrl(V4L2_CID_EXPOSURE_AUTO, V4L2_CTRL_TYPE_MENU,
+                      "Exposure, Auto", 0, 3, 1,
+                      V4L2_EXPOSURE_APERTURE_PRIORITY),
+        MakeQueryCtrl(V4L2_CID_EXPOSURE_ABSOLUTE, V4L2_CTRL_TYPE_INTEGER,
+                      "Exposure (Absolute)", 3, 2047, 1, 250),
+    };
+    for (auto &queryctrl : ctrls) {
+        controls_.push_back({queryctrl, queryctrl.default_value});
+    }
+}
+
+V4l2FakeDevice::~V4l2FakeDevice() {
+    if (fd_ != -1) {
+        Close(fd_);
+    }
+}
+
+int V4l2FakeDevice::Produce(int count) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    int delivered = 0;
+    for (int i = 0; i < count && streaming_; ++i) {
+        uint32_t sequence = sequence_++;
+        if (queued_.empty()) {
+            ++dropped_;
+            continue;
+        }
+
+        uint32_t index = queued_.front();
+        queued_.pop_front();
+
+        Buffer &buffer = buffers_[index];
+        struct v4l2_buffer &buf = buffer.buf;
+
+        // stamp the sequence so consumers can tell frames apart
+        if (buffer.plane[0].mem && buffer.plane[0].length >= sizeof(sequence)) {
+            memcpy(buffer.plane[0].mem, &sequence, sizeof(sequence));
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        int64_t ts_us = ts.tv_sec * 1000000ll + ts.tv_nsec / 1000;
+        ts_us += ts_offset_us_;
+        if (ts_jitter_us_) {
+            ts_us += (int64_t)(rand_r(&ts_seed_) % (2 * ts_jitter_us_ + 1)) -
+                     ts_jitter_us_;
+        }
+
+        bool compressed = IsCompressed(pix_.pixelformat);
+        if (IsMultiPlanar()) {
+            for (uint32_t p = 0; p < buffer.num_planes; ++p) {
+                uint32_t size = plane_fmt_[p].sizeimage;
+                buffer.planes[p].bytesused = compressed ? size / 8 : size;
+                buffer.planes[p].data_offset = 0;
+            }
+        } else {
+            buf.bytesused = compressed ? pix_.sizeimage / 8 : pix_.sizeimage;
+        }
+        buf.flags = V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+                    V4L2_BUF_FLAG_TSTAMP_SRC_SOE;
+        buf.field = V4L2_FIELD_NONE;
+        buf.sequence = sequence;
+        buf.timestamp.tv_sec = ts_us / 1000000;
+        buf.timestamp.tv_usec = ts_us % 1000000;
+
+        done_.push_back(index);
+        SetReadable(true);
+        ++delivered;
+    }
+
+    return delivered;
+}
+
+int V4l2FakeDevice::Stat(const char *path, struct stat *st) {
+    if (!present_ || (!node_.empty() && node_ != path)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    memset(st, 0, sizeof(*st));
+    st->st_mode = S_IFCHR | 0660;
+    return 0;
+}
+
+int V4l2FakeDevice::Open(const char *path, int /*flags*/) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!present_ || (!node_.empty() && node_ != path)) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (fd_ != -1) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    readable_ = false;
+    priority_ = false;
+    if (!ctrl_events_ || !OpenSocket()) {
+        fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    return fd_;
+}
+
+bool V4l2FakeDevice::OpenSocket() {
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        return false;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int peer = -1;
+    int fd = -1;
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        listen(listen_fd, 1) == 0 &&
+        getsockname(listen_fd, (struct sockaddr *)&addr, &len) == 0) {
+        peer = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (peer != -1 &&
+            connect(peer, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            fd = accept4(listen_fd, nullptr, nullptr,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        }
+    }
+    close(listen_fd);
+
+    if (fd == -1) {
+        if (peer != -1) {
+            close(peer);
+        }
+        return false;
+    }
+
+    // every byte has to be there before Produce returns
+    int one = 1;
+    setsockopt(peer, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fd_ = fd;
+    peer_fd_ = peer;
+    return true;
+}
+
+int V4l2FakeDevice::Close(int fd) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (fd != fd_ || fd_ == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    StreamOff();
+    FreeBuffers();
+    subscribed_.clear();
+    events_.clear();
+
+    close(fd_);
+    fd_ = -1;
+    if (peer_fd_ != -1) {
+        close(peer_fd_);
+        peer_fd_ = -1;
+    }
+    return 0;
+}
+
+int V4l2FakeDevice::Ioctl(int fd, unsigned long request, void *arg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (fd != fd_ || fd_ == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (!present_) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    int err = DoIoctl(request, arg);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void *V4l2FakeDevice::MMap(size_t length, int prot, int flags, int fd,
+                           off_t offset) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (fd != fd_ || fd_ == -1) {
+        errno = EBADF;
+        return MAP_FAILED;
+    }
+
+    if (!present_) {
+        errno = ENODEV;
+        return MAP_FAILED;
+    }
+
+    for (auto &buffer : buffers_) {
+        for (uint32_t p = 0; p < buffer.num_planes; ++p) {
+            auto &plane = buffer.plane[p];
+            if (plane.memfd != -1 && plane.offset == offset &&
+                length <= plane.length) {
+                return mmap(nullptr, length, prot, flags, plane.memfd, 0);
+            }
+        }
+    }
+
+    errno = EINVAL;
+    return MAP_FAILED;
+}
+
+int V4l2FakeDevice::MUnmap(void *addr, size_t length) {
+    return munmap(addr, length);
+}
+
+int V4l2FakeDevice::DoIoctl(unsigned long request, void *arg) {
+    if (enum_delay_us_ &&
+        (request == VIDIOC_ENUMINPUT || request == VIDIOC_ENUM_FMT ||
+         request == VIDIOC_ENUM_FRAMESIZES ||
+         request == VIDIOC_ENUM_FRAMEINTERVALS)) {
+        usleep(enum_delay_us_);
+    }
+
+    switch (request) {
+    case VIDIOC_QUERYCAP:
+        return QueryCap((struct v4l2_capability *)arg);
+
+    case VIDIOC_ENUMINPUT: {
+        auto input = (struct v4l2_input *)arg;
+        if (input->index != 0) {
+            return EINVAL;
+        }
+        memset(input, 0, sizeof(*input));
+        strncpy((char *)input->name, "Camera 1", sizeof(input->name) - 1);
+        input->type = V4L2_INPUT_TYPE_CAMERA;
+        return 0;
+    }
+
+    case VIDIOC_G_INPUT:
+        *(int *)arg = input_;
+        return 0;
+
+    case VIDIOC_S_INPUT:
+        if (*(int *)arg != 0) {
+            return EINVAL;
+        }
+        input_ = 0;
+        return 0;
+
+    case VIDIOC_ENUM_FMT:
+        return EnumFmt((struct v4l2_fmtdesc *)arg);
+
+    case VIDIOC_ENUM_FRAMESIZES:
+        return EnumFrameSizes((struct v4l2_frmsizeenum *)arg);
+
+    case VIDIOC_ENUM_FRAMEINTERVALS:
+        return EnumFrameIntervals((struct v4l2_frmivalenum *)arg);
+
+    case VIDIOC_TRY_FMT:
+        return TryFmt((struct v4l2_format *)arg);
+
+    case VIDIOC_S_FMT: {
+        if (!buffers_.empty()) {
+            return EBUSY;
+        }
+        auto fmt = (struct v4l2_format *)arg;
+        int err = TryFmt(fmt);
+        if (!err) {
+            auto fourcc = IsMultiPlanar() ? fmt->fmt.pix_mp.pixelformat
+                                          : fmt->fmt.pix.pixelformat;
+            auto width = IsMultiPlanar() ? fmt->fmt.pix_mp.width
+                                         : fmt->fmt.pix.width;
+            auto height = IsMultiPlanar() ? fmt->fmt.pix_mp.height
+                                          : fmt->fmt.pix.height;
+            memset(&pix_, 0, sizeof(pix_));
+            memset(plane_fmt_, 0, sizeof(plane_fmt_));
+            pix_.pixelformat = fourcc;
+            pix_.width = width;
+            pix_.height = height;
+            pix_.field = V4L2_FIELD_NONE;
+            pix_.colorspace = V4L2_COLORSPACE_SRGB;
+            num_planes_ = PlaneSizes(fourcc, width, height, plane_fmt_);
+            pix_.bytesperline = plane_fmt_[0].bytesperline;
+            for (uint32_t p = 0; p < num_planes_; ++p) {
+                pix_.sizeimage += plane_fmt_[p].sizeimage;
+            }
+        }
+        return err;
+    }
+
+    case VIDIOC_G_FMT: {
+        auto fmt = (struct v4l2_format *)arg;
+        if (fmt->type != type_) {
+            return EINVAL;
+        }
+        GetFmt(fmt);
+        return 0;
+    }
+
+    case VIDIOC_G_PARM:
+    case VIDIOC_S_PARM: {
+        auto parm = (struct v4l2_streamparm *)arg;
+        if (parm->type != type_) {
+            return EINVAL;
+        }
+        if (request == VIDIOC_S_PARM) {
+            if (!parm->parm.capture.timeperframe.denominator) {
+                return EINVAL;
+            }
+            timeperframe_ = parm->parm.capture.timeperframe;
+        }
+        memset(&parm->parm, 0, sizeof(parm->parm));
+        parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+        parm->parm.capture.timeperframe = timeperframe_;
+        return 0;
+    }
+
+    case VIDIOC_REQBUFS:
+        return ReqBufs((struct v4l2_requestbuffers *)arg);
+
+    case VIDIOC_QUERYBUF:
+        return QueryBuf((struct v4l2_buffer *)arg);
+
+    case VIDIOC_QBUF:
+        return QBuf((struct v4l2_buffer *)arg);
+
+    case VIDIOC_DQBUF:
+        return DQBuf((struct v4l2_buffer *)arg);
+
+    case VIDIOC_STREAMON:
+        if (*(int *)arg != (int)type_ || buffers_.empty()) {
+            return EINVAL;
+        }
+        streaming_ = true;
+        return 0;
+
+    case VIDIOC_STREAMOFF:
+        if (*(int *)arg != (int)type_) {
+            return EINVAL;
+        }
+        return StreamOff();
+
+    case VIDIOC_EXPBUF:
+        return ExpBuf((struct v4l2_exportbuffer *)arg);
+
+    case VIDIOC_QUERYCTRL:
+        return QueryCtrl((struct v4l2_queryctrl *)arg);
+
+    case VIDIOC_QUERYMENU:
+        return QueryMenu((struct v4l2_querymenu *)arg);
+
+    case VIDIOC_G_CTRL:
+    case VIDIOC_S_CTRL: {
+        ++control_ioctls_;
+        auto control = (struct v4l2_control *)arg;
+        Control *ctrl = FindControl(control->id);
+        if (!ctrl) {
+            return EINVAL;
+        }
+        if (request == VIDIOC_S_CTRL) {
+            int err = CheckControl(*ctrl, control->value);
+            if (err) {
+                return err;
+            }
+            ctrl->value = control->value;
+        }
+        control->value = ctrl->value;
+        return 0;
+    }
+
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_TRY_EXT_CTRLS:
+        ++control_ioctls_;
+        return ExtCtrls(request, (struct v4l2_ext_controls *)arg);
+
+    case VIDIOC_SUBSCRIBE_EVENT:
+    case VIDIOC_UNSUBSCRIBE_EVENT:
+        return SubscribeEvent(request, (struct v4l2_event_subscription *)arg);
+
+    case VIDIOC_DQEVENT:
+        return DQEvent((struct v4l2_event *)arg);
+
+    default:
+        return ENOTTY;
+    }
+}
+
+int V4l2FakeDevice::QueryCap(struct v4l2_capability *cap) {
+    memset(cap, 0, sizeof(*cap));
+    strncpy((char *)cap->driver, "fake", sizeof(cap->driver) - 1);
+    strncpy((char *)cap->card, card_.data(), sizeof(cap->card) - 1);
+    strncpy((char *)cap->bus_info, bus_info_.data(),
+            sizeof(cap->bus_info) - 1);
+    cap->version = 0x00010000;
+    cap->device_caps = (IsMultiPlanar() ? V4L2_CAP_VIDEO_CAPTURE_MPLANE
+                                        : V4L2_CAP_VIDEO_CAPTURE) |
+                       V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    return 0;
+}
+
+int V4l2FakeDevice::EnumFmt(struct v4l2_fmtdesc *desc) {
+    if (desc->type != type_) {
+        return EINVAL;
+    }
+
+    std::vector<uint32_t> fourccs;
+    for (auto &mode : modes_) {
+        if (std::find(fourccs.begin(), fourccs.end(), mode.fourcc) ==
+            fourccs.end()) {
+            fourccs.push_back(mode.fourcc);
+        }
+    }
+
+    if (desc->index >= fourccs.size()) {
+        return EINVAL;
+    }
+
+    uint32_t index = desc->index;
+    memset(desc, 0, sizeof(*desc));
+    desc->index = index;
+    desc->type = type_;
+    desc->pixelformat = fourccs[index];
+    desc->flags = IsCompressed(desc->pixelformat) ? V4L2_FMT_FLAG_COMPRESSED : 0;
+    snprintf((char *)desc->description, sizeof(desc->description),
+             "Fake %c%c%c%c", desc->pixelformat & 0xff,
+             (desc->pixelformat >> 8) & 0xff, (desc->pixelformat >> 16) & 0xff,
+             (desc->pixelformat >> 24) & 0xff);
+    return 0;
+}
+
+int V4l2FakeDevice::EnumFrameSizes(struct v4l2_frmsizeenum *frmsize) {
+    uint32_t n = 0;
+    for (auto &mode : modes_) {
+        if (mode.fourcc != frmsize->pixel_format) {
+            continue;
+        }
+        if (n++ == frmsize->index) {
+            frmsize->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+            frmsize->discrete.width = mode.width;
+            frmsize->discrete.height = mode.height;
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+int V4l2FakeDevice::EnumFrameIntervals(struct v4l2_frmivalenum *frmival) {
+    for (auto &mode : modes_) {
+        if (mode.fourcc != frmival->pixel_format ||
+            mode.width != frmival->width || mode.height != frmival->height) {
+            continue;
+        }
+
+        // full and half rate
+        uint32_t fps = frmival->index == 0 ? mode.fps : mode.fps / 2;
+        if (frmival->index > 1 || !fps) {
+            return EINVAL;
+        }
+        frmival->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+        frmival->discrete.numerator = 1;
+        frmival->discrete.denominator = fps;
+        return 0;
+    }
+    return EINVAL;
+}
+
+int V4l2FakeDevice::TryFmt(struct v4l2_format *fmt) {
+    if (fmt->type != type_ || modes_.empty()) {
+        return EINVAL;
+    }
+
+    uint32_t pixelformat = IsMultiPlanar() ? fmt->fmt.pix_mp.pixelformat
+                                           : fmt->fmt.pix.pixelformat;
+    uint32_t width = IsMultiPlanar() ? fmt->fmt.pix_mp.width
+                                     : fmt->fmt.pix.width;
+    uint32_t height = IsMultiPlanar() ? fmt->fmt.pix_mp.height
+                                      : fmt->fmt.pix.height;
+
+    // unknown formats fall back to the first one, like most drivers do
+    uint32_t fourcc = modes_[0].fourcc;
+    for (auto &mode : modes_) {
+        if (mode.fourcc == pixelformat) {
+            fourcc = mode.fourcc;
+            break;
+        }
+    }
+
+    // nearest frame size
+    const V4l2FakeMode *best = nullptr;
+    uint64_t best_diff = UINT64_MAX;
+    for (auto &mode : modes_) {
+        if (mode.fourcc != fourcc) {
+            continue;
+        }
+        uint64_t diff = std::abs((int64_t)mode.width * mode.height -
+                                 (int64_t)width * height);
+        if (diff < best_diff) {
+            best = &mode;
+            best_diff = diff;
+        }
+    }
+
+    struct v4l2_plane_pix_format planes[VIDEO_MAX_PLANES];
+    memset(planes, 0, sizeof(planes));
+    uint32_t num_planes =
+        PlaneSizes(fourcc, best->width, best->height, planes);
+
+    if (IsMultiPlanar()) {
+        auto &pix = fmt->fmt.pix_mp;
+        memset(&pix, 0, sizeof(pix));
+        pix.pixelformat = fourcc;
+        pix.width = best->width;
+        pix.height = best->height;
+        pix.field = V4L2_FIELD_NONE;
+        pix.colorspace = V4L2_COLORSPACE_SRGB;
+        pix.num_planes = num_planes;
+        std::copy(planes, planes + num_planes, pix.plane_fmt);
+    } else {
+        auto &pix = fmt->fmt.pix;
+        memset(&pix, 0, sizeof(pix));
+        pix.pixelformat = fourcc;
+        pix.width = best->width;
+        pix.height = best->height;
+        pix.field = V4L2_FIELD_NONE;
+        pix.colorspace = V4L2_COLORSPACE_SRGB;
+        pix.bytesperline = planes[0].bytesperline;
+        for (uint32_t p = 0; p < num_planes; ++p) {
+            pix.sizeimage += planes[p].sizeimage;
+        }
+    }
+    return 0;
+}
+
+void V4l2FakeDevice::GetFmt(struct v4l2_format *fmt) const {
+    if (!IsMultiPlanar()) {
+        fmt->fmt.pix = pix_;
+        return;
+    }
+
+    auto &pix = fmt->fmt.pix_mp;
+    memset(&pix, 0, sizeof(pix));
+    pix.pixelformat = pix_.pixelformat;
+    pix.width = pix_.width;
+    pix.height = pix_.height;
+    pix.field = pix_.field;
+    pix.colorspace = pix_.colorspace;
+    pix.num_planes = num_planes_;
+    std::copy(plane_fmt_, plane_fmt_ + num_planes_, pix.plane_fmt);
+}
+
+int V4l2FakeDevice::ReqBufs(struct v4l2_requestbuffers *req) {
+    if (req->type != type_ ||
+        (req->memory != V4L2_MEMORY_MMAP &&
+         req->memory != V4L2_MEMORY_USERPTR)) {
+        return EINVAL;
+    }
+
+    if (streaming_) {
+        return EBUSY;
+    }
+
+    FreeBuffers();
+
+    if (!req->count) {
+        return 0;
+    }
+
+    // user memory is one block, a plane each can not be told apart
+    uint32_t num_planes = IsMultiPlanar() ? num_planes_ : 1;
+    if (req->memory == V4L2_MEMORY_USERPTR && num_planes > 1) {
+        return EINVAL;
+    }
+
+    uint32_t count = std::min(req->count, FAKE_MAX_BUFFERS);
+
+    // the mmap offsets only have to be unique
+    uint32_t offset = 0;
+
+    memory_ = req->memory;
+    buffers_.resize(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        Buffer &buffer = buffers_[i];
+        memset(&buffer.buf, 0, sizeof(buffer.buf));
+        memset(buffer.planes, 0, sizeof(buffer.planes));
+        buffer.buf.index = i;
+        buffer.buf.type = type_;
+        buffer.buf.memory = memory_;
+        buffer.num_planes = num_planes;
+
+        if (memory_ == V4L2_MEMORY_USERPTR) {
+            continue;
+        }
+
+        for (uint32_t p = 0; p < num_planes; ++p) {
+            Plane &plane = buffer.plane[p];
+            uint32_t length = PageAlign(IsMultiPlanar()
+                                            ? plane_fmt_[p].sizeimage
+                                            : pix_.sizeimage);
+
+            plane.memfd = memfd_create("v4l2-fake", MFD_CLOEXEC);
+            if (plane.memfd == -1 || ftruncate(plane.memfd, length) == -1) {
+                int err = errno;
+                FreeBuffers();
+                return err;
+            }
+
+            plane.mem = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, plane.memfd, 0);
+            if (plane.mem == MAP_FAILED) {
+                int err = errno;
+                plane.mem = nullptr;
+                FreeBuffers();
+                return err;
+            }
+
+            plane.length = length;
+            plane.offset = offset;
+            offset += length;
+            buffer.planes[p].length = length;
+            buffer.planes[p].m.mem_offset = plane.offset;
+        }
+
+        if (!IsMultiPlanar()) {
+            buffer.buf.length = buffer.plane[0].length;
+            buffer.buf.m.offset = buffer.plane[0].offset;
+        }
+    }
+
+    req->count = count;
+    return 0;
+}
+
+int V4l2FakeDevice::QueryBuf(struct v4l2_buffer *buf) {
+    if (buf->type != type_ || buf->index >= buffers_.size()) {
+        return EINVAL;
+    }
+
+    if (IsMultiPlanar() &&
+        (!buf->m.planes || buf->length < buffers_[buf->index].num_planes)) {
+        return EINVAL;
+    }
+
+    CopyBuffer(buffers_[buf->index], buf);
+    return 0;
+}
+
+void V4l2FakeDevice::CopyBuffer(const Buffer &buffer,
+                                struct v4l2_buffer *buf) const {
+    struct v4l2_plane *planes = buf->m.planes;
+    *buf = buffer.buf;
+    if (IsMultiPlanar()) {
+        std::copy(buffer.planes, buffer.planes + buffer.num_planes, planes);
+        buf->m.planes = planes;
+        buf->length = buffer.num_planes;
+    }
+}
+
+int V4l2FakeDevice::QBuf(struct v4l2_buffer *buf) {
+    if (buf->type != type_ || buf->memory != memory_ ||
+        buf->index >= buffers_.size()) {
+        return EINVAL;
+    }
+
+    Buffer &buffer = buffers_[buf->index];
+    if (buffer.queued) {
+        return EINVAL;
+    }
+
+    if (IsMultiPlanar() && (!buf->m.planes || buf->length < buffer.num_planes)) {
+        return EINVAL;
+    }
+
+    if (memory_ == V4L2_MEMORY_USERPTR) {
+        unsigned long userptr =
+            IsMultiPlanar() ? buf->m.planes[0].m.userptr : buf->m.userptr;
+        uint32_t length =
+            IsMultiPlanar() ? buf->m.planes[0].length : buf->length;
+        if (!userptr || length < pix_.sizeimage) {
+            return EINVAL;
+        }
+        buffer.plane[0].mem = (void *)userptr;
+        buffer.plane[0].length = length;
+        if (IsMultiPlanar()) {
+            buffer.planes[0].m.userptr = userptr;
+            buffer.planes[0].length = length;
+        } else {
+            buffer.buf.m.userptr = userptr;
+            buffer.buf.length = length;
+        }
+    }
+
+    buffer.queued = true;
+    buffer.buf.flags = V4L2_BUF_FLAG_QUEUED;
+    queued_.push_back(buf->index);
+    return 0;
+}
+
+int V4l2FakeDevice::DQBuf(struct v4l2_buffer *buf) {
+    if (buf->type != type_ || buf->memory != memory_ || !streaming_) {
+        return EINVAL;
+    }
+
+    if (IsMultiPlanar() && (!buf->m.planes || buf->length < num_planes_)) {
+        return EINVAL;
+    }
+
+    if (done_.empty()) {
+        return EAGAIN;
+    }
+
+    uint32_t index = done_.front();
+    done_.pop_front();
+    if (done_.empty()) {
+        SetReadable(false);
+    }
+
+    Buffer &buffer = buffers_[index];
+    buffer.queued = false;
+    CopyBuffer(buffer, buf);
+    return 0;
+}
+
+int V4l2FakeDevice::StreamOff() {
+    streaming_ = false;
+    queued_.clear();
+    done_.clear();
+    for (auto &buffer : buffers_) {
+        buffer.queued = false;
+        buffer.buf.flags = 0;
+    }
+    SetReadable(false);
+    return 0;
+}
+
+int V4l2FakeDevice::ExpBuf(struct v4l2_exportbuffer *exp) {
+    if (!expbuf_) {
+        return ENOTTY;
+    }
+
+    if (exp->type != type_ || memory_ != V4L2_MEMORY_MMAP ||
+        exp->index >= buffers_.size() ||
+        exp->plane >= buffers_[exp->index].num_planes) {
+        return EINVAL;
+    }
+
+    int fd = fcntl(buffers_[exp->index].plane[exp->plane].memfd,
+                   F_DUPFD_CLOEXEC, 0);
+    if (fd == -1) {
+        return errno;
+    }
+    exp->fd = fd;
+    return 0;
+}
+
+int V4l2FakeDevice::QueryCtrl(struct v4l2_queryctrl *queryctrl) {
+    uint32_t id = queryctrl->id;
+    if (id & V4L2_CTRL_FLAG_NEXT_CTRL) {
+        id &= ~(V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND);
+        for (auto &ctrl : controls_) {
+            if (ctrl.queryctrl.id > id) {
+                *queryctrl = ctrl.queryctrl;
+                return 0;
+            }
+        }
+        return EINVAL;
+    }
+
+    Control *ctrl = FindControl(id);
+    if (!ctrl) {
+        return EINVAL;
+    }
+    *queryctrl = ctrl->queryctrl;
+    return 0;
+}
+
+int V4l2FakeDevice::QueryMenu(struct v4l2_querymenu *querymenu) {
+    if (querymenu->id != V4L2_CID_EXPOSURE_AUTO ||
+        querymenu->index >= sizeof(kExposureMenu) / sizeof(kExposureMenu[0])) {
+        return EINVAL;
+    }
+
+    memset(querymenu->name, 0, sizeof(querymenu->name));
+    strncpy((char *)querymenu->name, kExposureMenu[querymenu->index],
+            sizeof(querymenu->name) - 1);
+    return 0;
+}
+
+int V4l2FakeDevice::ExtCtrls(unsigned long request,
+                             struct v4l2_ext_controls *ext) {
+    // like the kernel, error_idx is count while the failing control is not
+    // known yet, and nothing is applied unless all of them pass
+    ext->error_idx = ext->count;
+    if (ext->count && !ext->controls) {
+        return EINVAL;
+    }
+
+    for (uint32_t i = 0; i < ext->count; ++i) {
+        auto &control = ext->controls[i];
+        Control *ctrl = FindControl(control.id);
+        if (!ctrl) {
+            ext->error_idx = request == VIDIOC_S_EXT_CTRLS ? ext->count : i;
+            return EINVAL;
+        }
+
+        if (request == VIDIOC_G_EXT_CTRLS) {
+            continue;
+        }
+
+        int64_t value = ctrl->queryctrl.type == V4L2_CTRL_TYPE_INTEGER64
+                            ? control.value64
+                            : control.value;
+        int err = CheckControl(*ctrl, value);
+        if (err) {
+            ext->error_idx = i;
+            return err;
+        }
+    }
+
+    for (uint32_t i = 0; i < ext->count; ++i) {
+        auto &control = ext->controls[i];
+        Control *ctrl = FindControl(control.id);
+        bool value64 = ctrl->queryctrl.type == V4L2_CTRL_TYPE_INTEGER64;
+        if (request == VIDIOC_S_EXT_CTRLS) {
+            ctrl->value = value64 ? control.value64 : control.value;
+        }
+        if (request == VIDIOC_G_EXT_CTRLS) {
+            if (value64) {
+                control.value64 = ctrl->value;
+            } else {
+                control.value = ctrl->value;
+            }
+        }
+    }
+    return 0;
+}
+
+bool V4l2FakeDevice::ChangeControl(uint32_t id, int64_t value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Control *ctrl = FindControl(id);
+    if (!ctrl || CheckControl(*ctrl, value)) {
+        return false;
+    }
+
+    if (ctrl->value != value) {
+        ctrl->value = value;
+        QueueEvent(*ctrl, V4L2_EVENT_CTRL_CH_VALUE);
+    }
+    return true;
+}
+
+bool V4l2FakeDevice::SetNode(const std::string &path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    node_ = path;
+    return !present_ || CreateNode();
+}
+
+bool V4l2FakeDevice::CreateNode() {
+    if (node_.empty()) {
+        return true;
+    }
+
+    int fd = open(node_.data(), O_WRONLY | O_CREAT | O_CLOEXEC, 0660);
+    if (fd == -1) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+void V4l2FakeDevice::Unplug() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!present_) {
+        return;
+    }
+
+    // the buffers stay until the stale fd is closed, user mappings remain
+    // valid like with the kernel
+    present_ = false;
+    streaming_ = false;
+    queued_.clear();
+    done_.clear();
+    events_.clear();
+    // a disconnected V4L2 fd polls POLLERR | POLLHUP
+    SetReadable(true);
+
+    if (!node_.empty()) {
+        unlink(node_.data());
+    }
+}
+
+void V4l2FakeDevice::Replug() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (present_) {
+        return;
+    }
+
+    input_ = 0;
+    memset(&pix_, 0, sizeof(pix_));
+    memset(plane_fmt_, 0, sizeof(plane_fmt_));
+    num_planes_ = 1;
+    timeperframe_.numerator = 1;
+    timeperframe_.denominator = 30;
+    sequence_ = 0;
+    for (auto &ctrl : controls_) {
+        ctrl.value = ctrl.queryctrl.default_value;
+    }
+
+    present_ = true;
+    CreateNode();
+}
+
+int V4l2FakeDevice::SubscribeEvent(unsigned long request,
+                                   struct v4l2_event_subscription *sub) {
+    // no way to raise POLLPRI
+    if (peer_fd_ == -1) {
+        return ENOTTY;
+    }
+
+    if (request == VIDIOC_UNSUBSCRIBE_EVENT && sub->type == V4L2_EVENT_ALL) {
+        subscribed_.clear();
+        events_.clear();
+        SetPriority(false);
+        return 0;
+    }
+
+    Control *ctrl = FindControl(sub->id);
+    if (sub->type != V4L2_EVENT_CTRL || !ctrl) {
+        return EINVAL;
+    }
+
+    auto it = std::find(subscribed_.begin(), subscribed_.end(), sub->id);
+    if (request == VIDIOC_UNSUBSCRIBE_EVENT) {
+        if (it != subscribed_.end()) {
+            subscribed_.erase(it);
+        }
+        return 0;
+    }
+
+    if (it == subscribed_.end()) {
+        subscribed_.push_back(sub->id);
+    }
+    if (sub->flags & V4L2_EVENT_SUB_FL_SEND_INITIAL) {
+        QueueEvent(*ctrl, V4L2_EVENT_CTRL_CH_VALUE | V4L2_EVENT_CTRL_CH_FLAGS);
+    }
+    return 0;
+}
+
+void V4l2FakeDevice::QueueEvent(const Control &ctrl, uint32_t changes) {
+    uint32_t id = ctrl.queryctrl.id;
+    if (std::find(subscribed_.begin(), subscribed_.end(), id) ==
+        subscribed_.end()) {
+        return;
+    }
+
+    struct v4l2_event *ev = nullptr;
+    for (auto &pending : events_) {
+        if (pending.id == id) {
+            ev = &pending;
+            changes |= pending.u.ctrl.changes;
+            break;
+        }
+    }
+    if (!ev) {
+        events_.emplace_back();
+        ev = &events_.back();
+    }
+
+    auto &queryctrl = ctrl.queryctrl;
+    memset(ev, 0, sizeof(*ev));
+    ev->type = V4L2_EVENT_CTRL;
+    ev->id = id;
+    ev->u.ctrl.changes = changes;
+    ev->u.ctrl.type = queryctrl.type;
+    if (queryctrl.type == V4L2_CTRL_TYPE_INTEGER64) {
+        ev->u.ctrl.value64 = ctrl.value;
+    } else {
+        ev->u.ctrl.value = ctrl.value;
+    }
+    ev->u.ctrl.flags = queryctrl.flags;
+    ev->u.ctrl.minimum = queryctrl.minimum;
+    ev->u.ctrl.maximum = queryctrl.maximum;
+    ev->u.ctrl.step = queryctrl.step;
+    ev->u.ctrl.default_value = queryctrl.default_value;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->timestamp = ts;
+    SetPriority(true);
+}
+
+int V4l2FakeDevice::DQEvent(struct v4l2_event *ev) {
+    if (peer_fd_ == -1) {
+        return ENOTTY;
+    }
+
+    if (events_.empty()) {
+        return ENOENT;
+    }
+
+    *ev = events_.front();
+    events_.pop_front();
+    ev->pending = events_.size();
+    ev->sequence = event_sequence_++;
+    if (events_.empty()) {
+        SetPriority(false);
+    }
+    return 0;
+}
+
+V4l2FakeDevice::Control *V4l2FakeDevice::FindControl(uint32_t id) {
+    for (auto &ctrl : controls_) {
+        if (ctrl.queryctrl.id == id) {
+            return &ctrl;
+        }
+    }
+    return nullptr;
+}
+
+int V4l2FakeDevice::CheckControl(const Control &ctrl, int64_t value) const {
+    auto &queryctrl = ctrl.queryctrl;
+    if (queryctrl.flags & V4L2_CTRL_FLAG_READ_ONLY) {
+        return EACCES;
+    }
+    if (value < queryctrl.minimum || value > queryctrl.maximum) {
+        return ERANGE;
+    }
+    if (queryctrl.step > 1 && (value - queryctrl.minimum) % queryctrl.step) {
+        return ERANGE;
+    }
+    return 0;
+}
+
+void V4l2FakeDevice::FreeBuffers() {
+    for (auto &buffer : buffers_) {
+        for (uint32_t p = 0; p < buffer.num_planes; ++p) {
+            auto &plane = buffer.plane[p];
+            if (plane.memfd != -1 && plane.mem) {
+                munmap(plane.mem, plane.length);
+            }
+            if (plane.memfd != -1) {
+                close(plane.memfd);
+            }
+        }
+    }
+    buffers_.clear();
+    queued_.clear();
+    done_.clear();
+}
+
+void V4l2FakeDevice::SetReadable(bool readable) {
+    if (readable == readable_ || fd_ == -1) {
+        return;
+    }
+
+    // one byte in flight while a frame is ready, reading it back stops at
+    // or skips an urgent byte, so both signals stay apart
+    if (peer_fd_ != -1) {
+        char byte = 'f';
+        ssize_t r = readable ? send(peer_fd_, &byte, 1, MSG_NOSIGNAL)
+                             : recv(fd_, &byte, 1, MSG_DONTWAIT);
+        if (r == 1) {
+            readable_ = readable;
+        }
+        return;
+    }
+
+    // the eventfd counter mirrors the done queue: non-zero while a frame
+    // is ready, so select/poll/epoll see the fd as readable
+    uint64_t value = 1;
+    if (readable) {
+        if (write(fd_, &value, sizeof(value)) != sizeof(value)) {
+            return;
+        }
+    } else {
+        if (read(fd_, &value, sizeof(value)) != sizeof(value)) {
+            return;
+        }
+    }
+    readable_ = readable;
+}
+
+void V4l2FakeDevice::SetPriority(bool priority) {
+    if (priority == priority_ || peer_fd_ == -1) {
+        return;
+    }
+
+    // at most one urgent byte in flight, a second would push the first
+    // into the normal data
+    char byte = 'e';
+    ssize_t r = priority ? send(peer_fd_, &byte, 1, MSG_OOB | MSG_NOSIGNAL)
+                         : recv(fd_, &byte, 1, MSG_OOB | MSG_DONTWAIT);
+    if (r == 1) {
+        priority_ = priority;
+    }
+}
+
+} // namespace webcam
+} // namespace noevil
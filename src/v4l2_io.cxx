@@ -0,0 +1,39 @@
+#include "v4l2_io.h"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace noevil {
+namespace webcam {
+
+int V4l2Io::Stat(const char *path, struct stat *st) { return stat(path, st); }
+
+int V4l2Io::Open(const char *path, int flags) { return open(path, flags); }
+
+int V4l2Io::Close(int fd) { return close(fd); }
+
+int V4l2Io::Ioctl(int fd, unsigned long request, void *arg) {
+    int r;
+    do {
+        r = ioctl(fd, request, arg);
+    } while (r == -1 && errno == EINTR);
+    return r;
+}
+
+void *V4l2Io::MMap(size_t length, int prot, int flags, int fd, off_t offset) {
+    return mmap(nullptr, length, prot, flags, fd, offset);
+}
+
+int V4l2Io::MUnmap(void *addr, size_t length) { return munmap(addr, length); }
+
+std::shared_ptr<V4l2Io> V4l2Io::System() {
+    static std::shared_ptr<V4l2Io> io = std::make_shared<V4l2Io>();
+    return io;
+}
+
+} // namespace webcam
+} // namespace noevil
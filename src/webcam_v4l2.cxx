@@ -8,18 +8,28 @@
  */
 #include "webcam_v4l2.h"
 
+#include "frame_ring.h"
 #include "spdlog/fmt/bundled/core.h"
 #include "spdlog/fmt/bundled/format.h"
 #include "string_util.hpp"
+#include "trace.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <utility>
 #include <vector>
 
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <unistd.h>
 
 // The SCALE macro converts a value (sv) from one range (sf -> sr)
 #define SCALE(df, dr, sf, sr, sv) (((sv - sf) * (dr - df) / (sr - sf)) + df)
@@ -31,71 +41,330 @@ static constexpr auto QBUF_SIZE = 5;
 static constexpr auto VIDEO_DEV_PREFIX = "/dev/video";
 static constexpr auto LOGGER_NAME = "webcam-v4l2";
 
+// enumerated modes by device, enumeration is slow on some UVC cameras
+static std::mutex g_mode_cache_mutex;
+static std::map<std::string, std::vector<WebcamMode>> g_mode_cache;
+
+// 0 for kFmtNone
+static uint32_t FormatFourcc(WebcamFormat fmt) {
+    switch (fmt) {
+    case WebcamFormat::kFmtMJPG:
+        return V4L2_PIX_FMT_MJPEG;
+    case WebcamFormat::kFmtYUYV:
+        return V4L2_PIX_FMT_YUYV;
+    case WebcamFormat::kFmtNV12M:
+        return V4L2_PIX_FMT_NV12M;
+    case WebcamFormat::kFmtNV12:
+        return V4L2_PIX_FMT_NV12;
+    case WebcamFormat::kFmtYU12:
+        return V4L2_PIX_FMT_YUV420;
+    case WebcamFormat::kFmtGREY:
+        return V4L2_PIX_FMT_GREY;
+    case WebcamFormat::kFmtY16:
+        return V4L2_PIX_FMT_Y16;
+    case WebcamFormat::kFmtRGB24:
+        return V4L2_PIX_FMT_RGB24;
+    case WebcamFormat::kFmtBGR24:
+        return V4L2_PIX_FMT_BGR24;
+    case WebcamFormat::kFmtH264:
+        return V4L2_PIX_FMT_H264;
+    default:
+        return 0;
+    }
+}
+
+// the format fields alike in both apis
+static uint32_t FmtFourcc(const struct v4l2_format &v4l2_fmt) {
+    return V4L2_TYPE_IS_MULTIPLANAR(v4l2_fmt.type)
+               ? v4l2_fmt.fmt.pix_mp.pixelformat
+               : v4l2_fmt.fmt.pix.pixelformat;
+}
+
+static uint32_t FmtWidth(const struct v4l2_format &v4l2_fmt) {
+    return V4L2_TYPE_IS_MULTIPLANAR(v4l2_fmt.type) ? v4l2_fmt.fmt.pix_mp.width
+                                                   : v4l2_fmt.fmt.pix.width;
+}
+
+static uint32_t FmtHeight(const struct v4l2_format &v4l2_fmt) {
+    return V4L2_TYPE_IS_MULTIPLANAR(v4l2_fmt.type) ? v4l2_fmt.fmt.pix_mp.height
+                                                   : v4l2_fmt.fmt.pix.height;
+}
+
+// node, driver, card and bus, keys the mode cache
+static std::string DeviceKey(const std::string &node,
+                             const struct v4l2_capability &cap) {
+    return fmt::format("{}|{}|{}|{}", node, cap.driver, cap.card,
+                       cap.bus_info);
+}
+
+static uint64_t NowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+struct WebcamV4l2::CaptureThreadState {
+    CaptureThreadState(const CaptureThreadOptions &opts, uint32_t count)
+        : options(opts), running(false), failure(0), frames(opts.capacity),
+          returns(count) {}
+
+    // a thread that ended by itself is joined at the latest here
+    ~CaptureThreadState() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    CaptureThreadOptions options;
+    std::thread thread;
+    std::atomic<bool> running;
+    // errno the thread ended with, stored before running is cleared
+    std::atomic<int> failure;
+
+    // captured frames to the consumer, released buffers back
+    struct Frame {
+        struct v4l2_buffer buf;
+        FrameMeta meta;
+    };
+
+    FrameRing<Frame> frames;
+    FrameRing<struct v4l2_buffer> returns;
+
+    // each counter has a single writer
+    std::atomic<uint64_t> produced{0};
+    std::atomic<uint64_t> published{0};
+    std::atomic<uint64_t> dropped_oldest{0};
+    std::atomic<uint64_t> dropped_newest{0};
+    std::atomic<uint64_t> blocked{0};
+    std::atomic<uint64_t> driver_dropped{0};
+    std::atomic<uint64_t> consumed{0};
+};
+
+// single writer increment, no locked instruction
+static inline void Bump(std::atomic<uint64_t> &counter) {
+    counter.store(counter.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+}
+
 void V4l2BufStatDeleter::operator()(V4l2BufStat *stat) {
     if (!stat->buffer)
         return;
 
     for (int i = 0; i < stat->count; ++i) {
-        munmap(stat->buffer[i].start, stat->buffer[i].length);
+        auto &unit = stat->buffer[i];
+        for (uint32_t p = 0; p < unit.num_planes; ++p) {
+            // user pointers belong to the caller
+            if (stat->memory == V4L2_MEMORY_MMAP && unit.plane[p].start) {
+                stat->io->MUnmap(unit.plane[p].start, unit.plane[p].length);
+            }
+            if (unit.plane[p].dmabuf_fd != -1) {
+                close(unit.plane[p].dmabuf_fd);
+            }
+        }
     }
 
     delete[] stat->buffer;
     stat->buffer = nullptr;
 }
 
+FrameLease::FrameLease()
+    : owner_(nullptr),
+      generation_(0),
+      num_planes_(0),
+      meta_() {
+    memset(&buf_, 0, sizeof(buf_));
+}
+
+FrameLease::~FrameLease() { Release(); }
+
+FrameLease::FrameLease(FrameLease &&other) noexcept
+    : owner_(other.owner_),
+      generation_(other.generation_),
+      num_planes_(other.num_planes_),
+      meta_(other.meta_),
+      buf_(other.buf_) {
+    std::copy(other.planes_, other.planes_ + other.num_planes_, planes_);
+    other.Reset();
+}
+
+FrameLease &FrameLease::operator=(FrameLease &&other) noexcept {
+    if (this != &other) {
+        Release();
+        owner_ = other.owner_;
+        generation_ = other.generation_;
+        num_planes_ = other.num_planes_;
+        std::copy(other.planes_, other.planes_ + other.num_planes_, planes_);
+        meta_ = other.meta_;
+        buf_ = other.buf_;
+        other.Reset();
+    }
+    return *this;
+}
+
+bool FrameLease::Release() {
+    if (!owner_) {
+        return true;
+    }
+
+    bool ret = owner_->ReleaseLease(*this);
+    Reset();
+    return ret;
+}
+
+void FrameLease::Reset() {
+    owner_ = nullptr;
+    generation_ = 0;
+    num_planes_ = 0;
+    planes_[0] = FramePlane();
+    meta_ = FrameMeta();
+    memset(&buf_, 0, sizeof(buf_));
+}
+
 WebcamV4l2::WebcamV4l2()
     : working_(false),
+      paused_(false),
       cam_fd_(-1),
       capabilities_(0),
       format_(0),
-      logger_(util::GetLogger(LOGGER_NAME)) {}
+      leases_(0),
+      generation_(0),
+      export_dmabuf_(false),
+      memory_(V4L2_MEMORY_MMAP),
+      buf_type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+      sizeimage_(0),
+      num_planes_(1),
+      color_planes_(1),
+      buffer_count_(QBUF_SIZE),
+      granted_count_(0),
+      adaptive_buffers_(false),
+      min_buffers_(2),
+      max_buffers_(16),
+      wait_begin_us_(0),
+      latest_only_(false),
+      frame_dropped_(0),
+      setup_begin_us_(0),
+      setup_us_(0),
+      cold_setup_us_(0),
+      resume_begin_us_(0),
+      switch_gap_us_(0),
+      logger_(util::GetLogger(LOGGER_NAME)),
+      ctrl_loaded_(false),
+      ctrl_events_(false),
+      next_ctrl_cb_(1),
+      io_(V4l2Io::System()) {
+    memset(plane_fmt_, 0, sizeof(plane_fmt_));
+}
 
 WebcamV4l2::WebcamV4l2(int id)
     : working_(false),
+      paused_(false),
       cam_fd_(-1),
       capabilities_(0),
       format_(0),
+      leases_(0),
+      generation_(0),
+      export_dmabuf_(false),
+      memory_(V4L2_MEMORY_MMAP),
+      buf_type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+      sizeimage_(0),
+      num_planes_(1),
+      color_planes_(1),
+      buffer_count_(QBUF_SIZE),
+      granted_count_(0),
+      adaptive_buffers_(false),
+      min_buffers_(2),
+      max_buffers_(16),
+      wait_begin_us_(0),
+      latest_only_(false),
+      frame_dropped_(0),
+      setup_begin_us_(0),
+      setup_us_(0),
+      cold_setup_us_(0),
+      resume_begin_us_(0),
+      switch_gap_us_(0),
       dev_name_(VIDEO_DEV_PREFIX + std::to_string(id)),
-      logger_(util::GetLogger(LOGGER_NAME)) {}
+      logger_(util::GetLogger(LOGGER_NAME)),
+      ctrl_loaded_(false),
+      ctrl_events_(false),
+      next_ctrl_cb_(1),
+      io_(V4l2Io::System()) {
+    memset(plane_fmt_, 0, sizeof(plane_fmt_));
+}
 
 WebcamV4l2::WebcamV4l2(const char *name)
     : working_(false),
+      paused_(false),
       cam_fd_(-1),
       capabilities_(0),
       format_(0),
+      leases_(0),
+      generation_(0),
+      export_dmabuf_(false),
+      memory_(V4L2_MEMORY_MMAP),
+      buf_type_(V4L2_BUF_TYPE_VIDEO_CAPTURE),
+      sizeimage_(0),
+      num_planes_(1),
+      color_planes_(1),
+      buffer_count_(QBUF_SIZE),
+      granted_count_(0),
+      adaptive_buffers_(false),
+      min_buffers_(2),
+      max_buffers_(16),
+      wait_begin_us_(0),
+      latest_only_(false),
+      frame_dropped_(0),
+      setup_begin_us_(0),
+      setup_us_(0),
+      cold_setup_us_(0),
+      resume_begin_us_(0),
+      switch_gap_us_(0),
       dev_name_(name),
-      logger_(util::GetLogger(LOGGER_NAME)) {}
+      logger_(util::GetLogger(LOGGER_NAME)),
+      ctrl_loaded_(false),
+      ctrl_events_(false),
+      next_ctrl_cb_(1),
+      io_(V4l2Io::System()) {
+    memset(plane_fmt_, 0, sizeof(plane_fmt_));
+}
 
 WebcamV4l2::~WebcamV4l2() { Release(); }
 
-std::string WebcamV4l2::GetError() const { return error_; }
+std::string WebcamV4l2::GetError() const {
+    // a capture fault is newer than error_ until error_ is set again
+    if (error_.empty() && capture_fault_.code != CaptureError::kNone) {
+        return FormatCaptureFault();
+    }
+    return error_;
+}
 
 std::string WebcamV4l2::FormatErrno() {
     return fmt::format("{} - {}", errno, strerror(errno));
 }
 
 bool WebcamV4l2::Open(bool force) {
-    logger_->debug("check {} open", dev_name_);
+    SPDLOG_LOGGER_DEBUG(logger_, "check {} open", dev_name_);
     if (IsOpen()) {
         if (force) {
-            close(cam_fd_);
-            cam_fd_ = -1;
+            Close();
 
         } else {
-            logger_->debug("{} is open", dev_name_);
+            SPDLOG_LOGGER_DEBUG(logger_, "{} is open", dev_name_);
             return true;
         }
     }
 
-    logger_->debug("check {} stat", dev_name_);
+    setup_begin_us_ = NowUs();
+    cold_setup_us_ = 0;
+
+    SPDLOG_LOGGER_DEBUG(logger_, "check {} stat", dev_name_);
     struct stat st;
-    if (-1 == stat(dev_name_.data(), &st)) {
+    if (-1 == io_->Stat(dev_name_.data(), &st)) {
         error_ = FormatErrno();
         logger_->error("can not identify {}, {}", dev_name_, error_);
         return false;
     }
 
-    logger_->debug("check {} type", dev_name_);
+    SPDLOG_LOGGER_DEBUG(logger_, "check {} type", dev_name_);
     // check if it's device
     if (!S_ISCHR(st.st_mode)) {
         error_ = dev_name_ + " is not a device";
@@ -103,14 +372,25 @@ bool WebcamV4l2::Open(bool force) {
         return false;
     }
 
-    logger_->debug("openning {} ", dev_name_);
-    cam_fd_ = open(dev_name_.data(), O_RDWR | O_NONBLOCK);
+    SPDLOG_LOGGER_DEBUG(logger_, "openning {} ", dev_name_);
+    cam_fd_ = io_->Open(dev_name_.data(), O_RDWR | O_NONBLOCK);
     if (cam_fd_ == -1) {
         error_ = FormatErrno();
         logger_->error("open {} failure: {}", dev_name_, error_);
         return false;
     }
-    logger_->debug("open {} success", dev_name_);
+    SPDLOG_LOGGER_DEBUG(logger_, "open {} success", dev_name_);
+
+    // another device may sit behind the node now, or the same one on
+    // another bus after a replug
+    struct v4l2_capability cam_cap;
+    if (io_->Ioctl(cam_fd_, VIDIOC_QUERYCAP, &cam_cap) == 0) {
+        device_key_ = DeviceKey(dev_name_, cam_cap);
+        bus_info_ = (char *)cam_cap.bus_info;
+    }
+
+    // ranges and values in place before the first control access
+    LoadControls();
     return true;
 }
 
@@ -125,7 +405,7 @@ bool WebcamV4l2::Open(const char *name) {
 bool WebcamV4l2::IsOpen() { return cam_fd_ != -1; }
 
 bool WebcamV4l2::Init() {
-    logger_->debug("initializing {}", dev_name_);
+    SPDLOG_LOGGER_DEBUG(logger_, "initializing {}", dev_name_);
     if (!IsOpen()) {
         error_ = "webcam is not open";
         logger_->error(error_);
@@ -150,60 +430,55 @@ bool WebcamV4l2::Init() {
 }
 
 
-bool WebcamV4l2::GrabFrame(std::string &img, uint32_t timeout) {
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = timeout * 1000;
-
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(cam_fd_, &fds);
-
-    int r = select(cam_fd_ + 1, &fds, nullptr, nullptr, &tv);
-
-    if (-1 == r) {
-        error_ = fmt::format("select failure, {}", FormatErrno());
-        logger_->error(error_);
-        return false;
-    }
-
-    if (!r) {
-        error_ = fmt::format("select {} ms timeout", timeout);
-        logger_->error(error_);
-        return false;
-    }
-
-    auto buf_ptr = &buf_stat_->buf;
-    memset(buf_ptr, 0, sizeof(*buf_ptr));
-    buf_ptr->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf_ptr->memory = V4L2_MEMORY_MMAP;
-
-    if (ioctl(cam_fd_, VIDIOC_DQBUF, buf_ptr) == -1) {
-        error_ = fmt::format("VIDIOC_DQBUF failure, {}", FormatErrno());
-        logger_->error(error_);
-        return false;
-    }
-
-    auto index = buf_ptr->index;
-    buf_stat_->buffer[index].bytes = buf_ptr->bytesused;
+bool WebcamV4l2::WaitReadable(uint32_t timeout) {
+    struct pollfd pfd;
+    pfd.fd = cam_fd_;
+    pfd.events = POLLIN | POLLPRI;
+
+    util::TraceScope trace("poll", util::kTraceNoFrame);
+    wait_begin_us_ = NowUs();
+    uint64_t deadline = wait_begin_us_ + timeout * 1000ull;
+    int wait = timeout;
+    for (;;) {
+        int r = poll(&pfd, 1, wait);
+        if (-1 == r) {
+            wait_begin_us_ = 0;
+            return FailCapture(CaptureError::kPoll, errno);
+        }
 
-    img.assign((char *)buf_stat_->buffer[index].start,
-               buf_stat_->buffer[index].bytes);
+        if (r) {
+            if (pfd.revents & POLLPRI) {
+                ProcessEvents();
+            }
+            // POLLERR as well, DQBUF tells what is wrong
+            if (pfd.revents & ~POLLPRI) {
+                return true;
+            }
+        }
 
-    if (ioctl(cam_fd_, VIDIOC_QBUF, buf_ptr) == -1) {
-        error_ = fmt::format("VIDIOC_QBUF failure, {}", FormatErrno());
-        logger_->error(error_);
-        return false;
+        uint64_t now = NowUs();
+        if (!r || now >= deadline) {
+            wait_begin_us_ = 0;
+            return FailCapture(CaptureError::kTimeout, 0, timeout);
+        }
+        wait = (deadline - now + 999) / 1000;
     }
-
-    return true;
 }
 
 bool WebcamV4l2::Close() {
     if (IsOpen()) {
-        close(cam_fd_);
+        io_->Close(cam_fd_);
         cam_fd_ = -1;
     }
+    // no modes of a closed node are served from the cache
+    device_key_.clear();
+
+    {
+        std::lock_guard<std::mutex> lock(ctrl_mutex_);
+        ctrl_.clear();
+    }
+    ctrl_loaded_ = false;
+    ctrl_events_ = false;
 
     return true;
 }
@@ -213,9 +488,9 @@ bool WebcamV4l2::SetInput(const char *name) {
 
     struct v4l2_input cam_input;
     cam_input.index = 0;
-    while (ioctl(cam_fd_, VIDIOC_ENUMINPUT, &cam_input) == 0) {
-        logger_->debug("enumerate input {} name: {}, type: {}", cam_input.index,
-                       cam_input.name, cam_input.type);
+    while (io_->Ioctl(cam_fd_, VIDIOC_ENUMINPUT, &cam_input) == 0) {
+        SPDLOG_LOGGER_DEBUG(logger_, "enumerate input {} name: {}, type: {}",
+                            cam_input.index, cam_input.name, cam_input.type);
         if (name && strncasecmp((char *)cam_input.name, name, 32) == 0) {
             match_index = cam_input.index;
         }
@@ -230,28 +505,29 @@ bool WebcamV4l2::SetInput(const char *name) {
     }
 
     cam_input.index = match_index;
-    if (ioctl(cam_fd_, VIDIOC_ENUMINPUT, &cam_input) == -1) {
+    if (io_->Ioctl(cam_fd_, VIDIOC_ENUMINPUT, &cam_input) == -1) {
         error_ = fmt::format("query input {} failure", match_index);
         logger_->error(error_);
         return false;
     }
 
-    logger_->debug("try to set input index: {}, name: {}, type: {}",
-                   cam_input.index, cam_input.name, cam_input.type);
+    SPDLOG_LOGGER_DEBUG(logger_,
+                        "try to set input index: {}, name: {}, type: {}",
+                        cam_input.index, cam_input.name, cam_input.type);
 
-    if (ioctl(cam_fd_, VIDIOC_S_INPUT, &cam_input) == -1) {
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_INPUT, &cam_input) == -1) {
         error_ = fmt::format("set input {} failure: {}", cam_input.index,
                              strerror(errno));
         logger_->error(error_);
         return false;
     }
 
-    logger_->debug("set input success");
+    SPDLOG_LOGGER_DEBUG(logger_, "set input success");
 
     return true;
 }
 
-bool WebcamV4l2::QueryCapability() {
+bool WebcamV4l2::QueryCapability(struct v4l2_capability *cap) {
     if (!IsOpen()) {
         error_ = fmt::format("{} is not open", dev_name_);
         logger_->error(error_);
@@ -259,7 +535,7 @@ bool WebcamV4l2::QueryCapability() {
     }
 
     struct v4l2_capability cam_cap;
-    if (ioctl(cam_fd_, VIDIOC_QUERYCAP, &cam_cap) == -1) {
+    if (io_->Ioctl(cam_fd_, VIDIOC_QUERYCAP, &cam_cap) == -1) {
         error_ = FormatErrno();
         logger_->error("query capibility failure: {}", error_);
         return false;
@@ -271,12 +547,23 @@ bool WebcamV4l2::QueryCapability() {
     logger_->info("bus info    : {}", cam_cap.bus_info);
 
     capabilities_ = cam_cap.capabilities;
+    // single planar where both are offered, plenty of code expects it
+    buf_type_ = (capabilities_ & V4L2_CAP_VIDEO_CAPTURE) == 0 &&
+                        (capabilities_ & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
+                    ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+                    : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    device_key_ = DeviceKey(dev_name_, cam_cap);
+    bus_info_ = (char *)cam_cap.bus_info;
+    if (cap) {
+        *cap = cam_cap;
+    }
     return true;
 }
 
 bool WebcamV4l2::IsV4l2VideoDevice() {
     // Judge if the device is a camera device
-    return (capabilities_ & V4L2_CAP_VIDEO_CAPTURE) != 0;
+    return (capabilities_ & (V4L2_CAP_VIDEO_CAPTURE |
+                             V4L2_CAP_VIDEO_CAPTURE_MPLANE)) != 0;
 }
 
 std::string WebcamV4l2::PixFormatName(uint32_t format) {
@@ -286,342 +573,1909 @@ std::string WebcamV4l2::PixFormatName(uint32_t format) {
     return buf;
 }
 
-bool WebcamV4l2::SetPixFormat(WebcamFormat fmt, uint32_t width,
-                              uint32_t height) {
-    if (!IsV4l2VideoDevice()) {
-        error_ = fmt::format("{} is not a video device", dev_name_);
-        logger_->error(error_);
-        return false;
+void WebcamV4l2::InitFormat(uint32_t fourcc, uint32_t width, uint32_t height,
+                            struct v4l2_format &v4l2_fmt) const {
+    memset(&v4l2_fmt, 0, sizeof(v4l2_fmt));
+    v4l2_fmt.type = buf_type_;
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf_type_)) {
+        v4l2_fmt.fmt.pix_mp.width = width;
+        v4l2_fmt.fmt.pix_mp.height = height;
+        v4l2_fmt.fmt.pix_mp.pixelformat = fourcc;
+        v4l2_fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+    } else {
+        v4l2_fmt.fmt.pix.width = width;
+        v4l2_fmt.fmt.pix.height = height;
+        v4l2_fmt.fmt.pix.pixelformat = fourcc;
+        v4l2_fmt.fmt.pix.field = V4L2_FIELD_ANY;
     }
+}
 
-    uint32_t pix_format = 0;
-
-    struct v4l2_fmtdesc fmt_desc;
-    fmt_desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt_desc.index = 0;
-    while (ioctl(cam_fd_, VIDIOC_ENUM_FMT, &fmt_desc) == 0) {
-        logger_->info("enumerate format: {}, {}",
-                      PixFormatName(fmt_desc.pixelformat),
-                      fmt_desc.description);
-
-        if (fmt == WebcamFormat::kFmtMJPG &&
-            fmt_desc.pixelformat == V4L2_PIX_FMT_MJPEG) {
-            pix_format = V4L2_PIX_FMT_MJPEG;
+void WebcamV4l2::ApplyFormat(const struct v4l2_format &v4l2_fmt) {
+    memset(plane_fmt_, 0, sizeof(plane_fmt_));
+    if (V4L2_TYPE_IS_MULTIPLANAR(v4l2_fmt.type)) {
+        auto &pix = v4l2_fmt.fmt.pix_mp;
+        format_ = pix.pixelformat;
+        num_planes_ = std::max<uint32_t>(
+            std::min<uint32_t>(pix.num_planes, VIDEO_MAX_PLANES), 1);
+        sizeimage_ = 0;
+        for (uint32_t p = 0; p < num_planes_; ++p) {
+            plane_fmt_[p] = pix.plane_fmt[p];
+            sizeimage_ += pix.plane_fmt[p].sizeimage;
         }
-
-        if (fmt == WebcamFormat::kFmtYUYV &&
-            fmt_desc.pixelformat == V4L2_PIX_FMT_YUYV) {
-            pix_format = V4L2_PIX_FMT_YUYV;
+    } else {
+        auto &pix = v4l2_fmt.fmt.pix;
+        format_ = pix.pixelformat;
+        num_planes_ = 1;
+        sizeimage_ = pix.sizeimage;
+        plane_fmt_[0].sizeimage = pix.sizeimage;
+        plane_fmt_[0].bytesperline = pix.bytesperline;
+    }
+
+    // NV12M and alike bring a buffer plane per color plane, the others
+    // pack all color planes into one
+    color_planes_ = num_planes_;
+    if (num_planes_ == 1) {
+        color_planes_ =
+            FormatLayout(format_, FmtWidth(v4l2_fmt), FmtHeight(v4l2_fmt),
+                         plane_fmt_[0].bytesperline, plane_layout_);
+    } else {
+        for (uint32_t p = 0; p < num_planes_; ++p) {
+            plane_layout_[p].plane = p;
+            plane_layout_[p].offset = 0;
+            plane_layout_[p].bytesperline = plane_fmt_[p].bytesperline;
+            plane_layout_[p].size = plane_fmt_[p].sizeimage;
         }
+    }
+}
 
-        struct v4l2_frmsizeenum frmsize;
-        frmsize.pixel_format = fmt_desc.pixelformat;
-        frmsize.index = 0;
-        while (ioctl(cam_fd_, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0) {
-            logger_->debug("frame size: {}x{}", frmsize.discrete.width,
-                           frmsize.discrete.height);
+uint32_t WebcamV4l2::FormatLayout(uint32_t fourcc, uint32_t width,
+                                  uint32_t height, uint32_t bytesperline,
+                                  WebcamPlaneLayout *layout) {
+    // bytes per pixel of the first plane, 0 for compressed formats
+    uint32_t depth = 0;
+    // chroma planes and their subsampling
+    uint32_t chroma = 0;
+    uint32_t chroma_line_div = 1;
+    switch (fourcc) {
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_JPEG:
+    case V4L2_PIX_FMT_H264:
+        break;
+    case V4L2_PIX_FMT_GREY:
+        depth = 1;
+        break;
+    case V4L2_PIX_FMT_YUYV:
+    case V4L2_PIX_FMT_Y16:
+        depth = 2;
+        break;
+    case V4L2_PIX_FMT_RGB24:
+    case V4L2_PIX_FMT_BGR24:
+        depth = 3;
+        break;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_NV12M:
+        depth = 1;
+        chroma = 1;
+        break;
+    case V4L2_PIX_FMT_YUV420:
+    case V4L2_PIX_FMT_YUV420M:
+        depth = 1;
+        chroma = 2;
+        chroma_line_div = 2;
+        break;
+    default:
+        // unknown, one plane of what the driver reports
+        layout[0] = WebcamPlaneLayout();
+        layout[0].bytesperline = bytesperline;
+        layout[0].size = bytesperline * height;
+        return 1;
+    }
 
-            struct v4l2_frmivalenum frmival;
-            memset(&frmival, 0, sizeof(frmival));
-            frmival.pixel_format = frmsize.pixel_format;
-            frmival.width = frmsize.discrete.width;
-            frmival.height = frmsize.discrete.height;
-            frmival.type = V4L2_FRMIVAL_TYPE_DISCRETE;
-            frmival.index = 0;
+    layout[0] = WebcamPlaneLayout();
+    if (!depth) {
+        return 1;
+    }
 
-            while (ioctl(cam_fd_, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0) {
-                logger_->debug("frame interval: {:0.3f}s ({} fps)",
-                               (double)frmival.discrete.numerator /
-                                   frmival.discrete.denominator,
-                               frmival.discrete.denominator);
-                frmival.index++;
-            }
-            ++frmsize.index;
-        }
+    layout[0].bytesperline = std::max(bytesperline, width * depth);
+    layout[0].size = layout[0].bytesperline * height;
 
-        ++fmt_desc.index;
+    // 4:2:0, chroma lines are half as many, half as wide for planar Cb/Cr
+    uint32_t offset = layout[0].size;
+    for (uint32_t c = 1; c <= chroma; ++c) {
+        auto &plane = layout[c];
+        plane = WebcamPlaneLayout();
+        plane.offset = offset;
+        plane.bytesperline = layout[0].bytesperline / chroma_line_div;
+        plane.size = plane.bytesperline * ((height + 1) / 2);
+        offset += plane.size;
     }
+    return 1 + chroma;
+}
 
-    if (fmt_desc.index == 0) {
-        error_ = "no format is supported";
+bool WebcamV4l2::TryPixFormat(uint32_t fourcc, uint32_t width,
+                              uint32_t height, struct v4l2_format &v4l2_fmt) {
+    SPDLOG_LOGGER_DEBUG(logger_, "try format {}, {}x{}", PixFormatName(fourcc),
+                        width, height);
+    InitFormat(fourcc, width, height, v4l2_fmt);
+
+    if (io_->Ioctl(cam_fd_, VIDIOC_TRY_FMT, &v4l2_fmt) == -1) {
+        error_ = fmt::format("try format {}, {}x{} error, {}",
+                             PixFormatName(fourcc), width, height,
+                             FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    return true;
+}
+
+bool WebcamV4l2::SetPixFormat(WebcamFormat fmt, uint32_t width,
+                              uint32_t height) {
+    if (!IsV4l2VideoDevice()) {
+        error_ = fmt::format("{} is not a video device", dev_name_);
         logger_->error(error_);
         return false;
     }
 
-    // no match, select the 1st format
-    if (pix_format == 0) {
+    uint32_t pix_format = FormatFourcc(fmt);
+
+    struct v4l2_format v4l2_fmt;
+    if (!pix_format || !TryPixFormat(pix_format, width, height, v4l2_fmt) ||
+        FmtFourcc(v4l2_fmt) != pix_format) {
+        // no match, select the 1st format
+        struct v4l2_fmtdesc fmt_desc;
+        memset(&fmt_desc, 0, sizeof(fmt_desc));
+        fmt_desc.type = buf_type_;
         fmt_desc.index = 0;
-        if (ioctl(cam_fd_, VIDIOC_ENUM_FMT, &fmt_desc) == 0) {
-            pix_format = fmt_desc.pixelformat;
-        } else {
-            error_ =
-                fmt::format("get index 0 format failure, {}", FormatErrno());
+        if (io_->Ioctl(cam_fd_, VIDIOC_ENUM_FMT, &fmt_desc) == -1) {
+            error_ = fmt::format("no format is supported, {}", FormatErrno());
             logger_->error(error_);
             return false;
         }
-    }
 
-    logger_->debug("try format {}, {}x{}", PixFormatName(pix_format), width,
-                   height);
-    struct v4l2_format v4l2_fmt;
-    v4l2_fmt.type = V4L2_CAP_VIDEO_CAPTURE;
-    v4l2_fmt.fmt.pix.width = width;
-    v4l2_fmt.fmt.pix.height = height;
-    v4l2_fmt.fmt.pix.pixelformat = pix_format;
-    v4l2_fmt.fmt.pix.field = V4L2_FIELD_ANY;
+        if (pix_format) {
+            logger_->warn("format {} is not supported, fall back to {}",
+                          PixFormatName(pix_format),
+                          PixFormatName(fmt_desc.pixelformat));
+        }
+        pix_format = fmt_desc.pixelformat;
 
-    if (ioctl(cam_fd_, VIDIOC_TRY_FMT, &v4l2_fmt) == -1) {
-        error_ = fmt::format("try format {}, {}x{} error, {}",
-                             PixFormatName(pix_format), width, height,
-                             FormatErrno());
-        logger_->error(error_);
-        return false;
+        if (!TryPixFormat(pix_format, width, height, v4l2_fmt)) {
+            return false;
+        }
     }
 
-    if (v4l2_fmt.fmt.pix.pixelformat != pix_format) {
+    if (FmtFourcc(v4l2_fmt) != pix_format) {
         error_ = fmt::format("format {} is not supported, run as {}",
                              PixFormatName(pix_format),
-                             PixFormatName(v4l2_fmt.fmt.pix.pixelformat));
+                             PixFormatName(FmtFourcc(v4l2_fmt)));
         logger_->error(error_);
         return false;
     }
 
-    if (v4l2_fmt.fmt.pix.width != width || v4l2_fmt.fmt.pix.height != height) {
+    if (FmtWidth(v4l2_fmt) != width || FmtHeight(v4l2_fmt) != height) {
         logger_->info("adjust resolution from {}x{} to {}x{}", width, height,
-                      v4l2_fmt.fmt.pix.width, v4l2_fmt.fmt.pix.height);
+                      FmtWidth(v4l2_fmt), FmtHeight(v4l2_fmt));
     }
 
-    if (ioctl(cam_fd_, VIDIOC_S_FMT, &v4l2_fmt) == -1) {
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_FMT, &v4l2_fmt) == -1) {
         error_ = fmt::format("set pixel format failure, {}", FormatErrno());
         logger_->error(error_);
         return false;
     }
 
-    format_ = pix_format;
-    logger_->info("enable pixel format {} {}x{}", PixFormatName(format_),
-                  v4l2_fmt.fmt.pix.width, v4l2_fmt.fmt.pix.height);
+    ApplyFormat(v4l2_fmt);
+    logger_->info("enable pixel format {} {}x{}, {} planes in {} buffer planes",
+                  PixFormatName(format_), FmtWidth(v4l2_fmt),
+                  FmtHeight(v4l2_fmt), color_planes_, num_planes_);
 
     return true;
 }
 
-void WebcamV4l2::Release() {
-    Stop();
-
-    Close();
-
-    capabilities_ = 0;
-    format_ = 0;
-}
+bool WebcamV4l2::QueryModes(std::vector<WebcamMode> &modes, bool refresh) {
+    if (!IsOpen() || device_key_.empty()) {
+        error_ = fmt::format("{} is not initialized", dev_name_);
+        logger_->error(error_);
+        return false;
+    }
 
-bool WebcamV4l2::SetMMap() {
-    if (buf_stat_) {
-        return true;
+    {
+        std::lock_guard<std::mutex> lock(g_mode_cache_mutex);
+        auto it = g_mode_cache.find(device_key_);
+        if (!refresh && it != g_mode_cache.end()) {
+            modes = it->second;
+            return true;
+        }
     }
 
-    if ((capabilities_ & V4L2_CAP_STREAMING) == 0) {
-        error_ = fmt::format("set mmap failure, {} is not a streaming device",
-                             dev_name_);
-        logger_->error(error_);
+    std::vector<WebcamMode> found;
+    if (!EnumerateModes(found)) {
         return false;
     }
 
-    std::unique_ptr<V4l2BufStat, V4l2BufStatDeleter> buf_stat(
-        new V4l2BufStat, V4l2BufStatDeleter());
+    std::lock_guard<std::mutex> lock(g_mode_cache_mutex);
+    g_mode_cache[device_key_] = found;
+    modes = std::move(found);
+    return true;
+}
 
-    // request
-    struct v4l2_requestbuffers req;
-    memset(&req, 0, sizeof(req));
-    req.count = QBUF_SIZE;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+bool WebcamV4l2::EnumerateModes(std::vector<WebcamMode> &modes) {
+    struct v4l2_fmtdesc fmt_desc;
+    memset(&fmt_desc, 0, sizeof(fmt_desc));
+    fmt_desc.type = buf_type_;
+    fmt_desc.index = 0;
+    while (io_->Ioctl(cam_fd_, VIDIOC_ENUM_FMT, &fmt_desc) == 0) {
+        logger_->info("enumerate format: {}, {}",
+                      PixFormatName(fmt_desc.pixelformat),
+                      fmt_desc.description);
 
-    if (ioctl(cam_fd_, VIDIOC_REQBUFS, &req) == -1) {
-        error_ = fmt::format("VIDIOC_REQBUFS failure, {}", FormatErrno());
-        logger_->error(error_);
-        return false;
+        struct v4l2_frmsizeenum frmsize;
+        memset(&frmsize, 0, sizeof(frmsize));
+        frmsize.pixel_format = fmt_desc.pixelformat;
+        frmsize.index = 0;
+        while (io_->Ioctl(cam_fd_, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0) {
+            WebcamMode mode;
+            mode.fourcc = fmt_desc.pixelformat;
+            mode.description = (char *)fmt_desc.description;
+            if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+                mode.width = frmsize.discrete.width;
+                mode.height = frmsize.discrete.height;
+            } else {
+                mode.width = frmsize.stepwise.max_width;
+                mode.height = frmsize.stepwise.max_height;
+            }
+            SPDLOG_LOGGER_DEBUG(logger_, "frame size: {}x{}", mode.width,
+                                mode.height);
+
+            struct v4l2_frmivalenum frmival;
+            memset(&frmival, 0, sizeof(frmival));
+            frmival.pixel_format = mode.fourcc;
+            frmival.width = mode.width;
+            frmival.height = mode.height;
+            frmival.index = 0;
+
+            while (io_->Ioctl(cam_fd_, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) ==
+                   0) {
+                if (frmival.type != V4L2_FRMIVAL_TYPE_DISCRETE) {
+                    mode.intervals.push_back(frmival.stepwise.min);
+                    mode.intervals.push_back(frmival.stepwise.max);
+                    mode.stepwise = true;
+                    break;
+                }
+                SPDLOG_LOGGER_DEBUG(logger_,
+                                    "frame interval: {:0.3f}s ({} fps)",
+                                    (double)frmival.discrete.numerator /
+                                        frmival.discrete.denominator,
+                                    frmival.discrete.denominator);
+                mode.intervals.push_back(frmival.discrete);
+                frmival.index++;
+            }
+
+            modes.push_back(mode);
+            if (frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE) {
+                break;
+            }
+            ++frmsize.index;
+        }
+
+        ++fmt_desc.index;
     }
 
-    logger_->debug("mmap information:");
-    logger_->debug("buffer for {} frames", req.count);
-    if (req.count < 2) {
-        error_ = "Insufficient buffer memory";
+    if (fmt_desc.index == 0) {
+        error_ = "no format is supported";
         logger_->error(error_);
         return false;
     }
 
-    buf_stat->type = req.type;
-    buf_stat->buffer = new V4l2BufUnit[req.count];
-    buf_stat->count = 0;
+    return true;
+}
 
-    // query and map
-    for (uint32_t i = 0; i < req.count; ++i) {
-        struct v4l2_buffer &buf = buf_stat->buf;
-        memset(&buf, 0, sizeof(struct v4l2_buffer));
+std::string WebcamSnapshot::Serialize() const {
+    std::string text;
+    text += fmt::format("card={}\n", card);
+    text += fmt::format("bus_info={}\n", bus_info);
+    text += fmt::format("input={}\n", input);
+    text += fmt::format("fourcc=0x{:08X}\n", fourcc);
+    text += fmt::format("width={}\n", width);
+    text += fmt::format("height={}\n", height);
+    text += fmt::format("timeperframe={}/{}\n", timeperframe.numerator,
+                        timeperframe.denominator);
+    text += fmt::format("buffer_count={}\n", buffer_count);
+    text += fmt::format("setup_us={}\n", setup_us);
+    for (auto &ctrl : controls) {
+        text += fmt::format("control=0x{:08X} {}\n", ctrl.first, ctrl.second);
+    }
+    return text;
+}
 
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
+bool WebcamSnapshot::Parse(const std::string &text) {
+    WebcamSnapshot snapshot;
 
-        if (ioctl(cam_fd_, VIDIOC_QUERYBUF, &buf) == -1) {
-            error_ =
-                fmt::format("query buffer {} failure, {}", i, strerror(errno));
-            logger_->error(error_);
-            return false;
+    std::istringstream in(text);
+    std::string line;
+    while (std::getline(in, line)) {
+        auto pos = line.find('=');
+        if (pos == std::string::npos) {
+            continue;
         }
 
-        auto &unit = buf_stat->buffer[i];
-        unit.index = i;
-        unit.length = buf.length;
-        unit.offset = buf.m.offset;
-        unit.start = mmap(nullptr, buf.length, PROT_READ | PROT_WRITE,
-                          MAP_SHARED, cam_fd_, buf.m.offset);
-
-        if (unit.start == MAP_FAILED) {
-            error_ = fmt::format("map buffer {} failure, {}", i, FormatErrno());
-            logger_->error(error_);
-            return false;
+        std::string key = line.substr(0, pos);
+        std::string value = line.substr(pos + 1);
+        const char *v = value.c_str();
+        if (key == "card") {
+            snapshot.card = value;
+        } else if (key == "bus_info") {
+            snapshot.bus_info = value;
+        } else if (key == "input") {
+            snapshot.input = strtoul(v, nullptr, 0);
+        } else if (key == "fourcc") {
+            snapshot.fourcc = strtoul(v, nullptr, 0);
+        } else if (key == "width") {
+            snapshot.width = strtoul(v, nullptr, 0);
+        } else if (key == "height") {
+            snapshot.height = strtoul(v, nullptr, 0);
+        } else if (key == "timeperframe") {
+            char *end = nullptr;
+            snapshot.timeperframe.numerator = strtoul(v, &end, 0);
+            if (*end == '/') {
+                snapshot.timeperframe.denominator = strtoul(end + 1, nullptr, 0);
+            }
+        } else if (key == "buffer_count") {
+            snapshot.buffer_count = strtoul(v, nullptr, 0);
+        } else if (key == "setup_us") {
+            snapshot.setup_us = strtoull(v, nullptr, 0);
+        } else if (key == "control") {
+            char *end = nullptr;
+            uint32_t id = strtoul(v, &end, 0);
+            snapshot.controls.emplace_back(id, strtol(end, nullptr, 0));
         }
-        buf_stat->count = i + 1;
     }
 
-    // put in queue
-    for (uint32_t i = 0; i < req.count; ++i) {
-        struct v4l2_buffer &buf = buf_stat->buf;
-        memset(&buf, 0, sizeof(struct v4l2_buffer));
-
-        buf.index = i;
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-
-        if (ioctl(cam_fd_, VIDIOC_QBUF, &buf) == -1) {
-            error_ = fmt::format("unable to queue buffer, {}", FormatErrno());
-            logger_->error(error_);
-            return false;
-        }
+    if (snapshot.card.empty() || !snapshot.fourcc || !snapshot.width ||
+        !snapshot.height) {
+        return false;
     }
 
-    buf_stat_ = std::move(buf_stat);
+    *this = std::move(snapshot);
     return true;
 }
 
-bool WebcamV4l2::FreeMMap() {
-    if (buf_stat_) {
-        buf_stat_.reset();
+bool WebcamV4l2::TakeSnapshot(WebcamSnapshot &snapshot) {
+    if (!IsOpen() || !format_) {
+        error_ = "format is not negotiated";
+        logger_->error(error_);
+        return false;
     }
-    return true;
-}
 
-bool WebcamV4l2::StreamOn() {
-    if (!buf_stat_) {
-        error_ = "mmap is not ready";
+    struct v4l2_capability cam_cap;
+    if (io_->Ioctl(cam_fd_, VIDIOC_QUERYCAP, &cam_cap) == -1) {
+        error_ = fmt::format("query capability failure, {}", FormatErrno());
         logger_->error(error_);
         return false;
     }
 
-    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(cam_fd_, VIDIOC_STREAMON, &type) == -1) {
-        error_ = fmt::format("streamon failure, {}", FormatErrno());
+    struct v4l2_format v4l2_fmt;
+    memset(&v4l2_fmt, 0, sizeof(v4l2_fmt));
+    v4l2_fmt.type = buf_type_;
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_FMT, &v4l2_fmt) == -1) {
+        error_ = fmt::format("VIDIOC_G_FMT failure, {}", FormatErrno());
         logger_->error(error_);
         return false;
     }
 
-    return true;
-}
+    WebcamSnapshot snap;
+    snap.card = (char *)cam_cap.card;
+    snap.bus_info = (char *)cam_cap.bus_info;
+    snap.fourcc = FmtFourcc(v4l2_fmt);
+    snap.width = FmtWidth(v4l2_fmt);
+    snap.height = FmtHeight(v4l2_fmt);
+    snap.buffer_count = granted_count_ ? granted_count_ : buffer_count_;
+    snap.setup_us = setup_us_;
 
-bool WebcamV4l2::StreamOff() {
+    int input = 0;
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_INPUT, &input) == 0) {
+        snap.input = input;
+    }
+
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = buf_type_;
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_PARM, &parm) == 0 &&
+        (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        snap.timeperframe = parm.parm.capture.timeperframe;
+    }
+
+    // plain values the application may have changed, cached ones cost no
+    // ioctl
+    LoadControls();
+    std::vector<uint32_t> uncached;
+    {
+        std::lock_guard<std::mutex> lock(ctrl_mutex_);
+        for (auto &it : ctrl_) {
+            auto &queryctrl = it.second.queryctrl;
+            bool plain = queryctrl.type == V4L2_CTRL_TYPE_INTEGER ||
+                         queryctrl.type == V4L2_CTRL_TYPE_BOOLEAN ||
+                         queryctrl.type == V4L2_CTRL_TYPE_MENU ||
+                         queryctrl.type == V4L2_CTRL_TYPE_INTEGER_MENU;
+            uint32_t skip = V4L2_CTRL_FLAG_DISABLED |
+                            V4L2_CTRL_FLAG_READ_ONLY |
+                            V4L2_CTRL_FLAG_WRITE_ONLY |
+                            V4L2_CTRL_FLAG_VOLATILE;
+            if (!plain || (queryctrl.flags & skip)) {
+                continue;
+            }
+            if (it.second.cached) {
+                snap.controls.emplace_back(it.first,
+                                           it.second.control.value);
+            } else {
+                uncached.push_back(it.first);
+            }
+        }
+    }
+    for (auto id : uncached) {
+        struct v4l2_control control;
+        memset(&control, 0, sizeof(control));
+        control.id = id;
+        if (io_->Ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == 0) {
+            snap.controls.emplace_back(control.id, control.value);
+        }
+    }
+
+    snapshot = std::move(snap);
+    return true;
+}
+
+bool WebcamV4l2::RestoreFrom(const WebcamSnapshot &snapshot) {
+    if (working_) {
+        error_ = "can not restore while streaming";
+        logger_->error(error_);
+        return false;
+    }
+
+    if (!IsOpen() && !Open()) {
+        return false;
+    }
+
+    struct v4l2_capability cam_cap;
+    if (!QueryCapability(&cam_cap)) {
+        return false;
+    }
+
+    if (!IsV4l2VideoDevice()) {
+        error_ = fmt::format("{} is not a video device", dev_name_);
+        logger_->error(error_);
+        return false;
+    }
+
+    if (snapshot.card != (char *)cam_cap.card ||
+        snapshot.bus_info != (char *)cam_cap.bus_info) {
+        error_ = fmt::format("snapshot of {} on {} does not match {} on {}",
+                             snapshot.card, snapshot.bus_info, cam_cap.card,
+                             cam_cap.bus_info);
+        logger_->error(error_);
+        return false;
+    }
+
+    int input = snapshot.input;
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_INPUT, &input) == -1) {
+        error_ = fmt::format("set input {} failure, {}", input, FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    // the snapshot holds what the driver accepted before, skip TRY_FMT
+    struct v4l2_format v4l2_fmt;
+    InitFormat(snapshot.fourcc, snapshot.width, snapshot.height, v4l2_fmt);
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_FMT, &v4l2_fmt) == -1) {
+        error_ = fmt::format("set pixel format failure, {}", FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    if (FmtFourcc(v4l2_fmt) != snapshot.fourcc ||
+        FmtWidth(v4l2_fmt) != snapshot.width ||
+        FmtHeight(v4l2_fmt) != snapshot.height) {
+        error_ = fmt::format("device runs {} {}x{} instead of the snapshot",
+                             PixFormatName(FmtFourcc(v4l2_fmt)),
+                             FmtWidth(v4l2_fmt), FmtHeight(v4l2_fmt));
+        logger_->error(error_);
+        return false;
+    }
+    ApplyFormat(v4l2_fmt);
+
+    if (snapshot.timeperframe.denominator) {
+        struct v4l2_streamparm parm;
+        memset(&parm, 0, sizeof(parm));
+        parm.type = buf_type_;
+        parm.parm.capture.timeperframe = snapshot.timeperframe;
+        if (io_->Ioctl(cam_fd_, VIDIOC_S_PARM, &parm) == -1) {
+            // Not fatal, like SetFps
+            logger_->warn("restore frame interval failure, {}", FormatErrno());
+        }
+    }
+
+    if (snapshot.buffer_count >= 2) {
+        buffer_count_ = snapshot.buffer_count;
+    }
+
+    RestoreControls(snapshot);
+
+    cold_setup_us_ = snapshot.setup_us;
+    logger_->info("restored {} {}x{} on {}", PixFormatName(format_),
+                  snapshot.width, snapshot.height, snapshot.bus_info);
+    return true;
+}
+
+bool WebcamV4l2::Reconnect(const char *name, const WebcamSnapshot &snapshot,
+                           bool start) {
+    if (!name) {
+        return false;
+    }
+
+    // what is left of the lost device is stale, fd and buffers alike
+    Release();
+
+    std::string old_name = dev_name_;
+    dev_name_ = name;
+    if (!RestoreFrom(snapshot) || (start && !Start())) {
+        std::string error = error_;
+        Release();
+        dev_name_ = old_name;
+        error_ = error;
+        return false;
+    }
+
+    logger_->info("reconnected {} on {}", snapshot.bus_info, dev_name_);
+    return true;
+}
+
+bool WebcamV4l2::QueryBusInfo(const char *name, std::string &bus_info) {
+    int fd = io_->Open(name, O_RDWR | O_NONBLOCK);
+    if (fd == -1) {
+        error_ = fmt::format("open {} failure, {}", name, FormatErrno());
+        return false;
+    }
+
+    struct v4l2_capability cam_cap;
+    bool ok = io_->Ioctl(fd, VIDIOC_QUERYCAP, &cam_cap) == 0;
+    if (ok) {
+        bus_info = (char *)cam_cap.bus_info;
+    } else {
+        error_ = fmt::format("query capability of {} failure, {}", name,
+                             FormatErrno());
+    }
+    io_->Close(fd);
+    return ok;
+}
+
+bool WebcamV4l2::RestoreControls(const WebcamSnapshot &snapshot) {
+    if (snapshot.controls.empty()) {
+        return true;
+    }
+
+    // one ioctl for all of them, the driver applies them in order
+    std::vector<struct v4l2_ext_control> ctrls(snapshot.controls.size());
+    for (size_t i = 0; i < ctrls.size(); ++i) {
+        memset(&ctrls[i], 0, sizeof(ctrls[i]));
+        ctrls[i].id = snapshot.controls[i].first;
+        ctrls[i].value = snapshot.controls[i].second;
+    }
+
+    struct v4l2_ext_controls ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count = ctrls.size();
+    ext.controls = ctrls.data();
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_EXT_CTRLS, &ext) == 0) {
+        for (auto &ctrl : ctrls) {
+            CacheControl(ctrl.id, ctrl.value);
+        }
+        return true;
+    }
+
+    // e.g. a manual value rejected while its auto mode is on, set what can
+    // be set one by one
+    logger_->warn("restore controls at once failure, {}, one by one",
+                  FormatErrno());
+    bool ret = true;
+    for (auto &ctrl : snapshot.controls) {
+        struct v4l2_control control;
+        control.id = ctrl.first;
+        control.value = ctrl.second;
+        if (io_->Ioctl(cam_fd_, VIDIOC_S_CTRL, &control) == -1) {
+            logger_->warn("restore control 0x{:X} failure, {}", ctrl.first,
+                          FormatErrno());
+            ret = false;
+        } else {
+            CacheControl(control.id, control.value);
+        }
+    }
+    return ret;
+}
+
+void WebcamV4l2::Release() {
+    Stop();
+
+    Close();
+
+    capabilities_ = 0;
+    format_ = 0;
+}
+
+bool WebcamV4l2::SetMMap() {
+    if ((capabilities_ & V4L2_CAP_STREAMING) == 0) {
+        error_ = fmt::format("set mmap failure, {} is not a streaming device",
+                             dev_name_);
+        logger_->error(error_);
+        return false;
+    }
+
+    std::unique_ptr<V4l2BufStat, V4l2BufStatDeleter> buf_stat(
+        new V4l2BufStat, V4l2BufStatDeleter());
+
+    // request
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = buffer_count_;
+    req.type = buf_type_;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (io_->Ioctl(cam_fd_, VIDIOC_REQBUFS, &req) == -1) {
+        error_ = fmt::format("VIDIOC_REQBUFS failure, {}", FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    granted_count_ = req.count;
+    SPDLOG_LOGGER_DEBUG(logger_, "mmap information:");
+    logger_->info("driver granted {} of {} buffers", req.count,
+                  buffer_count_);
+    if (req.count < 2) {
+        error_ = "Insufficient buffer memory";
+        logger_->error(error_);
+        return false;
+    }
+
+    bool mplane = V4L2_TYPE_IS_MULTIPLANAR(buf_type_);
+    buf_stat->io = io_.get();
+    buf_stat->type = req.type;
+    buf_stat->memory = req.memory;
+    buf_stat->num_planes = num_planes_;
+    buf_stat->buffer = new V4l2BufUnit[req.count];
+    buf_stat->count = 0;
+
+    // query and map
+    for (uint32_t i = 0; i < req.count; ++i) {
+        auto &unit = buf_stat->buffer[i];
+        unit.index = i;
+
+        struct v4l2_buffer &buf = buf_stat->buf;
+        memset(&buf, 0, sizeof(struct v4l2_buffer));
+
+        buf.type = buf_type_;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+        if (mplane) {
+            memset(unit.v4l2_planes, 0, sizeof(unit.v4l2_planes));
+            buf.m.planes = unit.v4l2_planes;
+            buf.length = VIDEO_MAX_PLANES;
+        }
+
+        if (io_->Ioctl(cam_fd_, VIDIOC_QUERYBUF, &buf) == -1) {
+            error_ =
+                fmt::format("query buffer {} failure, {}", i, strerror(errno));
+            logger_->error(error_);
+            return false;
+        }
+
+        // counted now, so the deleter unmaps the planes mapped so far
+        buf_stat->count = i + 1;
+        unit.num_planes = mplane ? std::min<uint32_t>(buf.length,
+                                                      VIDEO_MAX_PLANES)
+                                 : 1;
+        for (uint32_t p = 0; p < unit.num_planes; ++p) {
+            auto &plane = unit.plane[p];
+            plane.length = mplane ? buf.m.planes[p].length : buf.length;
+            plane.offset =
+                mplane ? buf.m.planes[p].m.mem_offset : buf.m.offset;
+            void *start =
+                io_->MMap(plane.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          cam_fd_, plane.offset);
+
+            if (start == MAP_FAILED) {
+                error_ = fmt::format("map buffer {} plane {} failure, {}", i,
+                                     p, FormatErrno());
+                logger_->error(error_);
+                return false;
+            }
+            plane.start = start;
+        }
+    }
+
+    if (export_dmabuf_) {
+        ExportDmaBuf(buf_stat.get());
+    }
+
+    // put in queue
+    for (uint32_t i = 0; i < req.count; ++i) {
+        struct v4l2_buffer &buf = buf_stat->buf;
+        PrepareBuffer(buf_stat.get(), i, buf);
+
+        if (io_->Ioctl(cam_fd_, VIDIOC_QBUF, &buf) == -1) {
+            error_ = fmt::format("unable to queue buffer, {}", FormatErrno());
+            logger_->error(error_);
+            return false;
+        }
+    }
+
+    buf_stat_ = std::move(buf_stat);
+    return true;
+}
+
+void WebcamV4l2::PrepareBuffer(V4l2BufStat *buf_stat, uint32_t index,
+                               struct v4l2_buffer &buf) {
+    auto &unit = buf_stat->buffer[index];
+
+    memset(&buf, 0, sizeof(buf));
+    buf.index = index;
+    buf.type = buf_stat->type;
+    buf.memory = buf_stat->memory;
+
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+        memset(unit.v4l2_planes, 0, sizeof(unit.v4l2_planes[0]) *
+                                        unit.num_planes);
+        if (buf.memory == V4L2_MEMORY_USERPTR) {
+            for (uint32_t p = 0; p < unit.num_planes; ++p) {
+                unit.v4l2_planes[p].m.userptr =
+                    (unsigned long)unit.plane[p].start;
+                unit.v4l2_planes[p].length = unit.plane[p].length;
+            }
+        }
+        buf.m.planes = unit.v4l2_planes;
+        buf.length = unit.num_planes;
+    } else if (buf.memory == V4L2_MEMORY_USERPTR) {
+        buf.m.userptr = (unsigned long)unit.plane[0].start;
+        buf.length = unit.plane[0].length;
+    }
+}
+
+void WebcamV4l2::ExportDmaBuf(V4l2BufStat *buf_stat) {
+    for (int i = 0; i < buf_stat->count; ++i) {
+        auto &unit = buf_stat->buffer[i];
+        for (uint32_t p = 0; p < unit.num_planes; ++p) {
+            struct v4l2_exportbuffer exp;
+            memset(&exp, 0, sizeof(exp));
+            exp.type = buf_stat->type;
+            exp.index = i;
+            exp.plane = p;
+            exp.flags = O_RDONLY | O_CLOEXEC;
+
+            if (io_->Ioctl(cam_fd_, VIDIOC_EXPBUF, &exp) == -1) {
+                // all or nothing, consumers then fall back to the mapped data
+                logger_->warn("export buffer {} plane {} as dmabuf failure, "
+                              "{}, dmabuf export disabled",
+                              i, p, FormatErrno());
+                for (int j = 0; j <= i; ++j) {
+                    auto &done = buf_stat->buffer[j];
+                    for (uint32_t q = 0; q < done.num_planes; ++q) {
+                        if (done.plane[q].dmabuf_fd != -1) {
+                            close(done.plane[q].dmabuf_fd);
+                            done.plane[q].dmabuf_fd = -1;
+                        }
+                    }
+                }
+                return;
+            }
+
+            unit.plane[p].dmabuf_fd = exp.fd;
+        }
+    }
+
+    SPDLOG_LOGGER_DEBUG(logger_, "exported {} buffers as dmabuf",
+                        buf_stat->count);
+}
+
+bool WebcamV4l2::IsDmaBufExported() const {
+    return buf_stat_ && buf_stat_->count > 0 &&
+           buf_stat_->buffer[0].plane[0].dmabuf_fd != -1;
+}
+
+bool WebcamV4l2::SetIo(const std::shared_ptr<V4l2Io> &io) {
+    if (IsOpen()) {
+        error_ = "can not replace io of an open device";
+        logger_->error(error_);
+        return false;
+    }
+
+    io_ = io ? io : V4l2Io::System();
+    return true;
+}
+
+bool WebcamV4l2::SetUserPtr() {
+    if ((capabilities_ & V4L2_CAP_STREAMING) == 0) {
+        error_ = fmt::format(
+            "set userptr failure, {} is not a streaming device", dev_name_);
+        logger_->error(error_);
+        return false;
+    }
+
+    // one caller buffer per frame, planes would need one each
+    if (num_planes_ > 1) {
+        error_ = fmt::format("user buffers need a single plane format, {} "
+                             "has {}",
+                             PixFormatName(format_), num_planes_);
+        logger_->error(error_);
+        return false;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (size_t i = 0; i < user_buffers_.size(); ++i) {
+        auto &unit = user_buffers_[i];
+        if ((uintptr_t)unit.start % page_size) {
+            error_ = fmt::format("user buffer {} is not page aligned",
+                                 unit.start);
+            logger_->error(error_);
+            return false;
+        }
+        // the driver would refuse it on QBUF with a bare EINVAL, or worse
+        if (unit.length < sizeimage_) {
+            error_ = fmt::format("user buffer {} holds {} bytes, {} frames "
+                                 "need {}",
+                                 i, unit.length, PixFormatName(format_),
+                                 sizeimage_);
+            logger_->error(error_);
+            return false;
+        }
+    }
+
+    std::unique_ptr<V4l2BufStat, V4l2BufStatDeleter> buf_stat(
+        new V4l2BufStat, V4l2BufStatDeleter());
+
+    struct v4l2_requestbuffers req;
+    memset(&req, 0, sizeof(req));
+    req.count = user_buffers_.size();
+    req.type = buf_type_;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (io_->Ioctl(cam_fd_, VIDIOC_REQBUFS, &req) == -1) {
+        error_ = fmt::format("VIDIOC_REQBUFS userptr failure, {}",
+                             FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    // the driver may grant fewer slots than buffers in the pool
+    uint32_t count = std::min<uint32_t>(req.count, user_buffers_.size());
+    granted_count_ = count;
+    logger_->info("driver granted {} of {} user buffers", count,
+                  user_buffers_.size());
+    if (count < 2) {
+        error_ = "Insufficient user buffers";
+        logger_->error(error_);
+        return false;
+    }
+
+    buf_stat->io = io_.get();
+    buf_stat->type = req.type;
+    buf_stat->memory = req.memory;
+    buf_stat->buffer = new V4l2BufUnit[count];
+    buf_stat->count = count;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        auto &unit = buf_stat->buffer[i];
+        unit.index = i;
+        unit.plane[0].length = user_buffers_[i].length;
+        unit.plane[0].start = user_buffers_[i].start;
+
+        struct v4l2_buffer &buf = buf_stat->buf;
+        PrepareBuffer(buf_stat.get(), i, buf);
+
+        if (io_->Ioctl(cam_fd_, VIDIOC_QBUF, &buf) == -1) {
+            error_ = fmt::format("unable to queue user buffer {}, {}", i,
+                                 FormatErrno());
+            logger_->error(error_);
+            return false;
+        }
+    }
+
+    buf_stat_ = std::move(buf_stat);
+    return true;
+}
+
+bool WebcamV4l2::SetBuffers() {
+    if (buf_stat_) {
+        return true;
+    }
+
+    bool ret =
+        memory_ == V4L2_MEMORY_USERPTR ? SetUserPtr() : SetMMap();
+    if (!ret) {
+        // drop the partly set up buffers in the driver as well
+        struct v4l2_requestbuffers req;
+        memset(&req, 0, sizeof(req));
+        req.type = buf_type_;
+        req.memory = memory_;
+        io_->Ioctl(cam_fd_, VIDIOC_REQBUFS, &req);
+    }
+    return ret;
+}
+
+bool WebcamV4l2::SetUserBuffers(const std::vector<UserBuffer> &buffers) {
+    if (buf_stat_) {
+        error_ = "can not change buffers while streaming";
+        logger_->error(error_);
+        return false;
+    }
+
+    user_buffers_ = buffers;
+    memory_ = buffers.empty() ? V4L2_MEMORY_MMAP : V4L2_MEMORY_USERPTR;
+    return true;
+}
+
+bool WebcamV4l2::SetBufferCount(uint32_t count) {
+    if (count < 2) {
+        error_ = fmt::format("{} buffers are too few, at least 2", count);
+        logger_->error(error_);
+        return false;
+    }
+
+    buffer_count_ = count;
+    return true;
+}
+
+void WebcamV4l2::SetAdaptiveBufferCount(bool enable, uint32_t min_count,
+                                        uint32_t max_count) {
+    adaptive_buffers_ = enable;
+    min_buffers_ = std::max<uint32_t>(min_count, 2);
+    max_buffers_ = std::max(max_count, min_buffers_);
+}
+
+void WebcamV4l2::AdaptBufferCount() {
+    // user pointer pools are sized by the caller
+    if (memory_ != V4L2_MEMORY_MMAP || usage_.frames < 2 ||
+        usage_.last_sequence <= usage_.first_sequence) {
+        return;
+    }
+
+    uint64_t interval = (usage_.last_ts_us - usage_.first_ts_us) /
+                        (usage_.last_sequence - usage_.first_sequence);
+    if (!interval) {
+        return;
+    }
+
+    // buffers the application held at once, plus the one being filled and
+    // a spare for the driver
+    uint32_t needed = (usage_.max_hold_us + interval - 1) / interval + 2;
+
+    uint32_t count = granted_count_;
+    if (usage_.dropped) {
+        count = std::max(count + 2, needed);
+    } else if (needed < count) {
+        // shrink one at a time, a quiet session may be luck
+        --count;
+    }
+    count = std::min(std::max(count, min_buffers_), max_buffers_);
+
+    logger_->info("adapt buffer count {} -> {}, frame interval {} us, max "
+                  "hold {} us, dropped {} of {}",
+                  granted_count_, count, interval, usage_.max_hold_us,
+                  usage_.dropped, usage_.frames + usage_.dropped);
+    buffer_count_ = count;
+}
+
+bool WebcamV4l2::DequeueBuffer(struct v4l2_buffer &buf) {
+    // the index is unknown until the buffer is out
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    bool mplane = V4L2_TYPE_IS_MULTIPLANAR(buf.type);
+    if (mplane) {
+        memset(planes, 0, sizeof(planes[0]) * buf_stat_->num_planes);
+        buf.m.planes = planes;
+        buf.length = buf_stat_->num_planes;
+    }
+
+    util::TraceScope trace("VIDIOC_DQBUF", util::kTraceNoFrame);
+    if (io_->Ioctl(cam_fd_, VIDIOC_DQBUF, &buf) == -1) {
+        return false;
+    }
+    trace.SetFrame(buf.sequence);
+
+    auto &unit = buf_stat_->buffer[buf.index];
+    if (mplane) {
+        memcpy(unit.v4l2_planes, planes, sizeof(planes[0]) * buf.length);
+        buf.m.planes = unit.v4l2_planes;
+    }
+
+    uint64_t now = NowUs();
+    unit.dequeued_us = now;
+    if (wait_begin_us_) {
+        metrics_.wait.Record(now - wait_begin_us_);
+        wait_begin_us_ = 0;
+    }
+    if (resume_begin_us_) {
+        uint64_t first = now - resume_begin_us_;
+        resume_stats_.last_first_frame_us = first;
+        resume_stats_.max_first_frame_us =
+            std::max(resume_stats_.max_first_frame_us, first);
+        resume_begin_us_ = 0;
+    }
+
+    uint64_t ts = buf.timestamp.tv_sec * 1000000ull + buf.timestamp.tv_usec;
+    frame_dropped_ = 0;
+    if (!usage_.frames) {
+        usage_.first_sequence = buf.sequence;
+        usage_.first_ts_us = ts;
+    } else if (buf.sequence > usage_.last_sequence + 1) {
+        frame_dropped_ = buf.sequence - usage_.last_sequence - 1;
+        usage_.dropped += frame_dropped_;
+    }
+    usage_.last_sequence = buf.sequence;
+    usage_.last_ts_us = ts;
+    ++usage_.frames;
+
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        ++usage_.errors;
+    }
+    uint32_t bytes = buf.bytesused;
+    if (mplane) {
+        bytes = 0;
+        for (uint32_t p = 0; p < buf.length; ++p) {
+            bytes += buf.m.planes[p].bytesused;
+        }
+    }
+    metrics_.OnFrame(ts, bytes, frame_dropped_,
+                     (buf.flags & V4L2_BUF_FLAG_ERROR) != 0);
+
+    return true;
+}
+
+void WebcamV4l2::MakeFrameMeta(const struct v4l2_buffer &buf, uint32_t dropped,
+                               uint32_t skipped, FrameMeta &meta) {
+    meta.timestamp = buf.timestamp;
+    meta.timestamp_us =
+        buf.timestamp.tv_sec * 1000000ull + buf.timestamp.tv_usec;
+    meta.sequence = buf.sequence;
+    meta.index = buf.index;
+    if (V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+        meta.bytesused = 0;
+        for (uint32_t p = 0; p < buf.length; ++p) {
+            auto &plane = buf.m.planes[p];
+            if (plane.bytesused > plane.data_offset) {
+                meta.bytesused += plane.bytesused - plane.data_offset;
+            }
+        }
+        meta.num_planes = buf.length;
+    } else {
+        meta.bytesused = buf.bytesused;
+        meta.num_planes = 1;
+    }
+    meta.flags = buf.flags;
+    meta.error = (buf.flags & V4L2_BUF_FLAG_ERROR) != 0;
+    meta.timestamp_type = buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK;
+    meta.timestamp_source = buf.flags & V4L2_BUF_FLAG_TSTAMP_SRC_MASK;
+    meta.dropped = dropped;
+    meta.skipped = skipped;
+}
+
+bool WebcamV4l2::DequeueFrame(struct v4l2_buffer &buf) {
+    if (!DequeueBuffer(buf)) {
+        return false;
+    }
+
+    uint32_t dropped = frame_dropped_;
+    uint32_t skipped = 0;
+
+    // hold the newest until a newer one is out, so it is never requeued
+    struct v4l2_buffer next;
+    while (latest_only_) {
+        memset(&next, 0, sizeof(next));
+        next.type = buf.type;
+        next.memory = buf.memory;
+        if (!DequeueBuffer(next)) {
+            break;
+        }
+
+        if (!QueueBuffer(buf)) {
+            logger_->error("requeue stale frame {} failure, {}", buf.sequence,
+                           FormatErrno());
+        }
+        buf = next;
+        dropped += frame_dropped_;
+        ++skipped;
+    }
+
+    usage_.skipped += skipped;
+    MakeFrameMeta(buf, dropped, skipped, frame_meta_);
+    RecordLatency(frame_meta_, buf_stat_->buffer[buf.index].dequeued_us);
+    return true;
+}
+
+void WebcamV4l2::RecordLatency(const FrameMeta &meta, uint64_t now) {
+    // other clocks are not comparable to CLOCK_MONOTONIC
+    if (meta.timestamp_type != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC) {
+        return;
+    }
+    metrics_.latency.Record(now > meta.timestamp_us ? now - meta.timestamp_us
+                                                    : 0);
+}
+
+bool WebcamV4l2::QueueBuffer(struct v4l2_buffer &buf) {
+    util::TraceScope trace("VIDIOC_QBUF", buf.sequence);
+    auto &unit = buf_stat_->buffer[buf.index];
+    if (unit.dequeued_us) {
+        uint64_t hold = NowUs() - unit.dequeued_us;
+        usage_.max_hold_us = std::max(usage_.max_hold_us, hold);
+        usage_.total_hold_us += hold;
+        metrics_.hold.Record(hold);
+        unit.dequeued_us = 0;
+    }
+
+    // from scratch, the dequeued planes are no input for QBUF
+    struct v4l2_buffer qbuf;
+    PrepareBuffer(buf_stat_.get(), buf.index, qbuf);
+    return io_->Ioctl(cam_fd_, VIDIOC_QBUF, &qbuf) != -1;
+}
+
+bool WebcamV4l2::FreeBuffers() {
+    if (buf_stat_) {
+        if (leases_ > 0) {
+            logger_->warn("free buffers with {} frame leases outstanding",
+                          leases_);
+        }
+
+        uint32_t memory = buf_stat_->memory;
+        uint32_t type = buf_stat_->type;
+        buf_stat_.reset();
+
+        // release the driver side, user pages stay pinned until then
+        struct v4l2_requestbuffers req;
+        memset(&req, 0, sizeof(req));
+        req.type = type;
+        req.memory = memory;
+        if (io_->Ioctl(cam_fd_, VIDIOC_REQBUFS, &req) == -1) {
+            logger_->warn("release buffers failure, {}", FormatErrno());
+        }
+    }
+
+    leases_ = 0;
+    ++generation_;
+    return true;
+}
+
+bool WebcamV4l2::StreamOn() {
     if (!buf_stat_) {
         error_ = "mmap is not ready";
         logger_->error(error_);
         return false;
     }
 
-    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(cam_fd_, VIDIOC_STREAMOFF, &type) == -1) {
-        error_ = fmt::format("streamoff failure, {}", FormatErrno());
-        logger_->error(error_);
+    enum v4l2_buf_type type = (enum v4l2_buf_type)buf_stat_->type;
+    if (io_->Ioctl(cam_fd_, VIDIOC_STREAMON, &type) == -1) {
+        error_ = fmt::format("streamon failure, {}", FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    return true;
+}
+
+bool WebcamV4l2::StreamOff() {
+    if (!buf_stat_) {
+        error_ = "mmap is not ready";
+        logger_->error(error_);
+        return false;
+    }
+
+    enum v4l2_buf_type type = (enum v4l2_buf_type)buf_stat_->type;
+    if (io_->Ioctl(cam_fd_, VIDIOC_STREAMOFF, &type) == -1) {
+        error_ = fmt::format("streamoff failure, {}", FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    return true;
+}
+
+bool WebcamV4l2::SetFps(uint8_t fps) {
+    if (!fps) {
+        return false;
+    }
+
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(struct v4l2_streamparm));
+    parm.type = buf_type_;
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_PARM, &parm) == -1) {
+        error_ = fmt::format("VIDIOC_G_PARM failure, {}", FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    logger_->info("current fps {}", parm.parm.capture.timeperframe.denominator);
+    if (parm.parm.capture.timeperframe.denominator == fps) {
+        return true;
+    }
+
+    logger_->info("try to set fps {}", fps);
+    struct v4l2_streamparm setfps;
+    memset(&setfps, 0, sizeof(setfps));
+    setfps.type = buf_type_;
+    setfps.parm.capture.timeperframe.numerator = 1;
+    setfps.parm.capture.timeperframe.denominator = fps;
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_PARM, &setfps) == -1) {
+        /* Not fatal - just warn about it */
+        error_ = fmt::format("set fps failure, {}", FormatErrno());
+        logger_->warn(error_);
+        return false;
+    }
+
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_PARM, &parm) == -1) {
+        error_ = fmt::format("VIDIOC_G_PARM failure, {}", FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    logger_->info("current fps {}", parm.parm.capture.timeperframe.denominator);
+    return true;
+}
+
+// Cost model estimates of NegotiateMode. Compressed sizes are typical UVC
+// camera output, decode times a libjpeg-turbo or software H.264 decoder on
+// one core. Raw formats FormatLayout does not know are costed as 2 bytes per
+// pixel, as wide as the common packed 4:2:2 and 16 bit formats, so they stay
+// candidates but never look cheaper than a format with a known size.
+static constexpr uint32_t kUnknownRawBytesPerPixel = 2;
+static constexpr uint32_t kMjpegBitsPerPixel10 = 20; // 2.0 bits per pixel
+static constexpr uint32_t kH264BitsPerPixel10 = 2;   // 0.2 bits per pixel
+static constexpr uint32_t kMjpegDecodeNsPerPixel = 3;
+static constexpr uint32_t kH264DecodeNsPerPixel = 5;
+
+struct ModeCandidate {
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    struct v4l2_fract interval;
+    bool compressed;
+    double fps;
+    double pixel_rate;
+    uint64_t frame_bytes;
+    uint64_t bandwidth;
+    uint64_t decode_us;
+    uint64_t latency_us;
+};
+
+static void EstimateMode(ModeCandidate &c, uint64_t bus_bandwidth) {
+    uint64_t pixels = (uint64_t)c.width * c.height;
+    c.compressed = false;
+    uint32_t decode_ns = 0;
+    switch (c.fourcc) {
+    case V4L2_PIX_FMT_MJPEG:
+    case V4L2_PIX_FMT_JPEG:
+        c.compressed = true;
+        c.frame_bytes = pixels * kMjpegBitsPerPixel10 / 80;
+        decode_ns = kMjpegDecodeNsPerPixel;
+        break;
+    case V4L2_PIX_FMT_H264:
+        c.compressed = true;
+        c.frame_bytes = pixels * kH264BitsPerPixel10 / 80;
+        decode_ns = kH264DecodeNsPerPixel;
+        break;
+    default: {
+        WebcamPlaneLayout layout[VIDEO_MAX_PLANES];
+        uint32_t n = WebcamV4l2::FormatLayout(c.fourcc, c.width, c.height, 0,
+                                              layout);
+        c.frame_bytes = 0;
+        for (uint32_t i = 0; i < n; ++i) {
+            c.frame_bytes += layout[i].size;
+        }
+        if (!c.frame_bytes) {
+            c.frame_bytes = pixels * kUnknownRawBytesPerPixel;
+        }
+    } break;
+    }
+
+    c.fps = (double)c.interval.denominator / c.interval.numerator;
+    c.pixel_rate = pixels * c.fps;
+    c.bandwidth = c.frame_bytes * c.fps;
+    c.decode_us = pixels * decode_ns / 1000;
+    uint64_t readout_us = 1000000ull * c.interval.numerator /
+                          c.interval.denominator;
+    uint64_t transfer_us =
+        bus_bandwidth ? c.frame_bytes * 1000000 / bus_bandwidth : 0;
+    c.latency_us = readout_us + transfer_us + c.decode_us;
+}
+
+bool WebcamV4l2::NegotiateMode(const ModeConstraints &constraints,
+                               NegotiatedMode &mode) {
+    if (working_ || paused_) {
+        error_ = "can not negotiate a mode while streaming";
+        logger_->error(error_);
+        return false;
+    }
+
+    std::vector<WebcamMode> modes;
+    if (!QueryModes(modes)) {
+        return false;
+    }
+
+    // every interval of a fitting size, for stepwise ranges both bounds and
+    // the interval of min_fps clamped into the range
+    std::vector<ModeCandidate> candidates;
+    uint32_t too_small = 0;
+    uint32_t too_slow = 0;
+    for (auto &m : modes) {
+        if (m.width < constraints.min_width ||
+            m.height < constraints.min_height) {
+            ++too_small;
+            continue;
+        }
+
+        std::vector<struct v4l2_fract> intervals = m.intervals;
+        if (intervals.empty()) {
+            intervals.push_back({1, 30});
+        }
+        // the slowest interval meeting min_fps, if inside the range, costs
+        // the least bandwidth, the driver rounds it to its step on S_PARM
+        if (m.stepwise && intervals.size() == 2 && constraints.min_fps) {
+            struct v4l2_fract want = {1, constraints.min_fps};
+            auto longer = [](const struct v4l2_fract &a,
+                             const struct v4l2_fract &b) {
+                return (uint64_t)a.numerator * b.denominator >
+                       (uint64_t)b.numerator * a.denominator;
+            };
+            if (longer(want, intervals[0]) && longer(intervals[1], want)) {
+                intervals.push_back(want);
+            }
+        }
+        for (auto &interval : intervals) {
+            if (!interval.numerator || !interval.denominator) {
+                continue;
+            }
+            ModeCandidate c;
+            c.fourcc = m.fourcc;
+            c.width = m.width;
+            c.height = m.height;
+            c.interval = interval;
+            EstimateMode(c, constraints.bus_bandwidth);
+            if (c.fps + 1e-6 < constraints.min_fps) {
+                ++too_slow;
+                continue;
+            }
+            candidates.push_back(c);
+        }
+    }
+
+    uint32_t over_bus = 0;
+    uint32_t over_decode = 0;
+    const ModeCandidate *best = nullptr;
+    auto preferred = [&](const ModeCandidate &c) {
+        return constraints.preference == ModePreference::kAny ||
+               c.compressed ==
+                   (constraints.preference == ModePreference::kCompressed);
+    };
+    auto better = [&](const ModeCandidate &a, const ModeCandidate &b) {
+        if (preferred(a) != preferred(b)) {
+            return preferred(a);
+        }
+        if (constraints.goal == ModeGoal::kLatency &&
+            a.latency_us != b.latency_us) {
+            return a.latency_us < b.latency_us;
+        }
+        if (a.pixel_rate != b.pixel_rate) {
+            return a.pixel_rate > b.pixel_rate;
+        }
+        return a.latency_us < b.latency_us;
+    };
+    for (auto &c : candidates) {
+        // the camera would not get the bus, the host would fall behind
+        if (constraints.bus_bandwidth &&
+            c.bandwidth > constraints.bus_bandwidth) {
+            ++over_bus;
+            continue;
+        }
+        if (c.decode_us * c.fps > 1000000) {
+            ++over_decode;
+            continue;
+        }
+        if (!best || better(c, *best)) {
+            best = &c;
+        }
+    }
+
+    if (!best) {
+        error_ = fmt::format(
+            "no mode meets {}x{} at {} fps, {} too small, {} too slow, {} "
+            "over the bus, {} over decode",
+            constraints.min_width, constraints.min_height,
+            constraints.min_fps, too_small, too_slow, over_bus, over_decode);
+        logger_->error(error_);
+        return false;
+    }
+
+    struct v4l2_format v4l2_fmt;
+    if (!TryPixFormat(best->fourcc, best->width, best->height, v4l2_fmt)) {
+        return false;
+    }
+    if (FmtFourcc(v4l2_fmt) != best->fourcc ||
+        FmtWidth(v4l2_fmt) != best->width ||
+        FmtHeight(v4l2_fmt) != best->height) {
+        error_ = fmt::format("enumerated mode {} {}x{} is refused, run as {} "
+                             "{}x{}",
+                             PixFormatName(best->fourcc), best->width,
+                             best->height, PixFormatName(FmtFourcc(v4l2_fmt)),
+                             FmtWidth(v4l2_fmt), FmtHeight(v4l2_fmt));
+        logger_->error(error_);
+        return false;
+    }
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_FMT, &v4l2_fmt) == -1) {
+        error_ = fmt::format("set pixel format failure, {}", FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+    ApplyFormat(v4l2_fmt);
+
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = buf_type_;
+    parm.parm.capture.timeperframe = best->interval;
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_PARM, &parm) == -1) {
+        error_ = fmt::format("set frame interval {}/{} failure, {}",
+                             best->interval.numerator,
+                             best->interval.denominator, FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    NegotiatedMode chosen;
+    chosen.fourcc = best->fourcc;
+    chosen.width = best->width;
+    chosen.height = best->height;
+    chosen.interval = parm.parm.capture.timeperframe;
+    chosen.bandwidth = best->bandwidth;
+    chosen.decode_us = best->decode_us;
+    chosen.latency_us = best->latency_us;
+    chosen.rationale = fmt::format(
+        "{} {}x{} at {:.1f} fps: {:.1f} of {:.1f} MB/s bus, decode {} us, "
+        "latency {} us; {} of {} candidates{}, rejected {} too small, "
+        "{} too slow, {} over the bus, {} over decode",
+        PixFormatName(best->fourcc), best->width, best->height, best->fps,
+        best->bandwidth / 1e6, constraints.bus_bandwidth / 1e6,
+        best->decode_us, best->latency_us,
+        constraints.goal == ModeGoal::kLatency ? "lowest latency"
+                                               : "highest pixel rate",
+        candidates.size(),
+        preferred(*best) ? "" : ", none of the preferred kind fits",
+        too_small, too_slow, over_bus, over_decode);
+    logger_->info("negotiated {}", chosen.rationale);
+
+    mode = std::move(chosen);
+    return true;
+}
+
+bool WebcamV4l2::GetControl() {
+    struct v4l2_queryctrl queryctrl;
+    memset(&queryctrl, 0, sizeof(queryctrl));
+    queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+    while (0 == io_->Ioctl(cam_fd_, VIDIOC_QUERYCTRL, &queryctrl)) {
+        ShowControl(&queryctrl);
+        queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+    }
+
+    return true;
+}
+
+bool WebcamV4l2::LoadControls() {
+    if (ctrl_loaded_) {
+        return true;
+    }
+
+    if (!IsOpen()) {
+        error_ = "webcam is not open";
+        logger_->error(error_);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(ctrl_mutex_);
+        struct v4l2_queryctrl queryctrl;
+        memset(&queryctrl, 0, sizeof(queryctrl));
+        queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
+        while (0 == io_->Ioctl(cam_fd_, VIDIOC_QUERYCTRL, &queryctrl)) {
+            auto &ctrl = ctrl_[queryctrl.id];
+            ctrl.queryctrl = queryctrl;
+            ctrl.control.id = queryctrl.id;
+            queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+        }
+    }
+
+    ctrl_loaded_ = true;
+    SubscribeControls();
+    return true;
+}
+
+void WebcamV4l2::SubscribeControls() {
+    std::vector<uint32_t> ids;
+    {
+        std::lock_guard<std::mutex> lock(ctrl_mutex_);
+        for (auto &it : ctrl_) {
+            auto &queryctrl = it.second.queryctrl;
+            // volatile values change without an event, 64 bit ones do not
+            // fit the cache
+            bool plain = queryctrl.type == V4L2_CTRL_TYPE_INTEGER ||
+                         queryctrl.type == V4L2_CTRL_TYPE_BOOLEAN ||
+                         queryctrl.type == V4L2_CTRL_TYPE_MENU ||
+                         queryctrl.type == V4L2_CTRL_TYPE_INTEGER_MENU;
+            uint32_t skip = V4L2_CTRL_FLAG_DISABLED |
+                            V4L2_CTRL_FLAG_WRITE_ONLY |
+                            V4L2_CTRL_FLAG_VOLATILE;
+            if (plain && !(queryctrl.flags & skip)) {
+                ids.push_back(it.first);
+            }
+        }
+    }
+
+    ctrl_events_ = false;
+    for (auto id : ids) {
+        // the current value arrives as the first event
+        struct v4l2_event_subscription sub;
+        memset(&sub, 0, sizeof(sub));
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id = id;
+        sub.flags = V4L2_EVENT_SUB_FL_SEND_INITIAL;
+        if (io_->Ioctl(cam_fd_, VIDIOC_SUBSCRIBE_EVENT, &sub) == -1) {
+            if (errno == ENOTTY || errno == EINVAL) {
+                // no events on this device, values are read on demand
+                SPDLOG_LOGGER_DEBUG(logger_, "{} has no control events, {}",
+                                    dev_name_, FormatErrno());
+                break;
+            }
+            logger_->warn("subscribe control 0x{:X} failure, {}", id,
+                          FormatErrno());
+            continue;
+        }
+        ctrl_events_ = true;
+    }
+
+    if (ctrl_events_) {
+        ProcessEvents();
+    }
+}
+
+int WebcamV4l2::ProcessEvents() {
+    if (!ctrl_events_) {
+        return 0;
+    }
+
+    int n = 0;
+    struct v4l2_event ev;
+    for (;;) {
+        memset(&ev, 0, sizeof(ev));
+        if (io_->Ioctl(cam_fd_, VIDIOC_DQEVENT, &ev) == -1) {
+            // ENOENT, nothing pending
+            break;
+        }
+        ++n;
+
+        if (ev.type == V4L2_EVENT_CTRL) {
+            auto &c = ev.u.ctrl;
+            int64_t value =
+                c.type == V4L2_CTRL_TYPE_INTEGER64 ? c.value64 : c.value;
+            {
+                std::lock_guard<std::mutex> lock(ctrl_mutex_);
+                auto it = ctrl_.find(ev.id);
+                if (it != ctrl_.end()) {
+                    auto &ctrl = it->second;
+                    if (c.changes & V4L2_EVENT_CTRL_CH_VALUE) {
+                        ctrl.control.value = c.value;
+                        ctrl.cached = true;
+                    }
+                    if (c.changes & V4L2_EVENT_CTRL_CH_FLAGS) {
+                        ctrl.queryctrl.flags = c.flags;
+                    }
+                    if (c.changes & V4L2_EVENT_CTRL_CH_RANGE) {
+                        ctrl.queryctrl.minimum = c.minimum;
+                        ctrl.queryctrl.maximum = c.maximum;
+                        ctrl.queryctrl.step = c.step;
+                        ctrl.queryctrl.default_value = c.default_value;
+                    }
+                }
+            }
+
+            for (auto &cb : ctrl_cbs_) {
+                cb.second(ev.id, value, c.changes);
+            }
+        }
+
+        if (!ev.pending) {
+            break;
+        }
+    }
+    return n;
+}
+
+void WebcamV4l2::CacheControl(uint32_t id, int32_t value) {
+    std::lock_guard<std::mutex> lock(ctrl_mutex_);
+    auto it = ctrl_.find(id);
+    if (it != ctrl_.end() && it->second.cached) {
+        it->second.control.value = value;
+    }
+}
+
+bool WebcamV4l2::IsControlCached(uint32_t id) const {
+    std::lock_guard<std::mutex> lock(ctrl_mutex_);
+    auto it = ctrl_.find(id);
+    return it != ctrl_.end() && it->second.cached;
+}
+
+uint32_t WebcamV4l2::AddControlCallback(const ControlCallback &cb) {
+    if (!cb) {
+        return 0;
+    }
+    uint32_t handle = next_ctrl_cb_++;
+    ctrl_cbs_.emplace_back(handle, cb);
+    return handle;
+}
+
+bool WebcamV4l2::RemoveControlCallback(uint32_t handle) {
+    for (auto it = ctrl_cbs_.begin(); it != ctrl_cbs_.end(); ++it) {
+        if (it->first == handle) {
+            ctrl_cbs_.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool WebcamV4l2::CheckControl(uint32_t id, int64_t value, bool write) {
+    std::unique_lock<std::mutex> lock(ctrl_mutex_);
+    auto it = ctrl_.find(id);
+    if (it == ctrl_.end()) {
+        error_ = fmt::format("control 0x{:X} is not supported", id);
+        return false;
+    }
+
+    // events may change flags and range meanwhile
+    auto queryctrl = it->second.queryctrl;
+    lock.unlock();
+    if (queryctrl.flags & V4L2_CTRL_FLAG_DISABLED) {
+        error_ = fmt::format("control {} is disabled", queryctrl.name);
         return false;
     }
 
-    return true;
+    if (!write) {
+        if (queryctrl.flags & V4L2_CTRL_FLAG_WRITE_ONLY) {
+            error_ = fmt::format("control {} is write only", queryctrl.name);
+            return false;
+        }
+        return true;
+    }
+
+    if (queryctrl.flags & V4L2_CTRL_FLAG_READ_ONLY) {
+        error_ = fmt::format("control {} is read only", queryctrl.name);
+        return false;
+    }
+
+    switch (queryctrl.type) {
+    case V4L2_CTRL_TYPE_INTEGER:
+    case V4L2_CTRL_TYPE_BOOLEAN:
+    case V4L2_CTRL_TYPE_MENU:
+    case V4L2_CTRL_TYPE_INTEGER_MENU:
+        if (value < queryctrl.minimum || value > queryctrl.maximum) {
+            error_ = fmt::format("control {} value {} is out of [{}:{}]",
+                                 queryctrl.name, value, queryctrl.minimum,
+                                 queryctrl.maximum);
+            return false;
+        }
+        if (queryctrl.type == V4L2_CTRL_TYPE_INTEGER && queryctrl.step > 1 &&
+            (value - queryctrl.minimum) % queryctrl.step) {
+            error_ = fmt::format("control {} value {} is off step {}",
+                                 queryctrl.name, value, queryctrl.step);
+            return false;
+        }
+        return true;
+
+    // the 32 bit range of VIDIOC_QUERYCTRL does not hold them
+    case V4L2_CTRL_TYPE_INTEGER64:
+    case V4L2_CTRL_TYPE_BUTTON:
+        return true;
+
+    default:
+        error_ = fmt::format("control {} of type {} is not a value",
+                             queryctrl.name, queryctrl.type);
+        return false;
+    }
 }
 
-bool WebcamV4l2::SetFps(uint8_t fps) {
-    if (!fps) {
+std::string WebcamV4l2::ControlName(uint32_t id) {
+    std::lock_guard<std::mutex> lock(ctrl_mutex_);
+    auto it = ctrl_.find(id);
+    if (it == ctrl_.end()) {
+        return fmt::format("0x{:X}", id);
+    }
+    return (const char *)it->second.queryctrl.name;
+}
+
+bool WebcamV4l2::GetControl(uint32_t id, int32_t &value) {
+    if (!LoadControls()) {
         return false;
     }
 
-    struct v4l2_streamparm parm;
-    memset(&parm, 0, sizeof(struct v4l2_streamparm));
-    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (ioctl(cam_fd_, VIDIOC_G_PARM, &parm) == -1) {
-        error_ = fmt::format("VIDIOC_G_PARM failure, {}", FormatErrno());
+    {
+        std::lock_guard<std::mutex> lock(ctrl_mutex_);
+        auto it = ctrl_.find(id);
+        if (it != ctrl_.end() && it->second.cached) {
+            value = it->second.control.value;
+            return true;
+        }
+    }
+
+    if (!CheckControl(id, 0, false)) {
         logger_->error(error_);
         return false;
     }
 
-    logger_->info("current fps {}", parm.parm.capture.timeperframe.denominator);
-    if (parm.parm.capture.timeperframe.denominator == fps) {
-        return true;
+    struct v4l2_control control;
+    memset(&control, 0, sizeof(control));
+    control.id = id;
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == -1) {
+        error_ = fmt::format("get control {} failure, {}", ControlName(id),
+                             FormatErrno());
+        logger_->error(error_);
+        return false;
     }
 
-    logger_->info("try to set fps {}", fps);
-    struct v4l2_streamparm setfps;
-    memset(&setfps, 0, sizeof(setfps));
-    setfps.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    setfps.parm.capture.timeperframe.numerator = 1;
-    setfps.parm.capture.timeperframe.denominator = fps;
-    if (ioctl(cam_fd_, VIDIOC_S_PARM, &setfps) == -1) {
-        /* Not fatal - just warn about it */
-        error_ = fmt::format("set fps failure, {}", FormatErrno());
-        logger_->warn(error_);
+    value = control.value;
+    return true;
+}
+
+bool WebcamV4l2::SetControl(uint32_t id, int32_t value) {
+    if (!LoadControls()) {
         return false;
     }
 
-    if (ioctl(cam_fd_, VIDIOC_G_PARM, &parm) == -1) {
-        error_ = fmt::format("VIDIOC_G_PARM failure, {}", FormatErrno());
+    if (!CheckControl(id, value, true)) {
         logger_->error(error_);
         return false;
     }
 
-    logger_->info("current fps {}", parm.parm.capture.timeperframe.denominator);
+    struct v4l2_control control;
+    memset(&control, 0, sizeof(control));
+    control.id = id;
+    control.value = value;
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_CTRL, &control) == -1) {
+        error_ = fmt::format("set control {} to {} failure, {}",
+                             ControlName(id), value, FormatErrno());
+        logger_->error(error_);
+        return false;
+    }
+
+    // no event for changes of this handle
+    CacheControl(id, control.value);
     return true;
 }
 
-bool WebcamV4l2::GetControl() {
-    struct v4l2_queryctrl queryctrl;
-    memset(&queryctrl, 0, sizeof(queryctrl));
-    queryctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL;
-    while (0 == ioctl(cam_fd_, VIDIOC_QUERYCTRL, &queryctrl)) {
-        ShowControl(&queryctrl);
-        queryctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
+bool WebcamV4l2::SetControls(ControlBatch &batch) {
+    batch.error_index_ = -1;
+    if (batch.empty()) {
+        return true;
+    }
+
+    if (!LoadControls()) {
+        return false;
+    }
+
+    // nothing reaches the device unless every value is valid
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!CheckControl(batch.id(i), batch.value(i), true)) {
+            batch.error_index_ = i;
+            logger_->error(error_);
+            return false;
+        }
+    }
+
+    if (!CommitControls(VIDIOC_S_EXT_CTRLS, batch)) {
+        return false;
     }
 
+    for (auto &ctrl : batch.ctrls_) {
+        CacheControl(ctrl.id, ctrl.value);
+    }
     return true;
 }
 
-bool WebcamV4l2::SetExtControl() {
-    // might be same as SetControl
-    struct v4l2_query_ext_ctrl query_ext_ctrl;
-    memset(&query_ext_ctrl, 0, sizeof(query_ext_ctrl));
-    query_ext_ctrl.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+bool WebcamV4l2::GetControls(ControlBatch &batch) {
+    batch.error_index_ = -1;
+    if (batch.empty()) {
+        return true;
+    }
 
-    while (0 == ioctl(cam_fd_, VIDIOC_QUERY_EXT_CTRL, &query_ext_ctrl)) {
-        if (!(query_ext_ctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
-            logger_->info("Ext control {}", query_ext_ctrl.name);
+    if (!LoadControls()) {
+        return false;
+    }
 
-            if (query_ext_ctrl.type == V4L2_CTRL_TYPE_MENU) {
-                logger_->info("{}", EnumerateMenu(query_ext_ctrl.id,
-                                                  query_ext_ctrl.minimum,
-                                                  query_ext_ctrl.maximum));
+    // served from the cache when every control is kept current
+    {
+        std::lock_guard<std::mutex> lock(ctrl_mutex_);
+        size_t i = 0;
+        for (; i < batch.size(); ++i) {
+            auto it = ctrl_.find(batch.id(i));
+            if (it == ctrl_.end() || !it->second.cached) {
+                break;
+            }
+        }
+        if (i == batch.size()) {
+            for (i = 0; i < batch.size(); ++i) {
+                batch.entries_[i].value =
+                    ctrl_.find(batch.id(i))->second.control.value;
             }
+            return true;
+        }
+    }
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (!CheckControl(batch.id(i), 0, false)) {
+            batch.error_index_ = i;
+            logger_->error(error_);
+            return false;
         }
+    }
 
-        query_ext_ctrl.id |=
-            V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    if (!CommitControls(VIDIOC_G_EXT_CTRLS, batch)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(ctrl_mutex_);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        auto &ctrl = batch.ctrls_[i];
+        auto it = ctrl_.find(ctrl.id);
+        batch.entries_[i].value =
+            it != ctrl_.end() &&
+                    it->second.queryctrl.type == V4L2_CTRL_TYPE_INTEGER64
+                ? ctrl.value64
+                : ctrl.value;
     }
     return true;
 }
 
+bool WebcamV4l2::CommitControls(unsigned long request, ControlBatch &batch) {
+    batch.ctrls_.resize(batch.size());
+    std::unique_lock<std::mutex> lock(ctrl_mutex_);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        auto &ctrl = batch.ctrls_[i];
+        memset(&ctrl, 0, sizeof(ctrl));
+        ctrl.id = batch.id(i);
+        auto it = ctrl_.find(ctrl.id);
+        if (it != ctrl_.end() &&
+            it->second.queryctrl.type == V4L2_CTRL_TYPE_INTEGER64) {
+            ctrl.value64 = batch.value(i);
+        } else {
+            ctrl.value = batch.value(i);
+        }
+    }
+    lock.unlock();
+
+    struct v4l2_ext_controls ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.which = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count = batch.size();
+    ext.controls = batch.ctrls_.data();
+    if (io_->Ioctl(cam_fd_, request, &ext) == 0) {
+        return true;
+    }
+
+    // error_idx == count, the batch failed before any control was touched
+    const char *op = request == VIDIOC_S_EXT_CTRLS ? "set" : "get";
+    if (ext.error_idx < ext.count) {
+        batch.error_index_ = ext.error_idx;
+        error_ = fmt::format("{} control {} failure, {}", op,
+                             ControlName(batch.id(ext.error_idx)),
+                             FormatErrno());
+    } else {
+        error_ = fmt::format("{} {} controls failure, {}", op, ext.count,
+                             FormatErrno());
+    }
+    logger_->error(error_);
+    return false;
+}
+
 std::string WebcamV4l2::EnumerateMenu(uint32_t id, int32_t index_min,
                                       int32_t index_max) {
     struct v4l2_querymenu querymenu;
@@ -631,7 +2485,7 @@ std::string WebcamV4l2::EnumerateMenu(uint32_t id, int32_t index_min,
     std::vector<std::string> menu_names;
     for (int32_t m = index_min; m <= index_max; ++m) {
         querymenu.index = m;
-        if (0 == ioctl(cam_fd_, VIDIOC_QUERYMENU, &querymenu)) {
+        if (0 == io_->Ioctl(cam_fd_, VIDIOC_QUERYMENU, &querymenu)) {
             menu_names.push_back((char *)querymenu.name);
         }
     }
@@ -651,7 +2505,7 @@ bool WebcamV4l2::ShowCtrlMenu(struct v4l2_queryctrl *queryctrl) {
     struct v4l2_control control;
     memset(&control, 0, sizeof(control));
     control.id = queryctrl->id;
-    if (ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == -1) {
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == -1) {
         error_ = fmt::format("read value of control {} failure, {}",
                              queryctrl->name, strerror(errno));
         logger_->error(error_);
@@ -663,7 +2517,7 @@ bool WebcamV4l2::ShowCtrlMenu(struct v4l2_queryctrl *queryctrl) {
     querymenu.id = queryctrl->id;
     querymenu.index = control.value;
 
-    if (-1 == ioctl(cam_fd_, VIDIOC_QUERYMENU, &querymenu)) {
+    if (-1 == io_->Ioctl(cam_fd_, VIDIOC_QUERYMENU, &querymenu)) {
         error_ =
             fmt::format("read menu item {} value of control {} failure, {}",
                         control.value, queryctrl->name, strerror(errno));
@@ -682,7 +2536,7 @@ bool WebcamV4l2::ShowCtrlInt(struct v4l2_queryctrl *queryctrl) {
     memset(&control, 0, sizeof(control));
     control.id = queryctrl->id;
 
-    if (ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == -1) {
+    if (io_->Ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == -1) {
         logger_->error("read value of control {} failure, {}", queryctrl->name,
                        strerror(errno));
         return false;
@@ -706,117 +2560,418 @@ bool WebcamV4l2::ShowCtrlInt(struct v4l2_queryctrl *queryctrl) {
                       queryctrl->minimum, queryctrl->maximum, queryctrl->step);
     }
 
-    V4l2Ctrl ctrl{.queryctrl = *queryctrl, .control = control};
-    ctrl_[control.id] = ctrl;
-
-    return true;
+    std::lock_guard<std::mutex> lock(ctrl_mutex_);
+    auto &ctrl = ctrl_[control.id];
+    ctrl.queryctrl = *queryctrl;
+    ctrl.control = control;
+
+    return true;
+}
+
+bool WebcamV4l2::ShowControl(struct v4l2_queryctrl *queryctrl) {
+    if (!queryctrl) {
+        return false;
+    }
+
+    if (queryctrl->flags & V4L2_CTRL_FLAG_DISABLED) {
+        logger_->info(
+            "queryctrl id: 0x{:X}, name: {:<32}, DISABLED, flags: {:<2} ",
+            queryctrl->id, queryctrl->name, queryctrl->flags);
+        return false;
+    }
+
+    switch (queryctrl->type) {
+    case V4L2_CTRL_TYPE_INTEGER:
+        if (!ShowCtrlInt(queryctrl)) {
+            return false;
+        }
+        break;
+
+    case V4L2_CTRL_TYPE_BOOLEAN: {
+        struct v4l2_control control;
+        memset(&control, 0, sizeof(control));
+
+        control.id = queryctrl->id;
+        if (io_->Ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == -1) {
+            error_ = fmt::format("read value of control {} failure, {}",
+                                 queryctrl->name, strerror(errno));
+            logger_->error(error_);
+            return false;
+        }
+        logger_->info("queryctrl bool id: 0x{:X}, name: {:<32}, value:{:<12}, "
+                      "flags: {:<2} "
+                      "(default: {})",
+                      queryctrl->id, queryctrl->name,
+                      control.value ? "True" : "False", queryctrl->flags,
+                      queryctrl->default_value ? "True" : "False");
+
+        std::lock_guard<std::mutex> lock(ctrl_mutex_);
+        auto &ctrl = ctrl_[control.id];
+        ctrl.queryctrl = *queryctrl;
+        ctrl.control = control;
+    } break;
+
+    case V4L2_CTRL_TYPE_MENU:
+        if (!ShowCtrlMenu(queryctrl)) {
+            return false;
+        }
+        break;
+
+    case V4L2_CTRL_TYPE_BUTTON:
+        logger_->info("queryctrl btn id: 0x{:X}, name: {:<32} - [Button]",
+                      queryctrl->id, queryctrl->name);
+        break;
+
+    default:
+        logger_->info("queryctrl deft id: 0x{:X}, name: {:<32} N/A [Unknown "
+                      "Control Type]",
+                      queryctrl->id, queryctrl->name);
+        break;
+    }
+
+    return true;
+}
+
+bool WebcamV4l2::SetExposure(int32_t exposure) {
+    ControlBatch batch;
+    if (exposure > 0) {
+        // the absolute time is ignored unless the mode goes manual first
+        batch.Set(V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_MANUAL)
+            .Set(V4L2_CID_EXPOSURE_ABSOLUTE, exposure);
+    } else {
+        batch.Set(V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_APERTURE_PRIORITY);
+    }
+
+    if (!SetControls(batch)) {
+        error_ = fmt::format("set exposure {} failure, {}", exposure, error_);
+        return false;
+    }
+    return true;
+}
+
+bool WebcamV4l2::SetExposure() {
+    int32_t mode;
+    if (!GetControl(V4L2_CID_EXPOSURE_AUTO, mode)) {
+        return false;
+    }
+    logger_->info("exposure auto type {}", mode);
+    return false;
+}
+
+// Sinks of CaptureFrame. Check runs before anything is dequeued, the call
+// gets the dequeued buffer and returns false to keep it from the driver.
+struct WebcamV4l2::CopySink {
+    std::string &out;
+
+    bool Check(WebcamV4l2 &) { return true; }
+    bool operator()(WebcamV4l2 &cam, const struct v4l2_buffer &buf) {
+        cam.CopyFrame(buf, out);
+        cam.buf_stat_->buffer[buf.index].bytes = out.size();
+        return true;
+    }
+};
+
+struct WebcamV4l2::DiscardSink {
+    bool Check(WebcamV4l2 &) { return true; }
+    bool operator()(WebcamV4l2 &, const struct v4l2_buffer &) {
+        return true;
+    }
+};
+
+struct WebcamV4l2::CallbackSink {
+    bool Check(WebcamV4l2 &cam) {
+        if (!cam.frame_cb_ && !cam.frame_meta_cb_ && !cam.frame_planes_cb_) {
+            return cam.FailCapture(CaptureError::kNoCallback);
+        }
+        return true;
+    }
+    bool operator()(WebcamV4l2 &cam, const struct v4l2_buffer &buf) {
+        cam.DeliverFrame(buf);
+        return true;
+    }
+};
+
+struct WebcamV4l2::LeaseSink {
+    FrameLease &lease;
+
+    bool Check(WebcamV4l2 &cam) {
+        // keep at least one buffer in the driver queue
+        if (cam.leases_ + 1 >= cam.buf_stat_->count) {
+            return cam.FailCapture(CaptureError::kLeaseLimit, 0, cam.leases_,
+                                   cam.buf_stat_->count);
+        }
+        return true;
+    }
+    bool operator()(WebcamV4l2 &cam, const struct v4l2_buffer &buf) {
+        cam.FillLease(lease, buf, cam.frame_meta_);
+        ++cam.leases_;
+        return false;
+    }
+};
+
+template <typename Sink>
+bool WebcamV4l2::CaptureFrame(Sink &sink, bool block, uint32_t timeout) {
+    capture_fault_.block = block;
+    util::SetTraceFrame(util::kTraceNoFrame);
+    util::TraceScope trace(block ? "grab" : "retrieve");
+    if (!working_) {
+        return FailCapture(CaptureError::kNotStarted);
+    }
+
+    if (!buf_stat_) {
+        return FailCapture(CaptureError::kNoBuffers);
+    }
+
+    if (capture_ && capture_->running) {
+        return FailCapture(CaptureError::kThreadRunning);
+    }
+
+    // the checks and the wait record their own fault
+    if (!sink.Check(*this) || (block && !WaitReadable(timeout))) {
+        return false;
+    }
+
+    struct v4l2_buffer buf;
+    memset(&buf, 0, sizeof(buf));
+    buf.type = buf_stat_->type;
+    buf.memory = buf_stat_->memory;
+    if (!DequeueFrame(buf)) {
+        return FailCapture(CaptureError::kDequeue, errno);
+    }
+    // the copy, the callback and whatever the caller does next
+    trace.SetFrame(buf.sequence);
+    util::SetTraceFrame(buf.sequence);
+
+    if (sink(*this, buf) && !QueueBuffer(buf)) {
+        return FailCapture(CaptureError::kQueue, errno);
+    }
+
+    capture_fault_.code = CaptureError::kNone;
+    return true;
+}
+
+bool WebcamV4l2::FailCapture(CaptureError code, int sys_errno, uint32_t arg0,
+                             uint32_t arg1) {
+    capture_fault_.code = code;
+    capture_fault_.sys_errno = sys_errno;
+    capture_fault_.args[0] = arg0;
+    capture_fault_.args[1] = arg1;
+    // keeps its capacity, GetError formats the fault instead
+    error_.clear();
+
+    if (code != CaptureError::kTimeout) {
+        LogGrabError();
+    }
+    return false;
+}
+
+std::string WebcamV4l2::FormatCaptureFault() const {
+    auto &fault = capture_fault_;
+    const char *op = fault.block ? "grab" : "retrieve";
+    switch (fault.code) {
+    case CaptureError::kNone:
+        break;
+    case CaptureError::kTimeout:
+        return fmt::format("{} frame failure, poll {} ms timeout", op,
+                           fault.args[0]);
+    case CaptureError::kNotStarted:
+        return "stream is not started";
+    case CaptureError::kNoBuffers:
+        return "v4l2 buffers are not ready";
+    case CaptureError::kThreadRunning:
+        return "capture thread is running, use PopFrame";
+    case CaptureError::kNoCallback:
+        return "frame callback is null";
+    case CaptureError::kLeaseLimit:
+        return fmt::format("{} of {} buffers are leased, release one first",
+                           fault.args[0], fault.args[1]);
+    case CaptureError::kPoll:
+        return fmt::format("{} frame failure, poll failure, {} - {}", op,
+                           fault.sys_errno, strerror(fault.sys_errno));
+    case CaptureError::kDequeue:
+        return fmt::format("{} VIDIOC_DQBUF failure, {} - {}", op,
+                           fault.sys_errno, strerror(fault.sys_errno));
+    case CaptureError::kQueue:
+        return fmt::format("{} VIDIOC_QBUF failure, {} - {}", op,
+                           fault.sys_errno, strerror(fault.sys_errno));
+    }
+    return "";
+}
+
+void WebcamV4l2::LogGrabError() {
+    uint32_t suppressed = 0;
+    if (!grab_log_.Allow(suppressed)) {
+        return;
+    }
+
+    if (suppressed) {
+        logger_->error("{}, {} more grab errors suppressed", GetError(),
+                       suppressed);
+    } else {
+        logger_->error(GetError());
+    }
+}
+
+// sync mode
+bool WebcamV4l2::Grab(std::string &out, uint32_t timeout) {
+    CopySink sink{out};
+    return CaptureFrame(sink, true, timeout);
 }
 
-bool WebcamV4l2::ShowControl(struct v4l2_queryctrl *queryctrl) {
-    if (!queryctrl) {
-        return false;
+bool WebcamV4l2::Grab(std::string *out, uint32_t timeout) {
+    if (out) {
+        return Grab(*out, timeout);
     }
+    DiscardSink sink;
+    return CaptureFrame(sink, true, timeout);
+}
 
-    if (queryctrl->flags & V4L2_CTRL_FLAG_DISABLED) {
-        logger_->info(
-            "queryctrl id: 0x{:X}, name: {:<32}, DISABLED, flags: {:<2} ",
-            queryctrl->id, queryctrl->name, queryctrl->flags);
-        return false;
+// block
+bool WebcamV4l2::Grab(uint32_t timeout) {
+    CallbackSink sink;
+    return CaptureFrame(sink, true, timeout);
+}
+
+void WebcamV4l2::DeliverFrame(const struct v4l2_buffer &buf) {
+    util::TraceScope trace("callback");
+    FramePlane planes[VIDEO_MAX_PLANES];
+    uint32_t n = MakePlanes(buf, planes);
+    if (frame_planes_cb_) {
+        frame_planes_cb_(planes, n, frame_meta_);
+    } else if (frame_meta_cb_) {
+        frame_meta_cb_(planes[0].data, planes[0].bytesused, frame_meta_);
+    } else {
+        frame_cb_(planes[0].data, planes[0].bytesused);
     }
+}
 
-    switch (queryctrl->type) {
-    case V4L2_CTRL_TYPE_INTEGER:
-        if (!ShowCtrlInt(queryctrl)) {
-            return false;
+uint32_t WebcamV4l2::MakePlanes(const struct v4l2_buffer &buf,
+                                FramePlane *planes) const {
+    // the buffer planes first
+    auto &unit = buf_stat_->buffer[buf.index];
+    FramePlane spans[VIDEO_MAX_PLANES];
+    uint32_t n = 1;
+    if (!V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+        spans[0].data = (const char *)unit.plane[0].start;
+        spans[0].bytesused = buf.bytesused;
+        spans[0].length = unit.plane[0].length;
+        spans[0].dmabuf_fd = unit.plane[0].dmabuf_fd;
+    } else {
+        n = std::min<uint32_t>(buf.length, unit.num_planes);
+        for (uint32_t p = 0; p < n; ++p) {
+            // the payload of a plane may start past a header the driver put
+            // in front of it
+            auto &v4l2_plane = buf.m.planes[p];
+            uint32_t offset =
+                std::min(v4l2_plane.data_offset, v4l2_plane.bytesused);
+            spans[p].data = (const char *)unit.plane[p].start + offset;
+            spans[p].bytesused = v4l2_plane.bytesused - offset;
+            spans[p].length = unit.plane[p].length;
+            spans[p].dmabuf_fd = unit.plane[p].dmabuf_fd;
+            spans[p].offset = offset;
         }
-        break;
+    }
 
-    case V4L2_CTRL_TYPE_BOOLEAN: {
-        struct v4l2_control control;
-        memset(&control, 0, sizeof(control));
+    // a single color plane is the whole payload, compressed ones included
+    if (color_planes_ == 1) {
+        planes[0] = spans[0];
+        planes[0].bytesperline = plane_layout_[0].bytesperline;
+        return 1;
+    }
 
-        control.id = queryctrl->id;
-        if (ioctl(cam_fd_, VIDIOC_G_CTRL, &control) == -1) {
-            error_ = fmt::format("read value of control {} failure, {}",
-                                 queryctrl->name, strerror(errno));
-            logger_->error(error_);
-            return false;
+    for (uint32_t c = 0; c < color_planes_; ++c) {
+        auto &layout = plane_layout_[c];
+        if (layout.plane >= n) {
+            return c;
         }
-        logger_->info("queryctrl bool id: 0x{:X}, name: {:<32}, value:{:<12}, "
-                      "flags: {:<2} "
-                      "(default: {})",
-                      queryctrl->id, queryctrl->name,
-                      control.value ? "True" : "False", queryctrl->flags,
-                      queryctrl->default_value ? "True" : "False");
 
-        V4l2Ctrl ctrl{.queryctrl = *queryctrl, .control = control};
-        ctrl_[control.id] = ctrl;
-    } break;
+        auto &span = spans[layout.plane];
+        uint32_t offset = std::min(layout.offset, span.bytesused);
+        planes[c].data = span.data + offset;
+        planes[c].bytesused =
+            std::min(layout.size, span.bytesused - offset);
+        planes[c].length = layout.size;
+        planes[c].bytesperline = layout.bytesperline;
+        planes[c].dmabuf_fd = span.dmabuf_fd;
+        planes[c].offset = span.offset + offset;
+    }
+    return color_planes_;
+}
 
-    case V4L2_CTRL_TYPE_MENU:
-        if (!ShowCtrlMenu(queryctrl)) {
-            return false;
-        }
-        break;
+void WebcamV4l2::CopyFrame(const struct v4l2_buffer &buf,
+                           std::string &out) const {
+    util::TraceScope trace("copy");
+    // packed planes are copied as they are, padding included
+    if (!V4L2_TYPE_IS_MULTIPLANAR(buf.type)) {
+        out.assign((const char *)buf_stat_->buffer[buf.index].plane[0].start,
+                   buf.bytesused);
+        return;
+    }
 
-    case V4L2_CTRL_TYPE_BUTTON:
-        logger_->info("queryctrl btn id: 0x{:X}, name: {:<32} - [Button]",
-                      queryctrl->id, queryctrl->name);
-        break;
+    FramePlane planes[VIDEO_MAX_PLANES];
+    uint32_t n = MakePlanes(buf, planes);
+    if (n == 1) {
+        out.assign(planes[0].data, planes[0].bytesused);
+        return;
+    }
 
-    default:
-        logger_->info("queryctrl deft id: 0x{:X}, name: {:<32} N/A [Unknown "
-                      "Control Type]",
-                      queryctrl->id, queryctrl->name);
-        break;
+    size_t size = 0;
+    for (uint32_t p = 0; p < n; ++p) {
+        size += planes[p].bytesused;
     }
+    out.clear();
+    out.reserve(size);
+    for (uint32_t p = 0; p < n; ++p) {
+        out.append(planes[p].data, planes[p].bytesused);
+    }
+}
 
-    return true;
+// non-block
+bool WebcamV4l2::Retrieve(bool discard) {
+    if (discard) {
+        DiscardSink sink;
+        return CaptureFrame(sink, false, 0);
+    }
+    CallbackSink sink;
+    return CaptureFrame(sink, false, 0);
 }
 
-bool WebcamV4l2::SetExposure() {
-    int ret;
-    struct v4l2_control ctrl;
-    //得到曝光模式
-    ctrl.id = V4L2_CID_EXPOSURE_AUTO;
-    if (ioctl(cam_fd_, VIDIOC_G_CTRL, &ctrl) == -1) {
-        printf("Get exposure auto Type failed\n");
-        return false;
-    }
-    printf("\nGet Exposure Auto Type:[%d]\n", ctrl.value);
-
-    // ctrl.id = V4L2_CID_ROTATE;
-    // ctrl.value = 90;
-    // if (ioctl(cam_fd_, VIDIOC_S_CTRL, &ctrl) == -1) {
-    // printf("Set rotate failed\n");
-    // return false;
-    //}
-    // printf("\nSet rotate:[%d]\n", ctrl.value);
-    // struct v4l2_control ctrl;
-    // ctrl.id = V4L2_CID_EXPOSURE_AUTO;
-    // if (ioctl(cam_fd_, VIDIOC_G_CTRL, &ctrl) == -1) {
-    // logger_->warn("get exposure failure, {}", strerror(errno));
-    //}
-    // logger_->info("exposure {}", ctrl.value);
-    return false;
+bool WebcamV4l2::Retrieve(std::string &img) {
+    CopySink sink{img};
+    return CaptureFrame(sink, false, 0);
 }
 
-// sync mode
-bool WebcamV4l2::Grab(std::string &out, uint32_t timeout) {
-    if (!working_) {
-        error_ = "not started";
-        logger_->error(error_);
-        return false;
+bool WebcamV4l2::Retrieve(std::string *img) {
+    if (img) {
+        return Retrieve(*img);
     }
+    DiscardSink sink;
+    return CaptureFrame(sink, false, 0);
+}
 
-    if (!buf_stat_) {
-        error_ = "v4l2 buffers are not ready";
-        logger_->error(error_);
+void WebcamV4l2::FillLease(FrameLease &lease, const struct v4l2_buffer &buf,
+                           const FrameMeta &meta) {
+    lease.owner_ = this;
+    lease.generation_ = generation_;
+    lease.meta_ = meta;
+    lease.buf_ = buf;
+    lease.num_planes_ = MakePlanes(buf, lease.planes_);
+}
+
+bool WebcamV4l2::ReleaseLease(FrameLease &lease) {
+    // buffers were freed or reallocated since the lease was taken
+    if (lease.generation_ != generation_ || !buf_stat_) {
         return false;
     }
 
-    if (!GrabFrame(out, timeout)) {
-        error_ = fmt::format("grab frame failure, {}", error_);
+    // the capture thread owns the queue, it requeues the buffer
+    if (capture_ && capture_->running) {
+        return capture_->returns.Push(lease.buf_);
+    }
+
+    --leases_;
+    if (!QueueBuffer(lease.buf_)) {
+        error_ = fmt::format("release VIDIOC_QBUF failure, {}", FormatErrno());
         logger_->error(error_);
         return false;
     }
@@ -824,263 +2979,480 @@ bool WebcamV4l2::Grab(std::string &out, uint32_t timeout) {
     return true;
 }
 
-bool WebcamV4l2::Grab(std::string *out, uint32_t timeout) {
+bool WebcamV4l2::Grab(FrameLease &lease, uint32_t timeout) {
+    // the caller may reuse a lease, give its buffer back first
+    lease.Release();
+    LeaseSink sink{lease};
+    return CaptureFrame(sink, true, timeout);
+}
+
+bool WebcamV4l2::Retrieve(FrameLease &lease) {
+    lease.Release();
+    LeaseSink sink{lease};
+    return CaptureFrame(sink, false, 0);
+}
+
+bool WebcamV4l2::StartCaptureThread(const CaptureThreadOptions &options) {
     if (!working_) {
-        error_ = "not started";
+        error_ = "stream is not started";
         logger_->error(error_);
         return false;
     }
 
-    if (!buf_stat_) {
-        error_ = "v4l2 buffers are not ready";
+    if (capture_ && capture_->running) {
+        return true;
+    }
+
+    // ended by itself, its frames go back to the driver first
+    StopCaptureThread();
+
+    if (leases_ > 0) {
+        error_ = fmt::format("{} frame leases are outstanding", leases_);
         logger_->error(error_);
         return false;
     }
 
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = timeout * 1000;
+    CaptureThreadOptions opts = options;
+    opts.capacity = std::min<uint32_t>(std::max<uint32_t>(opts.capacity, 1),
+                                       buf_stat_->count - 1);
 
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(cam_fd_, &fds);
+    capture_.reset(new CaptureThreadState(opts, buf_stat_->count));
+    capture_->running = true;
+    capture_->thread = std::thread(&WebcamV4l2::CaptureLoop, this);
 
-    int r = select(cam_fd_ + 1, &fds, nullptr, nullptr, &tv);
+    logger_->info("capture thread started, capacity {}, policy {}, cpu {}",
+                  opts.capacity, (int)opts.policy, opts.cpu);
+    return true;
+}
 
-    if (-1 == r) {
-        error_ = fmt::format("select failure, {}", FormatErrno());
-        logger_->error(error_);
+bool WebcamV4l2::StopCaptureThread() {
+    // joinable as well when it ended by itself
+    if (!capture_ || !capture_->thread.joinable()) {
         return false;
     }
 
-    if (!r) {
-        error_ = fmt::format("select {} ms timeout", timeout);
-        logger_->error(error_);
-        return false;
+    capture_->running = false;
+    capture_->thread.join();
+
+    // unconsumed frames and released buffers go back to the driver, leases
+    // still held by the consumer requeue directly from now on
+    DrainReturns();
+    CaptureThreadState::Frame frame;
+    while (capture_->frames.Pop(frame)) {
+        QueueBuffer(frame.buf);
+        --leases_;
     }
 
-    auto buf_ptr = &buf_stat_->buf;
-    memset(buf_ptr, 0, sizeof(*buf_ptr));
-    buf_ptr->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf_ptr->memory = V4L2_MEMORY_MMAP;
+    logger_->info("capture thread stopped");
+    return true;
+}
 
-    if (ioctl(cam_fd_, VIDIOC_DQBUF, buf_ptr) == -1) {
-        logger_->error("grab VIDIOC_DQBUF failure, {}", FormatErrno());
+bool WebcamV4l2::PopFrame(FrameLease &lease) {
+    lease.Release();
+
+    if (!capture_ || !capture_->running) {
+        int failure = capture_ ? capture_->failure.load() : 0;
+        if (failure == ENODEV) {
+            error_ = fmt::format("capture thread ended, device {} is gone",
+                                 dev_name_);
+        } else if (failure) {
+            error_ = fmt::format("capture thread ended, {} - {}", failure,
+                                 strerror(failure));
+        } else {
+            error_ = "capture thread is not running";
+        }
         return false;
     }
 
-    if (out) {
-        (*out).assign((char *)buf_stat_->buffer[buf_ptr->index].start,
-                      buf_ptr->bytesused);
-    }
-
-    if (ioctl(cam_fd_, VIDIOC_QBUF, buf_ptr) == -1) {
-        logger_->error("grab VIDIOC_QBUF failure, {}", FormatErrno());
+    CaptureThreadState::Frame frame;
+    if (!capture_->frames.Pop(frame)) {
         return false;
     }
 
+    FillLease(lease, frame.buf, frame.meta);
+    RecordLatency(frame.meta, NowUs());
+    util::SetTraceFrame(frame.meta.sequence);
+    Bump(capture_->consumed);
     return true;
 }
 
-// block
-bool WebcamV4l2::Grab(uint32_t timeout) {
-    if (!frame_cb_) {
-        error_ = "frame callback is null";
-        logger_->error(error_);
-        return false;
-    }
+CaptureThreadStats WebcamV4l2::GetCaptureThreadStats() const {
+    CaptureThreadStats stats;
+    if (!capture_) {
+        return stats;
+    }
+
+    auto &cap = *capture_;
+    stats.produced = cap.produced.load(std::memory_order_relaxed);
+    stats.published = cap.published.load(std::memory_order_relaxed);
+    stats.dropped_oldest = cap.dropped_oldest.load(std::memory_order_relaxed);
+    stats.dropped_newest = cap.dropped_newest.load(std::memory_order_relaxed);
+    stats.blocked = cap.blocked.load(std::memory_order_relaxed);
+    stats.driver_dropped = cap.driver_dropped.load(std::memory_order_relaxed);
+    stats.consumed = cap.consumed.load(std::memory_order_relaxed);
+    return stats;
+}
 
-    if (!working_) {
-        error_ = "stream is not started";
-        logger_->error(error_);
-        return false;
+bool WebcamV4l2::HasRingRoom() {
+    return leases_ + 1 < buf_stat_->count &&
+           capture_->frames.size() < capture_->options.capacity;
+}
+
+void WebcamV4l2::DrainReturns() {
+    struct v4l2_buffer buf;
+    while (capture_->returns.Pop(buf)) {
+        if (!QueueBuffer(buf)) {
+            logger_->error("capture VIDIOC_QBUF failure, {}", FormatErrno());
+        }
+        --leases_;
     }
+}
 
-    if (!buf_stat_) {
-        error_ = "v4l2 buffers are not ready";
-        logger_->error(error_);
-        return false;
+void WebcamV4l2::CaptureLoop() {
+    auto &cap = *capture_;
+    util::SetTraceThreadName("webcam capture");
+
+    if (cap.options.cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cap.options.cpu, &cpus);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (err) {
+            logger_->warn("pin capture thread to cpu {} failure, {}",
+                          cap.options.cpu, strerror(err));
+        }
     }
 
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = timeout * 1000;
+    struct pollfd pfd;
+    pfd.fd = cam_fd_;
+    pfd.events = POLLIN | POLLPRI;
+
+    while (cap.running.load(std::memory_order_acquire)) {
+        DrainReturns();
+
+        wait_begin_us_ = NowUs();
+        int r;
+        {
+            util::TraceScope trace("poll", util::kTraceNoFrame);
+            r = poll(&pfd, 1, cap.options.timeout);
+        }
+        if (r == -1 && errno != EINTR) {
+            cap.failure = errno;
+            logger_->error("capture poll failure, {}", FormatErrno());
+            break;
+        }
+        if (r <= 0) {
+            continue;
+        }
+        if (pfd.revents & POLLPRI) {
+            ProcessEvents();
+            if (!(pfd.revents & ~POLLPRI)) {
+                continue;
+            }
+        }
 
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(cam_fd_, &fds);
+        DrainReturns();
+        if (!HasRingRoom()) {
+            if (cap.options.policy == RingFullPolicy::kBlock) {
+                Bump(cap.blocked);
+                while (!HasRingRoom() &&
+                       cap.running.load(std::memory_order_acquire)) {
+                    std::this_thread::sleep_for(
+                        std::chrono::microseconds(200));
+                    DrainReturns();
+                }
+                continue;
+            }
 
-    int r = select(cam_fd_ + 1, &fds, nullptr, nullptr, &tv);
+            CaptureThreadState::Frame old;
+            if (cap.options.policy == RingFullPolicy::kDropOldest &&
+                cap.frames.Pop(old)) {
+                if (!QueueBuffer(old.buf)) {
+                    logger_->error("capture VIDIOC_QBUF failure, {}",
+                                   FormatErrno());
+                }
+                --leases_;
+                Bump(cap.dropped_oldest);
+            }
+        }
 
-    if (-1 == r) {
-        error_ = fmt::format("select failure, {}", FormatErrno());
-        logger_->error(error_);
-        return false;
+        CaptureThreadState::Frame frame;
+        struct v4l2_buffer &buf = frame.buf;
+        memset(&buf, 0, sizeof(buf));
+        buf.type = buf_stat_->type;
+        buf.memory = buf_stat_->memory;
+
+        if (!DequeueBuffer(buf)) {
+            if (errno == ENODEV) {
+                // unplugged, the fd stays readable for ever
+                logger_->error("capture device {} is gone", dev_name_);
+                cap.failure = ENODEV;
+                break;
+            }
+            if (errno != EAGAIN) {
+                logger_->error("capture VIDIOC_DQBUF failure, {}",
+                               FormatErrno());
+            }
+            continue;
+        }
+        MakeFrameMeta(buf, frame_dropped_, 0, frame.meta);
+
+        Bump(cap.produced);
+        cap.driver_dropped.store(usage_.dropped, std::memory_order_relaxed);
+
+        // still no room, the consumer holds the older frames itself
+        if (!HasRingRoom()) {
+            if (!QueueBuffer(buf)) {
+                logger_->error("capture VIDIOC_QBUF failure, {}",
+                               FormatErrno());
+            }
+            Bump(cap.dropped_newest);
+            continue;
+        }
+
+        ++leases_;
+        cap.frames.Push(frame);
+        Bump(cap.published);
     }
+    wait_begin_us_ = 0;
+    // PopFrame reports the failure, Grab and Retrieve work again
+    cap.running = false;
+}
 
-    if (!r) {
-        error_ = fmt::format("select {} ms timeout", timeout);
-        logger_->error(error_);
-        return false;
+bool WebcamV4l2::Start() {
+    if (working_) {
+        return true;
     }
 
-    auto buf_ptr = &buf_stat_->buf;
-    memset(buf_ptr, 0, sizeof(*buf_ptr));
-    buf_ptr->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf_ptr->memory = V4L2_MEMORY_MMAP;
+    if (paused_) {
+        return Resume();
+    }
 
-    if (ioctl(cam_fd_, VIDIOC_DQBUF, buf_ptr) == -1) {
-        logger_->error("VIDIOC_DQBUF failure");
+    usage_ = BufferUsage();
+    metrics_.Reset();
+    frame_meta_ = FrameMeta();
+    resume_stats_ = ResumeStats();
+    if (!SetBuffers()) {
         return false;
     }
 
-    frame_cb_((const char *)buf_stat_->buffer[buf_ptr->index].start,
-              buf_ptr->bytesused);
+    working_ = StreamOn();
+    logger_->info("start working {}", working_);
+
+    if (working_ && setup_begin_us_) {
+        setup_us_ = NowUs() - setup_begin_us_;
+        setup_begin_us_ = 0;
+        if (cold_setup_us_) {
+            logger_->info("warm start in {} us, {} us saved against cold start",
+                          setup_us_, setup_saved_us());
+        } else {
+            logger_->info("setup in {} us", setup_us_);
+        }
+    }
+    return working_;
+}
 
-    if (ioctl(cam_fd_, VIDIOC_QBUF, buf_ptr) == -1) {
-        logger_->error("VIDIOC_QBUF failure");
+bool WebcamV4l2::Stop() {
+    if (!working_ && !paused_) {
         return false;
     }
 
+    StopCaptureThread();
+    paused_capture_.reset();
+
+    if (working_) {
+        StreamOff();
+    }
+
+    if (adaptive_buffers_) {
+        AdaptBufferCount();
+    }
+
+    FreeBuffers();
+
+    working_ = false;
+    paused_ = false;
+    resume_begin_us_ = 0;
+    logger_->info("stop working");
     return true;
 }
 
-// non-block
-bool WebcamV4l2::Retrieve(bool discard) {
-    if (!frame_cb_) {
-        error_ = "frame callback is null";
+bool WebcamV4l2::SwitchMode(WebcamFormat fmt, uint32_t width,
+                            uint32_t height, uint8_t fps, uint32_t warmup,
+                            uint32_t timeout) {
+    if (!working_) {
+        error_ = "stream is not started";
         logger_->error(error_);
         return false;
     }
 
-    if (!working_) {
-        error_ = "stream is not started";
+    uint32_t pix_format = fmt == WebcamFormat::kFmtNone ? format_
+                                                         : FormatFourcc(fmt);
+    uint64_t begin = NowUs();
+
+    std::unique_ptr<CaptureThreadOptions> capture_options;
+    if (capture_ && capture_->running) {
+        capture_options.reset(new CaptureThreadOptions(capture_->options));
+        StopCaptureThread();
+    }
+
+    StreamOff();
+    FreeBuffers();
+    working_ = false;
+
+    // what S_FMT grants is checked below, no TRY_FMT round trip
+    struct v4l2_format v4l2_fmt;
+    InitFormat(pix_format, width, height, v4l2_fmt);
+    if (io_->Ioctl(cam_fd_, VIDIOC_S_FMT, &v4l2_fmt) == -1) {
+        error_ = fmt::format("switch pixel format failure, {}", FormatErrno());
         logger_->error(error_);
         return false;
     }
 
-    if (!buf_stat_) {
-        error_ = "v4l2 buffers are not ready";
+    if (FmtFourcc(v4l2_fmt) != pix_format) {
+        error_ = fmt::format("format {} is not supported, run as {}",
+                             PixFormatName(pix_format),
+                             PixFormatName(FmtFourcc(v4l2_fmt)));
         logger_->error(error_);
         return false;
     }
+    ApplyFormat(v4l2_fmt);
 
-    struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+    // S_FMT may reset the frame interval
+    if (fps) {
+        SetFps(fps);
+    }
 
-    if (ioctl(cam_fd_, VIDIOC_DQBUF, &buf) == -1) {
-        logger_->error("retrieve VIDIOC_DQBUF failure, {}", FormatErrno());
+    if (!SetBuffers()) {
         return false;
     }
 
-    if (!discard) {
-        frame_cb_((const char *)buf_stat_->buffer[buf.index].start,
-                  buf.bytesused);
+    working_ = StreamOn();
+    if (!working_) {
+        FreeBuffers();
+        return false;
     }
 
-    if (ioctl(cam_fd_, VIDIOC_QBUF, &buf) == -1) {
-        logger_->error("retrieve VIDIOC_QBUF failure, {}", FormatErrno());
-        return false;
+    // the first frames after a switch are often dark or half exposed
+    for (uint32_t i = 0; i < warmup; ++i) {
+        DiscardSink sink;
+        if (!CaptureFrame(sink, true, timeout)) {
+            error_ = fmt::format("warm-up frame failure, {}", GetError());
+            logger_->error(error_);
+            StreamOff();
+            FreeBuffers();
+            working_ = false;
+            return false;
+        }
+    }
+
+    usage_ = BufferUsage();
+    metrics_.Reset();
+    frame_meta_ = FrameMeta();
+
+    if (capture_options) {
+        StartCaptureThread(*capture_options);
     }
 
+    switch_gap_us_ = NowUs() - begin;
+    logger_->info("switch to {} {}x{} in {:.1f} ms, {} warm-up frames",
+                  PixFormatName(format_), FmtWidth(v4l2_fmt),
+                  FmtHeight(v4l2_fmt), switch_gap_us_ / 1000.0, warmup);
     return true;
 }
 
-bool WebcamV4l2::Retrieve(std::string &img) {
+bool WebcamV4l2::Pause() {
     if (!working_) {
         error_ = "stream is not started";
         logger_->error(error_);
         return false;
     }
 
-    if (!buf_stat_) {
-        error_ = "v4l2 buffers are not ready";
-        logger_->error(error_);
-        return false;
+    std::unique_ptr<CaptureThreadOptions> capture_options;
+    if (capture_ && capture_->running) {
+        capture_options.reset(new CaptureThreadOptions(capture_->options));
     }
+    StopCaptureThread();
 
-    struct v4l2_buffer buf;
-    memset(&buf, 0, sizeof(buf));
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-
-    if (ioctl(cam_fd_, VIDIOC_DQBUF, &buf) == -1) {
-        logger_->error("retrieve VIDIOC_DQBUF failure, {}", FormatErrno());
+    if (!StreamOff()) {
         return false;
     }
+    paused_capture_ = std::move(capture_options);
 
-    img.assign((char *)buf_stat_->buffer[buf.index].start, buf.bytesused);
-
-    if (ioctl(cam_fd_, VIDIOC_QBUF, &buf) == -1) {
-        logger_->error("retrieve VIDIOC_QBUF failure, {}", FormatErrno());
-        return false;
+    // STREAMOFF took every buffer back from the driver and the consumer,
+    // outstanding leases must not requeue them
+    if (leases_ > 0) {
+        logger_->warn("pause with {} frame leases outstanding", leases_);
+    }
+    leases_ = 0;
+    ++generation_;
+    for (int i = 0; i < buf_stat_->count; ++i) {
+        buf_stat_->buffer[i].dequeued_us = 0;
     }
 
+    working_ = false;
+    paused_ = true;
+    resume_begin_us_ = 0;
+    logger_->info("pause working");
     return true;
 }
 
-bool WebcamV4l2::Retrieve(std::string *img) {
-    if (img) {
-        return Retrieve(*img);
-    } else { // discard frame quickly
-        if (!working_) {
-            error_ = "stream is not started";
-            logger_->error(error_);
-            return false;
-        }
+bool WebcamV4l2::Resume() {
+    if (!paused_) {
+        error_ = "stream is not paused";
+        logger_->error(error_);
+        return false;
+    }
 
-        if (!buf_stat_) {
-            error_ = "v4l2 buffers are not ready";
-            logger_->error(error_);
-            return false;
-        }
+    uint64_t begin = NowUs();
 
+    for (int i = 0; i < buf_stat_->count; ++i) {
         struct v4l2_buffer buf;
         memset(&buf, 0, sizeof(buf));
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-
-        if (ioctl(cam_fd_, VIDIOC_DQBUF, &buf) == -1) {
-            logger_->error("retrieve VIDIOC_DQBUF failure, {}", FormatErrno());
-            return false;
-        }
+        buf.index = i;
+        PrepareBuffer(buf_stat_.get(), i, buf);
 
-        if (ioctl(cam_fd_, VIDIOC_QBUF, &buf) == -1) {
-            logger_->error("retrieve VIDIOC_QBUF failure, {}", FormatErrno());
+        if (!QueueBuffer(buf)) {
+            error_ = fmt::format("requeue buffer {} failure, {}", i,
+                                 FormatErrno());
+            logger_->error(error_);
+            // STREAMOFF takes back the buffers already queued, still paused
+            std::string error = error_;
+            StreamOff();
+            error_ = error;
             return false;
         }
-
-        return true;
-    }
-}
-
-bool WebcamV4l2::Start() {
-    if (working_) {
-        return true;
     }
 
-    if (!SetMMap()) {
+    if (!StreamOn()) {
+        std::string error = error_;
+        StreamOff();
+        error_ = error;
         return false;
     }
 
-    working_ = StreamOn();
-    logger_->info("start working {}", working_);
-    return working_;
-}
-
-bool WebcamV4l2::Stop() {
-    if (!working_) {
-        return false;
-    }
+    // sequence numbers restart with the stream on most drivers
+    usage_ = BufferUsage();
+    metrics_.Reset();
+    frame_meta_ = FrameMeta();
+    working_ = true;
+    paused_ = false;
 
-    StreamOff();
+    uint64_t elapsed = NowUs() - begin;
+    ++resume_stats_.resumes;
+    resume_stats_.last_resume_us = elapsed;
+    resume_stats_.max_resume_us =
+        std::max(resume_stats_.max_resume_us, elapsed);
+    resume_stats_.total_resume_us += elapsed;
+    resume_begin_us_ = begin;
 
-    FreeMMap();
+    logger_->info("resume working in {} us", elapsed);
 
-    working_ = false;
-    logger_->info("stop working");
+    if (paused_capture_) {
+        std::unique_ptr<CaptureThreadOptions> capture_options =
+            std::move(paused_capture_);
+        return StartCaptureThread(*capture_options);
+    }
     return true;
 }
 
@@ -0,0 +1,115 @@
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+
+// Control reads of V4l2FakeDevice with and without V4L2_EVENT_CTRL. With
+// events the values are kept current by ProcessEvents and read from the
+// cache, without they cost a VIDIOC_G_CTRL each. A change from outside the
+// camera is checked to reach the cache and the control callbacks, and a
+// batch with one bad value to change nothing and name the bad control.
+//
+// usage: bench_controls [reads]
+
+using namespace noevil::webcam;
+
+static double ReadNs(WebcamV4l2 &cam, int reads) {
+    int32_t value = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < reads; ++i) {
+        cam.GetControl(V4L2_CID_BRIGHTNESS, value);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() /
+           reads;
+}
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    int reads = argc > 1 ? atoi(argv[1]) : 100000;
+
+    auto polled_dev = std::make_shared<V4l2FakeDevice>();
+    WebcamV4l2 polled("/dev/video-fake");
+    polled.SetIo(polled_dev);
+
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetControlEvents(true);
+    WebcamV4l2 cam("/dev/video-fake");
+    cam.SetIo(dev);
+
+    if (!polled.Open() || !cam.Open()) {
+        std::cout << "open failure, " << polled.GetError() << cam.GetError()
+                  << std::endl;
+        return 1;
+    }
+
+    uint32_t last_id = 0;
+    int64_t last_value = 0;
+    uint32_t last_changes = 0;
+    cam.AddControlCallback(
+        [&](uint32_t id, int64_t value, uint32_t changes) {
+            last_id = id;
+            last_value = value;
+            last_changes = changes;
+        });
+    cam.ProcessEvents();
+
+    double polled_ns = ReadNs(polled, reads);
+    double cached_ns = ReadNs(cam, reads);
+    printf("read     ioctl %6.1f ns, cached %6.1f ns\n", polled_ns, cached_ns);
+
+    // another application turns the brightness up
+    dev->ChangeControl(V4L2_CID_BRIGHTNESS, 33);
+    int events = cam.ProcessEvents();
+
+    uint32_t ioctls = dev->control_ioctls();
+    int32_t value = 0;
+    bool read = cam.GetControl(V4L2_CID_BRIGHTNESS, value);
+    bool cached = cam.IsControlCached(V4L2_CID_BRIGHTNESS) &&
+                  dev->control_ioctls() == ioctls;
+    bool called = last_id == V4L2_CID_BRIGHTNESS && last_value == 33 &&
+                  (last_changes & V4L2_EVENT_CTRL_CH_VALUE);
+    printf("change   %d events, read %d %s, callback %s\n", events, value,
+           cached ? "from the cache" : "by ioctl",
+           called ? "called" : "not called");
+
+    // gain is out of range, none of the three may be applied
+    ControlBatch batch;
+    batch.Set(V4L2_CID_BRIGHTNESS, 10)
+        .Set(V4L2_CID_GAIN, 500)
+        .Set(V4L2_CID_CONTRAST, 60);
+    ioctls = polled_dev->control_ioctls();
+    bool rejected = !polled.SetControls(batch);
+    int bad = batch.error_index();
+    rejected = rejected && bad == 1 && polled_dev->control_ioctls() == ioctls;
+    ControlBatch current;
+    current.Get(V4L2_CID_BRIGHTNESS)
+        .Get(V4L2_CID_GAIN)
+        .Get(V4L2_CID_CONTRAST);
+    bool untouched = polled.GetControls(current) && current.value(0) == 0 &&
+                     current.value(1) == 0 && current.value(2) == 50;
+
+    batch.Clear();
+    batch.Set(V4L2_CID_BRIGHTNESS, 10)
+        .Set(V4L2_CID_GAIN, 50)
+        .Set(V4L2_CID_CONTRAST, 60);
+    bool applied = polled.SetControls(batch) && batch.error_index() == -1 &&
+                   polled.GetControls(current) && current.value(0) == 10 &&
+                   current.value(1) == 50 && current.value(2) == 60;
+    printf("batch    bad value %s at %d, %s, good batch %s\n",
+           rejected ? "rejected" : "accepted", bad,
+           untouched ? "nothing applied" : "partly applied",
+           applied ? "applied" : "failure");
+
+    return !polled.IsControlCached(V4L2_CID_BRIGHTNESS) && events == 1 &&
+                   read && value == 33 && cached && called && rejected &&
+                   untouched && applied
+               ? 0
+               : 1;
+}
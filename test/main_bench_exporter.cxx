@@ -0,0 +1,234 @@
+#include "device_monitor.h"
+#include "metrics_exporter.h"
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Prometheus exporter on loopback. A fleet of V4l2FakeDevice cameras, nodes
+// in a temporary directory watched by DeviceMonitor, streams a while and one
+// camera is replugged. A client then scrapes /metrics over TCP, while the
+// exporter serves from the camera thread, and the textfile is written too.
+//
+// usage: bench_exporter [cameras] [scrapes]
+
+using namespace noevil::webcam;
+
+// one HTTP/1.1 request, the whole response
+static std::string Fetch(uint16_t port, const char *path) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    std::string response;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        std::string request = std::string("GET ") + path +
+                              " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            response.append(buf, n);
+        }
+    }
+    close(fd);
+    return response;
+}
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    int count = argc > 1 ? atoi(argv[1]) : 4;
+    int scrapes = argc > 2 ? atoi(argv[2]) : 200;
+
+    char dir[] = "/tmp/webcam-exporter-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    std::vector<std::shared_ptr<V4l2FakeDevice>> devs;
+    std::vector<std::unique_ptr<WebcamV4l2>> cams;
+    std::vector<std::string> nodes;
+    DeviceMonitor monitor(dir);
+    MetricsExporter exporter;
+    exporter.SetMonitor(&monitor);
+
+    int ret = 1;
+    do {
+        bool ready = true;
+        for (int i = 0; i < count && ready; ++i) {
+            nodes.push_back(fmt::format("{}/video{}", dir, i));
+            auto dev = std::make_shared<V4l2FakeDevice>();
+            dev->SetBusInfo(fmt::format("usb-0000:00:14.0-{}", i + 1));
+            dev->SetModes({{V4L2_PIX_FMT_YUYV, 640, 480, 30}});
+            dev->SetNode(nodes.back());
+
+            std::unique_ptr<WebcamV4l2> cam(
+                new WebcamV4l2(nodes.back().data()));
+            cam->SetIo(dev);
+            ready = cam->Open() && cam->Init() &&
+                    cam->SetPixFormat(WebcamFormat::kFmtYUYV, 640, 480) &&
+                    cam->Start() && monitor.Add(cam.get()) &&
+                    exporter.Add(cam.get());
+            if (!ready) {
+                std::cout << "prepare failure, " << cam->GetError() << " "
+                          << monitor.GetError() << " " << exporter.GetError()
+                          << std::endl;
+            }
+            devs.push_back(dev);
+            cams.push_back(std::move(cam));
+        }
+        if (!ready) {
+            break;
+        }
+
+        // replug the first camera once
+        devs[0]->Unplug();
+        while (monitor.IsConnected(cams[0].get()) && monitor.Poll(100) >= 0) {
+        }
+        devs[0]->Replug();
+        while (!monitor.IsConnected(cams[0].get()) && monitor.Poll(100) >= 0) {
+        }
+
+        FrameLease lease;
+        for (int f = 0; f < 300; ++f) {
+            for (int i = 0; i < count; ++i) {
+                devs[i]->Produce();
+                cams[i]->Grab(lease, 100);
+                lease.Release();
+            }
+        }
+
+        if (!exporter.Listen("127.0.0.1", 0)) {
+            std::cout << exporter.GetError() << std::endl;
+            break;
+        }
+
+        std::atomic<bool> done(false);
+        std::string first, missing;
+        int bad = 0;
+        double total_us = 0;
+        std::thread client([&] {
+            missing = Fetch(exporter.port(), "/nothing");
+            for (int i = 0; i < scrapes; ++i) {
+                auto begin = std::chrono::steady_clock::now();
+                std::string response = Fetch(exporter.port(), "/metrics");
+                auto end = std::chrono::steady_clock::now();
+                total_us += std::chrono::duration<double, std::micro>(
+                                end - begin)
+                                .count();
+                if (response.compare(0, 15, "HTTP/1.1 200 OK")) {
+                    ++bad;
+                }
+                if (first.empty()) {
+                    first = response;
+                }
+            }
+            done = true;
+        });
+        while (!done && exporter.Poll(100) >= 0) {
+        }
+        client.join();
+
+        // a client trickling its request holds the camera thread no longer
+        // than the deadline of one request
+        std::thread slow([&] {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(exporter.port());
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+                const char request[] = "GET /metrics HTTP/1.1\r\n\r\n";
+                for (size_t i = 0; i + 1 < sizeof(request); ++i) {
+                    if (send(fd, request + i, 1, MSG_NOSIGNAL) != 1) {
+                        break;
+                    }
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(50));
+                }
+            }
+            close(fd);
+        });
+        auto slow_begin = std::chrono::steady_clock::now();
+        exporter.Poll(1000);
+        double slow_ms = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - slow_begin)
+                             .count();
+        slow.join();
+
+        auto begin = std::chrono::steady_clock::now();
+        std::string text = exporter.Render();
+        auto end = std::chrono::steady_clock::now();
+
+        std::string prom = std::string(dir) + "/webcam.prom";
+        bool written = exporter.WriteTextfile(prom);
+        FILE *fp = fopen(prom.data(), "r");
+        long size = 0;
+        if (fp) {
+            fseek(fp, 0, SEEK_END);
+            size = ftell(fp);
+            fclose(fp);
+        }
+        unlink(prom.data());
+
+        // the replugged camera, labelled by its node and bus
+        std::string reconnected = fmt::format(
+            "webcam_reconnects_total{{device=\"{}\",bus_info=\"{}\"}} 1\n",
+            nodes[0], "usb-0000:00:14.0-1");
+        bool labelled = text.find(reconnected) != std::string::npos;
+        bool not_found = !missing.compare(0, 12, "HTTP/1.1 404");
+
+        size_t body = first.find("\r\n\r\n");
+        printf("%d cameras, %zu bytes of metrics, render %.1f us\n", count,
+               text.size(), std::chrono::duration<double, std::micro>(
+                                end - begin)
+                                .count());
+        printf("%d scrapes, %d bad, %.1f us each on loopback, 404 %s\n",
+               scrapes, bad, scrapes ? total_us / scrapes : 0,
+               not_found ? "ok" : "missing");
+        printf("trickling client held poll %.1f ms\n", slow_ms);
+        printf("textfile %s, %ld bytes, reconnect %s\n",
+               written ? "written" : exporter.GetError().data(), size,
+               labelled ? "labelled" : "missing");
+        if (body != std::string::npos) {
+            // a taste of the exposition
+            std::string head = first.substr(body + 4, 600);
+            printf("%s...\n", head.data());
+        }
+
+        ret = !bad && not_found && written && labelled && slow_ms < 400 &&
+                      size == (long)text.size()
+                  ? 0
+                  : 1;
+    } while (0);
+
+    for (auto &cam : cams) {
+        cam->Stop();
+    }
+    for (auto &node : nodes) {
+        unlink(node.data());
+    }
+    rmdir(dir);
+    return ret;
+}
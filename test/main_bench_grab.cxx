@@ -0,0 +1,101 @@
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Per frame overhead of every public grab and retrieve path on small GREY
+// frames of V4l2FakeDevice, so the copy hardly counts. Each frame costs one
+// Produce of the fake device as well, which is the same for all paths. Then
+// a grab in latest-frame mode with four frames ready has to deliver the
+// newest one and skip the other three.
+//
+// usage: bench_grab [frames]
+
+using namespace noevil::webcam;
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    int frames = argc > 1 ? atoi(argv[1]) : 200000;
+
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetModes({{V4L2_PIX_FMT_GREY, 64, 48, 30}});
+
+    WebcamV4l2 cam("/dev/video-fake");
+    cam.SetIo(dev);
+    if (!cam.Open() || !cam.Init() ||
+        !cam.SetPixFormat(WebcamFormat::kFmtGREY, 64, 48) || !cam.Start()) {
+        std::cout << "prepare failure, " << cam.GetError() << std::endl;
+        return 1;
+    }
+
+    uint64_t bytes = 0;
+    cam.SetFrameCallback(
+        [&](const char *const, uint32_t size) { bytes += size; });
+
+    std::string img;
+    FrameLease lease;
+    struct Path {
+        const char *name;
+        std::function<bool()> grab;
+    };
+    std::vector<Path> paths = {
+        {"Grab(string&)", [&] { return cam.Grab(img, 100); }},
+        {"Grab(nullptr)", [&] { return cam.Grab(nullptr, 100); }},
+        {"Grab()", [&] { return cam.Grab(100); }},
+        {"Grab(lease)", [&] { return cam.Grab(lease, 100); }},
+        {"Retrieve(string&)", [&] { return cam.Retrieve(img); }},
+        {"Retrieve(nullptr)",
+         [&] { return cam.Retrieve((std::string *)nullptr); }},
+        {"Retrieve()", [&] { return cam.Retrieve(); }},
+        {"Retrieve(lease)", [&] { return cam.Retrieve(lease); }},
+    };
+
+    printf("%-20s %10s %10s\n", "path", "frames", "ns/frame");
+    int failed = 0;
+    for (auto &path : paths) {
+        int ok = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < frames; ++i) {
+            dev->Produce();
+            ok += path.grab();
+        }
+        auto end = std::chrono::steady_clock::now();
+        lease.Release();
+
+        if (ok != frames) {
+            ++failed;
+        }
+        printf("%-20s %10d %10.1f\n", path.name, ok,
+               std::chrono::duration<double, std::nano>(end - begin).count() /
+                   frames);
+    }
+
+    // the newest of four, the older three requeued and not grabbed later
+    dev->Produce();
+    uint32_t sequence = cam.Grab(lease, 100) ? lease.sequence() : 0;
+    lease.Release();
+    cam.SetLatestFrameOnly(true);
+    dev->Produce(4);
+    bool latest = cam.Grab(lease, 100) && lease.sequence() == sequence + 4 &&
+                  cam.last_skipped() == 3;
+    lease.Release();
+    latest = latest && !cam.Grab(lease, 0);
+    cam.SetLatestFrameOnly(false);
+    printf("latest frame only %s, skipped %u\n", latest ? "ok" : "failure",
+           cam.last_skipped());
+    if (!latest) {
+        ++failed;
+    }
+
+    cam.Stop();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,109 @@
+#include "capture_group.h"
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Frame set matching of CaptureGroup over fake cameras with a fixed offset
+// and random jitter on their timestamps. Every round each device produces
+// one frame, the last camera misses one frame in 50 so the others have to
+// drop theirs. Prints the matched sets and the skew of every camera.
+//
+// usage: bench_group [rounds] [cameras]
+
+using namespace noevil::webcam;
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    int rounds = argc > 1 ? atoi(argv[1]) : 500;
+    int n = argc > 2 ? atoi(argv[2]) : 3;
+
+    // one round per millisecond, jitter and offset well below that
+    CaptureGroupOptions options;
+    options.tolerance_us = 400;
+    CaptureGroup group(options);
+
+    std::vector<std::shared_ptr<V4l2FakeDevice>> devs;
+    std::vector<std::unique_ptr<WebcamV4l2>> cams;
+    for (int i = 0; i < n; ++i) {
+        auto dev = std::make_shared<V4l2FakeDevice>();
+        dev->SetModes({{V4L2_PIX_FMT_YUYV, 320, 240, 30}});
+        dev->SetTimestampSkew(i * 50, i * 60, i + 1);
+
+        std::unique_ptr<WebcamV4l2> cam(
+            new WebcamV4l2(("/dev/video-fake" + std::to_string(i)).data()));
+        cam->SetIo(dev);
+        if (!cam->Open() || !cam->Init() ||
+            !cam->SetPixFormat(WebcamFormat::kFmtYUYV, 320, 240) ||
+            !group.Add(cam.get())) {
+            std::cout << "prepare camera " << i << " failure, "
+                      << cam->GetError() << group.GetError() << std::endl;
+            return 1;
+        }
+
+        devs.push_back(dev);
+        cams.push_back(std::move(cam));
+    }
+
+    uint64_t bad_sets = 0;
+    group.SetHandler([&](std::vector<FrameLease> &set) {
+        // the fake devices stamp the sequence, which differs per camera
+        // once one misses a frame, so check the timestamps instead
+        uint64_t first = set[0].meta().timestamp_us;
+        for (auto &lease : set) {
+            uint64_t ts = lease.meta().timestamp_us;
+            if ((ts > first ? ts - first : first - ts) >
+                options.tolerance_us) {
+                ++bad_sets;
+            }
+        }
+    });
+
+    if (!group.Start()) {
+        std::cout << "start failure, " << group.GetError() << std::endl;
+        return 1;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+        for (int i = 0; i < n; ++i) {
+            if (i == n - 1 && r % 50 == 49) {
+                continue;
+            }
+            devs[i]->Produce();
+        }
+
+        while (group.Poll(0) > 0) {
+        }
+        std::this_thread::sleep_until(begin +
+                                      std::chrono::milliseconds(r + 1));
+    }
+    while (group.Poll(10) > 0) {
+    }
+
+    auto stats = group.GetStats();
+    group.Stop();
+
+    printf("rounds %d, sets %lu, max spread %lu us, out of tolerance %lu\n",
+           rounds, (unsigned long)stats.sets,
+           (unsigned long)stats.max_spread_us, (unsigned long)bad_sets);
+    printf("%8s %8s %8s %8s %10s %10s %10s\n", "camera", "frames", "matched",
+           "dropped", "mean us", "min us", "max us");
+    for (size_t i = 0; i < stats.cameras.size(); ++i) {
+        auto &c = stats.cameras[i];
+        printf("%8zu %8lu %8lu %8lu %10ld %10ld %10ld\n", i,
+               (unsigned long)c.frames, (unsigned long)c.matched,
+               (unsigned long)c.dropped, (long)c.mean_skew_us(),
+               (long)c.min_skew_us, (long)c.max_skew_us);
+    }
+
+    return bad_sets ? 1 : 0;
+}
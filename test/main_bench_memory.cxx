@@ -0,0 +1,225 @@
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Compare copy counts and throughput of the capture memory modes:
+//   mmap + copy     Grab(std::string &), one copy per frame
+//   mmap + lease    Grab(FrameLease &), no copy
+//   userptr + lease the driver fills caller buffers, no copy
+//   mplane + lease  NV12M from a multi-planar device, planes in place
+// Runs against V4l2FakeDevice unless a device path is given, the mplane
+// mode only runs against the fake. On the fake, dmabuf export is checked as
+// well, on a driver with VIDIOC_EXPBUF and on one without.
+//
+// usage: bench_memory [/dev/videoX] [frames]
+
+using namespace noevil::webcam;
+
+struct BenchResult {
+    const char *name;
+    uint64_t frames = 0;
+    uint64_t copies = 0;
+    uint64_t copied_bytes = 0;
+    uint64_t frame_bytes = 0;
+    double seconds = 0;
+};
+
+// read one byte per page, as a consumer would touch the frame
+static uint32_t Touch(const char *data, uint32_t size) {
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < size; i += 4096) {
+        sum += (uint8_t)data[i];
+    }
+    return sum;
+}
+
+static bool Prepare(WebcamV4l2 &cam,
+                    WebcamFormat fmt = WebcamFormat::kFmtYUYV) {
+    if (!cam.Open() || !cam.Init() || !cam.SetPixFormat(fmt, 1280, 720)) {
+        std::cout << "prepare failure, " << cam.GetError() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// one frame with dmabuf export asked for, the buffers are exported and the
+// lease carries a live fd if the driver has EXPBUF, else export is off and
+// the fd -1
+static bool CheckDmaBuf(WebcamV4l2 &cam, V4l2FakeDevice &dev, bool supported) {
+    dev.SetExportSupported(supported);
+    cam.SetDmaBufExport(true);
+    FrameLease lease;
+    bool grabbed = false;
+    if (cam.Start()) {
+        dev.Produce();
+        grabbed = cam.Grab(lease, 1000);
+    }
+    bool exported = cam.IsDmaBufExported();
+    int fd = lease.dmabuf_fd();
+    bool ok = grabbed && exported == supported &&
+              (supported ? fd >= 0 && fcntl(fd, F_GETFD) != -1 : fd == -1);
+    printf("dmabuf %-13s exported %s, fd %d, %s\n",
+           supported ? "EXPBUF" : "without EXPBUF", exported ? "yes" : "no",
+           fd, ok ? "ok" : "failure");
+    lease.Release();
+    cam.Stop();
+    cam.SetDmaBufExport(false);
+    dev.SetExportSupported(true);
+    return ok;
+}
+
+template <typename GrabFn>
+static bool Run(WebcamV4l2 &cam, V4l2FakeDevice *dev, int frames,
+                BenchResult &result, GrabFn grab) {
+    if (!cam.Start()) {
+        std::cout << result.name << " start failure, " << cam.GetError()
+                  << std::endl;
+        return false;
+    }
+
+    uint32_t sum = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        if (dev) {
+            dev->Produce();
+        }
+        uint32_t size = 0;
+        if (grab(size, sum)) {
+            ++result.frames;
+            result.frame_bytes += size;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    result.seconds = std::chrono::duration<double>(end - begin).count();
+
+    cam.Stop();
+
+    // keep the checksum alive
+    if (sum == 0xFFFFFFFF) {
+        std::cout << sum << std::endl;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    const char *dev_name = argc > 1 ? argv[1] : nullptr;
+    int frames = argc > 2 ? atoi(argv[2]) : 2000;
+
+    std::shared_ptr<V4l2FakeDevice> dev;
+    WebcamV4l2 cam(dev_name ? dev_name : "/dev/video-fake");
+    if (!dev_name) {
+        dev = std::make_shared<V4l2FakeDevice>();
+        cam.SetIo(dev);
+    }
+
+    if (!Prepare(cam)) {
+        return 1;
+    }
+
+    std::vector<BenchResult> results(dev ? 4 : 3);
+    results[0].name = "mmap + copy";
+    results[1].name = "mmap + lease";
+    results[2].name = "userptr + lease";
+
+    std::string frm;
+    Run(cam, dev.get(), frames, results[0],
+        [&](uint32_t &size, uint32_t &sum) {
+            if (!cam.Grab(frm, 1000)) {
+                return false;
+            }
+            ++results[0].copies;
+            results[0].copied_bytes += frm.size();
+            size = frm.size();
+            sum += Touch(frm.data(), size);
+            return true;
+        });
+
+    FrameLease lease;
+    auto grab_lease = [&](uint32_t &size, uint32_t &sum) {
+        if (!cam.Grab(lease, 1000)) {
+            return false;
+        }
+        size = lease.bytesused();
+        sum += Touch(lease.data(), size);
+        lease.Release();
+        return true;
+    };
+
+    Run(cam, dev.get(), frames, results[1], grab_lease);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint32_t length =
+        (cam.sizeimage() + page_size - 1) / page_size * page_size;
+    std::vector<UserBuffer> pool;
+    for (int i = 0; i < 5; ++i) {
+        void *start = nullptr;
+        if (posix_memalign(&start, page_size, length)) {
+            std::cout << "allocate user buffer failure" << std::endl;
+            return 1;
+        }
+        pool.push_back({start, length});
+    }
+
+    cam.SetUserBuffers(pool);
+    Run(cam, dev.get(), frames, results[2], grab_lease);
+    cam.SetUserBuffers({});
+
+    for (auto &unit : pool) {
+        free(unit.start);
+    }
+
+    if (dev) {
+        results[3].name = "mplane + lease";
+
+        auto mplane_dev = std::make_shared<V4l2FakeDevice>();
+        mplane_dev->SetMultiPlanar(true);
+        mplane_dev->SetModes({{V4L2_PIX_FMT_NV12M, 1280, 720, 30}});
+
+        WebcamV4l2 mplane_cam("/dev/video-fake-mplane");
+        mplane_cam.SetIo(mplane_dev);
+        if (!Prepare(mplane_cam, WebcamFormat::kFmtNV12M)) {
+            return 1;
+        }
+
+        FrameLease planes;
+        Run(mplane_cam, mplane_dev.get(), frames, results[3],
+            [&](uint32_t &size, uint32_t &sum) {
+                if (!mplane_cam.Grab(planes, 1000)) {
+                    return false;
+                }
+                for (uint32_t p = 0; p < planes.num_planes(); ++p) {
+                    auto &plane = planes.plane(p);
+                    size += plane.bytesused;
+                    sum += Touch(plane.data, plane.bytesused);
+                }
+                planes.Release();
+                return true;
+            });
+    }
+
+    bool dmabuf = !dev || (CheckDmaBuf(cam, *dev, true) &&
+                           CheckDmaBuf(cam, *dev, false));
+
+    printf("%-16s %8s %8s %12s %10s %10s\n", "mode", "frames", "copies",
+           "copied MB", "fps", "MB/s");
+    for (auto &r : results) {
+        printf("%-16s %8lu %8lu %12.1f %10.0f %10.1f\n", r.name,
+               (unsigned long)r.frames, (unsigned long)r.copies,
+               r.copied_bytes / 1e6, r.frames / r.seconds,
+               r.frame_bytes / 1e6 / r.seconds);
+    }
+
+    return dmabuf ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Mode negotiation against the mode table of a typical UVC camera with raw
+// YUYV, MJPEG and H.264, or a real device if given. Prints the mode chosen
+// for a few constraint sets and why, and checks the device runs it. On the
+// fake, QueryModes has to list the table as advertised, and a second table
+// with formats the size estimates do not know checks those are not taken
+// for free.
+//
+// usage: bench_negotiate [/dev/videoX]
+
+using namespace noevil::webcam;
+
+struct Case {
+    const char *name;
+    ModeConstraints constraints;
+};
+
+static Case MakeCase(const char *name, uint32_t width, uint32_t height,
+                     uint32_t fps, ModeGoal goal, ModePreference preference) {
+    Case c;
+    c.name = name;
+    c.constraints.min_width = width;
+    c.constraints.min_height = height;
+    c.constraints.min_fps = fps;
+    c.constraints.goal = goal;
+    c.constraints.preference = preference;
+    return c;
+}
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    const char *dev_name = argc > 1 ? argv[1] : nullptr;
+
+    std::vector<V4l2FakeMode> table = {{V4L2_PIX_FMT_YUYV, 640, 480, 30},
+                                       {V4L2_PIX_FMT_YUYV, 1280, 720, 10},
+                                       {V4L2_PIX_FMT_YUYV, 1920, 1080, 5},
+                                       {V4L2_PIX_FMT_MJPEG, 640, 480, 60},
+                                       {V4L2_PIX_FMT_MJPEG, 1280, 720, 60},
+                                       {V4L2_PIX_FMT_MJPEG, 1920, 1080, 30},
+                                       {V4L2_PIX_FMT_H264, 1920, 1080, 30}};
+    std::shared_ptr<V4l2FakeDevice> dev;
+    if (!dev_name) {
+        dev = std::make_shared<V4l2FakeDevice>();
+        dev->SetModes(table);
+    }
+
+    WebcamV4l2 cam(dev_name ? dev_name : "/dev/video-fake");
+    cam.SetIo(dev);
+    if (!cam.Open() || !cam.Init()) {
+        std::cout << "open failure, " << cam.GetError() << std::endl;
+        return 1;
+    }
+
+    int failed = 0;
+
+    // the fake advertises fps and half of it for every size
+    std::vector<WebcamMode> modes;
+    if (!cam.QueryModes(modes)) {
+        std::cout << "query modes failure, " << cam.GetError() << std::endl;
+        return 1;
+    }
+    if (dev) {
+        bool listed = modes.size() == table.size();
+        for (size_t i = 0; listed && i < table.size(); ++i) {
+            auto &m = modes[i];
+            auto &t = table[i];
+            listed = m.fourcc == t.fourcc && m.width == t.width &&
+                     m.height == t.height && !m.stepwise &&
+                     m.intervals.size() == 2 &&
+                     m.intervals[0].numerator == 1 &&
+                     m.intervals[0].denominator == t.fps &&
+                     m.intervals[1].numerator == 1 &&
+                     m.intervals[1].denominator == t.fps / 2;
+        }
+        printf("%-14s %zu modes %s\n", "query modes", modes.size(),
+               listed ? "as advertised" : "differ from the fake's table");
+        if (!listed) {
+            ++failed;
+        }
+    }
+
+    std::vector<Case> cases = {
+        MakeCase("throughput", 0, 0, 0, ModeGoal::kThroughput,
+                 ModePreference::kAny),
+        MakeCase("raw 720p", 1280, 720, 0, ModeGoal::kThroughput,
+                 ModePreference::kRaw),
+        MakeCase("raw 720p 30", 1280, 720, 30, ModeGoal::kThroughput,
+                 ModePreference::kRaw),
+        MakeCase("latency vga", 640, 480, 0, ModeGoal::kLatency,
+                 ModePreference::kAny),
+        MakeCase("latency 1080p", 1920, 1080, 0, ModeGoal::kLatency,
+                 ModePreference::kCompressed),
+        MakeCase("1080p 60", 1920, 1080, 60, ModeGoal::kThroughput,
+                 ModePreference::kAny),
+    };
+
+    for (auto &c : cases) {
+        NegotiatedMode mode;
+        auto begin = std::chrono::steady_clock::now();
+        bool ok = cam.NegotiateMode(c.constraints, mode);
+        auto end = std::chrono::steady_clock::now();
+        double us =
+            std::chrono::duration<double, std::micro>(end - begin).count();
+        if (!ok) {
+            printf("%-14s %8.1f us  none, %s\n", c.name, us,
+                   cam.GetError().data());
+            continue;
+        }
+
+        // the device runs what was reported
+        WebcamSnapshot snapshot;
+        if (!cam.TakeSnapshot(snapshot) || snapshot.fourcc != mode.fourcc ||
+            snapshot.width != mode.width || snapshot.height != mode.height) {
+            ++failed;
+        }
+        printf("%-14s %8.1f us  %s\n", c.name, us, mode.rationale.data());
+    }
+
+    if (failed) {
+        std::cout << failed << " modes not applied" << std::endl;
+    }
+
+    // UYVY has no known layout and JPEG is compressed, on a bus too narrow
+    // for raw 2 bytes per pixel only JPEG fits
+    if (dev) {
+        cam.Close();
+        // another camera, the mode cache is keyed by the bus
+        dev->SetBusInfo("usb-fake-2");
+        dev->SetModes({{V4L2_PIX_FMT_UYVY, 640, 480, 30},
+                       {V4L2_PIX_FMT_YUYV, 640, 480, 30},
+                       {V4L2_PIX_FMT_JPEG, 640, 480, 30}});
+        Case c = MakeCase("unknown raw", 640, 480, 30, ModeGoal::kLatency,
+                          ModePreference::kAny);
+        c.constraints.bus_bandwidth = 640 * 480 * 2 * 30 - 1;
+        NegotiatedMode mode;
+        bool negotiated = cam.Open() && cam.Init() &&
+                          cam.NegotiateMode(c.constraints, mode);
+        printf("%-14s %s\n", c.name,
+               negotiated ? mode.rationale.data() : cam.GetError().data());
+        if (!negotiated || mode.fourcc != V4L2_PIX_FMT_JPEG) {
+            std::cout << "unknown raw format taken over JPEG" << std::endl;
+            ++failed;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+#include "capture_reactor.h"
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+// Scalability of CaptureReactor over 1 to 64 fake cameras. Every round
+// each device produces one frame, then the reactor polls until all of them
+// are dispatched. The time per frame includes producing it.
+//
+// usage: bench_reactor [rounds]
+
+using namespace noevil::webcam;
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    int rounds = argc > 1 ? atoi(argv[1]) : 2000;
+
+    printf("%8s %10s %12s %12s %10s\n", "cameras", "frames", "frames/s",
+           "ns/frame", "polls");
+
+    for (int n = 1; n <= 64; n *= 2) {
+        std::vector<std::shared_ptr<V4l2FakeDevice>> devs;
+        std::vector<std::unique_ptr<WebcamV4l2>> cams;
+        CaptureReactor reactor;
+
+        uint64_t frames = 0;
+        for (int i = 0; i < n; ++i) {
+            auto dev = std::make_shared<V4l2FakeDevice>();
+            dev->SetModes({{V4L2_PIX_FMT_YUYV, 320, 240, 30}});
+
+            std::unique_ptr<WebcamV4l2> cam(
+                new WebcamV4l2(("/dev/video-fake" + std::to_string(i)).data()));
+            cam->SetIo(dev);
+            if (!cam->Open() || !cam->Init() ||
+                !cam->SetPixFormat(WebcamFormat::kFmtYUYV, 320, 240) ||
+                !cam->Start()) {
+                std::cout << "prepare camera " << i << " failure, "
+                          << cam->GetError() << std::endl;
+                return 1;
+            }
+
+            reactor.Add(cam.get(),
+                        [&](WebcamV4l2 &, FrameLease &) { ++frames; });
+
+            devs.push_back(dev);
+            cams.push_back(std::move(cam));
+        }
+
+        uint64_t polls = 0;
+        uint64_t expected = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (int r = 0; r < rounds; ++r) {
+            for (auto &dev : devs) {
+                dev->Produce();
+            }
+            expected += n;
+            while (frames < expected) {
+                if (reactor.Poll(1000) <= 0) {
+                    std::cout << "poll failure, " << reactor.GetError()
+                              << std::endl;
+                    return 1;
+                }
+                ++polls;
+            }
+        }
+        auto end = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(end - begin).count();
+
+        printf("%8d %10lu %12.0f %12.0f %10lu\n", n, (unsigned long)frames,
+               frames / seconds, seconds * 1e9 / frames,
+               (unsigned long)polls);
+
+        for (auto &cam : cams) {
+            reactor.Remove(cam.get());
+            cam->Stop();
+        }
+    }
+
+    return 0;
+}
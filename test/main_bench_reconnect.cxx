@@ -0,0 +1,138 @@
+#include "device_monitor.h"
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Recovery from simulated USB resets. A V4l2FakeDevice stands in for the
+// camera and a plain file in a temporary directory for its node, which
+// DeviceMonitor watches. Every cycle unplugs the device, replugs it reset to
+// its defaults, every other time under another node name, and checks that
+// format, fps and controls are back and frames flow again. Controls changed
+// after Add, by the camera and from outside, are kept current by control
+// events and must come back as well. A node of some other device shows up
+// while the camera is away, it is no failed attempt.
+//
+// usage: bench_reconnect [cycles]
+
+using namespace noevil::webcam;
+
+static bool SameSetup(const WebcamSnapshot &a, const WebcamSnapshot &b) {
+    return a.fourcc == b.fourcc && a.width == b.width &&
+           a.height == b.height &&
+           a.timeperframe.numerator == b.timeperframe.numerator &&
+           a.timeperframe.denominator == b.timeperframe.denominator &&
+           a.controls == b.controls;
+}
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    int cycles = argc > 1 ? atoi(argv[1]) : 100;
+
+    char dir[] = "/tmp/webcam-reconnect-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string nodes[] = {std::string(dir) + "/video0",
+                           std::string(dir) + "/video1"};
+    std::string stray = std::string(dir) + "/video9";
+
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetNode(nodes[0]);
+    dev->SetControlEvents(true);
+
+    int ret = 1;
+    do {
+        WebcamV4l2 cam(nodes[0].data());
+        cam.SetIo(dev);
+        if (!cam.Open() || !cam.Init() ||
+            !cam.SetPixFormat(WebcamFormat::kFmtYUYV, 1280, 720) ||
+            !cam.SetControl(V4L2_CID_BRIGHTNESS, 20) ||
+            !cam.SetControl(V4L2_CID_GAIN, 40)) {
+            std::cout << "prepare failure, " << cam.GetError() << std::endl;
+            break;
+        }
+        cam.SetFps(10);
+        if (!cam.Start()) {
+            std::cout << "start failure, " << cam.GetError() << std::endl;
+            break;
+        }
+
+        DeviceMonitor monitor(dir);
+        if (!monitor.Add(&cam)) {
+            std::cout << "monitor failure, " << monitor.GetError()
+                      << std::endl;
+            break;
+        }
+
+        int removed = 0;
+        int restored = 0;
+        monitor.SetHandler([&](WebcamV4l2 &, bool connected) {
+            ++(connected ? restored : removed);
+        });
+
+        FrameLease lease;
+        int bad = 0;
+        for (int i = 0; i < cycles; ++i) {
+            WebcamSnapshot before;
+            cam.SetControl(V4L2_CID_BRIGHTNESS, i % 64);
+            dev->ChangeControl(V4L2_CID_GAIN, i % 100);
+            cam.ProcessEvents();
+            cam.TakeSnapshot(before);
+
+            dev->Unplug();
+            if (cam.Grab(lease, 10)) {
+                ++bad;
+            }
+            while (monitor.IsConnected(&cam) && monitor.Poll(100) >= 0) {
+            }
+
+            close(open(stray.data(), O_WRONLY | O_CREAT, 0660));
+            monitor.Poll(0);
+            unlink(stray.data());
+
+            dev->SetNode(nodes[(i + 1) % 2]);
+            dev->Replug();
+            while (!monitor.IsConnected(&cam) && monitor.Poll(100) >= 0) {
+            }
+
+            WebcamSnapshot after;
+            dev->Produce();
+            if (!cam.Grab(lease, 1000) || !cam.TakeSnapshot(after) ||
+                !SameSetup(before, after)) {
+                std::cout << "cycle " << i << " not restored, "
+                          << cam.GetError() << std::endl;
+                ++bad;
+            }
+            lease.Release();
+        }
+
+        auto stats = monitor.GetStats(&cam);
+        printf("cycles %d, removals %u, reconnects %u, failures %u, "
+               "handler %d/%d\n",
+               cycles, stats.removals, stats.reconnects, stats.failures,
+               removed, restored);
+        printf("recovery %lu us avg, %lu us max, last on %s\n",
+               (unsigned long)stats.mean_recovery_us(),
+               (unsigned long)stats.max_recovery_us, cam.dev_name().data());
+
+        cam.Stop();
+        ret = bad || stats.failures ? 1 : 0;
+    } while (0);
+
+    for (auto &node : nodes) {
+        unlink(node.data());
+    }
+    rmdir(dir);
+    return ret;
+}
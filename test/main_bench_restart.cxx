@@ -0,0 +1,198 @@
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Cold start against a warm start from a serialized snapshot. The cold
+// start runs Open, Init, SetPixFormat, SetFps and Start, the warm one only
+// RestoreFrom and Start. Then Stop/Start cycles against Pause/Resume cycles,
+// which keep the buffers mapped, and a pause of the capture thread, which
+// must deliver frames again after the resume. On the fake, a mode switch
+// whose warm-up frames never come must leave the stream stopped, and the
+// adaptive buffer count must grow after a session with drops and shrink
+// after a quiet one. Runs against V4l2FakeDevice, which answers every
+// enumeration after a delay like slow UVC cameras, unless a device path is
+// given.
+//
+// usage: bench_restart [/dev/videoX] [enum delay us]
+
+using namespace noevil::webcam;
+
+// Buffers granted on three starts of a fresh device from 3 buffers, adapted
+// in between: after the first session 5 frames were dropped while the
+// application was away, the second one is quiet.
+static std::vector<uint32_t> AdaptedCounts() {
+    std::vector<uint32_t> counts;
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetModes({{V4L2_PIX_FMT_GREY, 64, 48, 30}});
+
+    WebcamV4l2 cam("/dev/video-fake");
+    cam.SetIo(dev);
+    if (!cam.Open() || !cam.Init() ||
+        !cam.SetPixFormat(WebcamFormat::kFmtGREY, 64, 48) ||
+        !cam.SetBufferCount(3)) {
+        std::cout << "adapt failure, " << cam.GetError() << std::endl;
+        return counts;
+    }
+    cam.SetAdaptiveBufferCount(true, 2, 16);
+
+    std::string frame;
+    for (int session = 0; session < 3 && cam.Start(); ++session) {
+        counts.push_back(cam.buffer_count());
+        // 8 frames into 3 buffers while nobody grabs, the gap shows on the
+        // frame after
+        int away = session == 0 ? 8 : 0;
+        for (int i = 0; i < away; ++i) {
+            dev->Produce();
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        while (cam.Grab(frame, 0)) {
+        }
+        for (int i = 0; i < 5; ++i) {
+            dev->Produce();
+            cam.Grab(frame, 100);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        cam.Stop();
+    }
+    return counts;
+}
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    const char *dev_name = argc > 1 && argv[1][0] ? argv[1] : nullptr;
+    uint32_t delay = argc > 2 ? atoi(argv[2]) : 20000;
+
+    std::shared_ptr<V4l2FakeDevice> dev;
+    if (!dev_name) {
+        dev = std::make_shared<V4l2FakeDevice>();
+        dev->SetEnumDelay(delay);
+    }
+
+    std::string text;
+    {
+        WebcamV4l2 cam(dev_name ? dev_name : "/dev/video-fake");
+        cam.SetIo(dev);
+        if (!cam.Open() || !cam.Init() ||
+            !cam.SetPixFormat(WebcamFormat::kFmtYUYV, 640, 480)) {
+            std::cout << "cold start failure, " << cam.GetError() << std::endl;
+            return 1;
+        }
+        cam.SetFps(30);
+        if (!cam.Start()) {
+            std::cout << "cold start failure, " << cam.GetError() << std::endl;
+            return 1;
+        }
+
+        WebcamSnapshot snapshot;
+        if (!cam.TakeSnapshot(snapshot)) {
+            std::cout << "snapshot failure, " << cam.GetError() << std::endl;
+            return 1;
+        }
+        text = snapshot.Serialize();
+        printf("cold start %8lu us\n", (unsigned long)cam.setup_us());
+    }
+
+    WebcamSnapshot snapshot;
+    if (!snapshot.Parse(text)) {
+        std::cout << "parse snapshot failure" << std::endl;
+        return 1;
+    }
+
+    WebcamV4l2 cam(dev_name ? dev_name : "/dev/video-fake");
+    cam.SetIo(dev);
+    if (!cam.RestoreFrom(snapshot) || !cam.Start()) {
+        std::cout << "warm start failure, " << cam.GetError() << std::endl;
+        return 1;
+    }
+    printf("warm start %8lu us, %ld us saved\n", (unsigned long)cam.setup_us(),
+           (long)cam.setup_saved_us());
+
+    std::cout << text;
+
+    const int cycles = 200;
+    FrameLease lease;
+    auto cycle = [&](bool pause) {
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < cycles; ++i) {
+            if (pause ? !cam.Pause() || !cam.Resume()
+                      : !cam.Stop() || !cam.Start()) {
+                std::cout << "cycle failure, " << cam.GetError() << std::endl;
+                return false;
+            }
+            if (dev) {
+                dev->Produce();
+            }
+            cam.Grab(lease, 1000);
+            lease.Release();
+        }
+        auto end = std::chrono::steady_clock::now();
+        printf("%-14s %8.1f us per cycle\n",
+               pause ? "pause/resume" : "stop/start",
+               std::chrono::duration<double, std::micro>(end - begin).count() /
+                   cycles);
+        return true;
+    };
+
+    if (!cycle(false) || !cycle(true)) {
+        return 1;
+    }
+
+    auto &stats = cam.resume_stats();
+    printf("resumes %u, resume %lu us avg %lu us max, first frame %lu us max\n",
+           stats.resumes,
+           (unsigned long)(stats.total_resume_us / stats.resumes),
+           (unsigned long)stats.max_resume_us,
+           (unsigned long)stats.max_first_frame_us);
+
+    // the capture thread is stopped by the pause and back after the resume
+    bool popped = false;
+    if (cam.StartCaptureThread() && cam.Pause() && cam.Resume()) {
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (!popped && std::chrono::steady_clock::now() < deadline) {
+            if (dev) {
+                dev->Produce();
+            }
+            popped = cam.PopFrame(lease);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        lease.Release();
+    }
+    printf("capture thread after resume %s\n",
+           popped ? "ok" : cam.GetError().data());
+
+    // nothing is produced, the warm-up times out
+    bool switch_stopped = true;
+    if (dev) {
+        switch_stopped =
+            !cam.SwitchMode(WebcamFormat::kFmtYUYV, 320, 240, 0, 1, 10) &&
+            !cam.IsWorking() && cam.Start();
+        printf("failed switch %s\n",
+               switch_stopped ? "left the stream stopped" : "kept streaming");
+    }
+
+    bool adapted = true;
+    if (dev) {
+        std::vector<uint32_t> counts = AdaptedCounts();
+        adapted = counts == std::vector<uint32_t>{3, 5, 4};
+        printf("buffer count %u, after drops %u, after a quiet session %u, "
+               "%s\n",
+               counts.size() > 0 ? counts[0] : 0,
+               counts.size() > 1 ? counts[1] : 0,
+               counts.size() > 2 ? counts[2] : 0,
+               adapted ? "ok" : "failure");
+    }
+
+    cam.Stop();
+    return popped && switch_stopped && adapted ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Cost of the per frame stream metrics, and StreamStats of a capture thread
+// stream of V4l2FakeDevice read by another thread all along. The fake stamps
+// frames 2 ms early with +-300 us jitter, which the latency and jitter show.
+// Then a capture thread with a ring of 2 and nobody popping, under each ring
+// full policy, is checked to keep the frames the policy promises.
+//
+// usage: bench_stats [frames]
+
+using namespace noevil::webcam;
+
+static void PrintSummary(const char *name, const LatencySummary &s) {
+    printf("%-8s %8lu samples, mean %6lu, p50 %6lu, p99 %6lu, p999 %6lu, "
+           "max %6lu us\n",
+           name, (unsigned long)s.count, (unsigned long)s.mean_us,
+           (unsigned long)s.p50_us, (unsigned long)s.p99_us,
+           (unsigned long)s.p999_us, (unsigned long)s.max_us);
+}
+
+// 8 frames of a fresh device into a ring of 2 out of 5 buffers, then pop
+// until it runs dry, the sequences popped
+static std::vector<uint32_t> Overflow(RingFullPolicy policy) {
+    std::vector<uint32_t> sequences;
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetModes({{V4L2_PIX_FMT_GREY, 64, 48, 30}});
+
+    WebcamV4l2 cam("/dev/video-fake");
+    cam.SetIo(dev);
+    CaptureThreadOptions options;
+    options.capacity = 2;
+    options.policy = policy;
+    if (!cam.Open() || !cam.Init() ||
+        !cam.SetPixFormat(WebcamFormat::kFmtGREY, 64, 48) ||
+        !cam.SetBufferCount(5) || !cam.Start() ||
+        !cam.StartCaptureThread(options)) {
+        std::cout << "overflow failure, " << cam.GetError() << std::endl;
+        return sequences;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        dev->Produce();
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    // a blocked thread dequeues the frames waiting in the driver meanwhile
+    FrameLease lease;
+    auto idle = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - idle <
+           std::chrono::milliseconds(50)) {
+        if (cam.PopFrame(lease)) {
+            sequences.push_back(lease.sequence());
+            lease.Release();
+            idle = std::chrono::steady_clock::now();
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    cam.StopCaptureThread();
+    cam.Stop();
+    return sequences;
+}
+
+int main(int argc, char **argv) {
+    noevil::util::Init("/tmp/webcam_bench.log");
+    noevil::util::SetLevel(spdlog::level::warn);
+
+    int frames = argc > 1 ? atoi(argv[1]) : 2000;
+
+    // what the dequeuing thread pays per frame
+    {
+        const int updates = 10000000;
+        StreamMetrics metrics;
+        uint64_t ts = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < updates; ++i) {
+            ts += 33333 + (i & 63);
+            metrics.OnFrame(ts, 3072, 0, false);
+            metrics.wait.Record(i & 1023);
+            metrics.hold.Record(i & 4095);
+            metrics.latency.Record(2000 + (i & 511));
+        }
+        auto end = std::chrono::steady_clock::now();
+        printf("update   %8.1f ns/frame, %lu frames counted\n",
+               std::chrono::duration<double, std::nano>(end - begin).count() /
+                   updates,
+               (unsigned long)metrics.Snapshot().frames);
+    }
+
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetModes({{V4L2_PIX_FMT_GREY, 64, 48, 30}});
+    dev->SetTimestampSkew(-2000, 300);
+
+    WebcamV4l2 cam("/dev/video-fake");
+    cam.SetIo(dev);
+    if (!cam.Open() || !cam.Init() ||
+        !cam.SetPixFormat(WebcamFormat::kFmtGREY, 64, 48) || !cam.Start() ||
+        !cam.StartCaptureThread(CaptureThreadOptions())) {
+        std::cout << "prepare failure, " << cam.GetError() << std::endl;
+        return 1;
+    }
+
+    std::atomic<bool> done(false);
+    uint64_t snapshots = 0;
+    uint64_t seen = 0;
+    double snapshot_ns = 0;
+    std::thread reader([&] {
+        while (!done.load(std::memory_order_relaxed)) {
+            auto begin = std::chrono::steady_clock::now();
+            StreamStats stats = cam.GetStreamStats();
+            auto end = std::chrono::steady_clock::now();
+            snapshot_ns +=
+                std::chrono::duration<double, std::nano>(end - begin).count();
+            seen = stats.frames;
+            ++snapshots;
+        }
+    });
+
+    uint64_t consumed = 0;
+    std::thread consumer([&] {
+        FrameLease lease;
+        while (!done.load(std::memory_order_relaxed)) {
+            if (cam.PopFrame(lease)) {
+                ++consumed;
+                lease.Release();
+            } else {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+    });
+
+    for (int i = 0; i < frames; ++i) {
+        dev->Produce();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    done = true;
+    reader.join();
+    consumer.join();
+    cam.StopCaptureThread();
+
+    StreamStats stats = cam.GetStreamStats();
+    cam.Stop();
+
+    printf("stream   %8lu frames, %lu consumed, %.1f fps, jitter %lu us, "
+           "dropped %lu, errors %lu\n",
+           (unsigned long)stats.frames, (unsigned long)consumed, stats.fps,
+           (unsigned long)stats.jitter_us, (unsigned long)stats.dropped,
+           (unsigned long)stats.errors);
+    printf("payload  %8lu bytes, %.0f bytes/s, %lu buffers out\n",
+           (unsigned long)stats.bytes, stats.bytes_per_second,
+           (unsigned long)stats.buffers_out);
+    PrintSummary("wait", stats.wait);
+    PrintSummary("hold", stats.hold);
+    PrintSummary("latency", stats.latency);
+    printf("snapshot %8lu taken while streaming, %.0f ns each, the last saw "
+           "%lu frames\n",
+           (unsigned long)snapshots, snapshots ? snapshot_ns / snapshots : 0,
+           (unsigned long)seen);
+
+    // the newest two, the first two, or every frame the driver held
+    struct {
+        const char *name;
+        RingFullPolicy policy;
+        std::vector<uint32_t> want;
+    } overflows[] = {
+        {"drop oldest", RingFullPolicy::kDropOldest, {6, 7}},
+        {"drop newest", RingFullPolicy::kDropNewest, {0, 1}},
+        {"block", RingFullPolicy::kBlock, {0, 1, 2, 3, 4}},
+    };
+    bool kept = true;
+    for (auto &o : overflows) {
+        std::vector<uint32_t> got = Overflow(o.policy);
+        std::string seqs;
+        for (auto seq : got) {
+            seqs += " " + std::to_string(seq);
+        }
+        printf("overflow %-11s kept%s, %s\n", o.name, seqs.data(),
+               got == o.want ? "ok" : "failure");
+        kept = kept && got == o.want;
+    }
+
+    return stats.frames && stats.latency.count && stats.hold.count && kept
+               ? 0
+               : 1;
+}
@@ -0,0 +1,90 @@
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Grab loop cost under a timeout storm: a started V4l2FakeDevice never
+// produces, so every Grab times out on the error path. Logging runs at the
+// trace level of the test programs, to a synchronous or an async sink. Heap
+// allocations of the whole process are counted during the storm.
+//
+// usage: bench_timeout [sync|async] [grabs]
+
+using namespace noevil::webcam;
+
+static std::atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size) {
+    ++allocations;
+    if (void *p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+
+static long FileSize(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (long)st.st_size : 0;
+}
+
+int main(int argc, char **argv) {
+    bool async = argc > 1 && strcmp(argv[1], "async") == 0;
+    int grabs = argc > 2 ? atoi(argv[2]) : 100000;
+
+    // fresh, so its size counts what this run logged
+    const char *log_path = "/tmp/webcam_bench_timeout.log";
+    unlink(log_path);
+    noevil::util::Init(log_path, 1024 * 1024 * 10, 10, async);
+    noevil::util::SetLevel(spdlog::level::trace);
+
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetModes({{V4L2_PIX_FMT_GREY, 64, 48, 30}});
+
+    WebcamV4l2 cam("/dev/video-fake");
+    cam.SetIo(dev);
+    if (!cam.Open() || !cam.Init() ||
+        !cam.SetPixFormat(WebcamFormat::kFmtGREY, 64, 48) || !cam.Start()) {
+        std::cout << "prepare failure, " << cam.GetError() << std::endl;
+        return 1;
+    }
+
+    std::string img;
+    int failed = 0;
+    uint64_t allocated = allocations;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < grabs; ++i) {
+        failed += !cam.Grab(img, 0) &&
+                  cam.GetCaptureError() == CaptureError::kTimeout;
+    }
+    auto end = std::chrono::steady_clock::now();
+    allocated = allocations - allocated;
+
+    // a frame still comes through after the storm
+    dev->Produce();
+    bool recovered = cam.Grab(img, 100);
+    cam.Stop();
+    // drains the async queue
+    spdlog::shutdown();
+
+    printf("%-6s %8d timeouts %8.1f ns/grab %8.3f allocs/grab %8ld log "
+           "bytes%s\n",
+           async ? "async" : "sync", failed,
+           std::chrono::duration<double, std::nano>(end - begin).count() /
+               grabs,
+           (double)allocated / grabs, FileSize(log_path),
+           recovered ? "" : ", no recovery");
+    return failed == grabs && recovered ? 0 : 1;
+}
@@ -0,0 +1,143 @@
+#include "trace.h"
+#include "v4l2_fake_device.h"
+#include "webcam_v4l2.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+// Pipeline tracing. The cost of a TraceScope off and on, then V4l2FakeDevice
+// frames grabbed with tracing off and on, each followed by a stage of the
+// caller tagged by the thread frame. The trace is dumped and checked: begin
+// and end pair up, the frames are tagged, and a small ring keeps the newest
+// events only.
+//
+// usage: bench_trace [frames] [trace.json]
+
+using namespace noevil::webcam;
+namespace util = noevil::util;
+
+static size_t Count(const std::string &text, const std::string &what) {
+    size_t n = 0;
+    for (size_t pos = text.find(what); pos != std::string::npos;
+         pos = text.find(what, pos + what.size())) {
+        ++n;
+    }
+    return n;
+}
+
+static double ScopeNs(int scopes) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < scopes; ++i) {
+        util::TraceScope trace("empty", i);
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - begin).count() /
+           scopes;
+}
+
+static double GrabUs(WebcamV4l2 &cam, V4l2FakeDevice &dev, int frames,
+                     int &grabbed) {
+    std::string frame;
+    grabbed = 0;
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < frames; ++i) {
+        dev.Produce();
+        if (cam.Grab(frame, 100)) {
+            // tagged with the frame just grabbed
+            util::TraceScope trace("process");
+            ++grabbed;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - begin).count() /
+           frames;
+}
+
+int main(int argc, char **argv) {
+    util::Init("/tmp/webcam_bench.log");
+    util::SetLevel(spdlog::level::warn);
+
+    int frames = argc > 1 ? atoi(argv[1]) : 2000;
+    std::string path = argc > 2 ? argv[2] : "/tmp/webcam_bench_trace.json";
+
+    const int scopes = 1000000;
+    double off_ns = ScopeNs(scopes);
+    util::EnableTrace(true);
+    double on_ns = ScopeNs(scopes);
+    util::EnableTrace(false);
+    util::ClearTrace();
+    printf("scope    off %6.1f ns, on %6.1f ns\n", off_ns, on_ns);
+
+    auto dev = std::make_shared<V4l2FakeDevice>();
+    dev->SetModes({{V4L2_PIX_FMT_YUYV, 640, 480, 30}});
+
+    WebcamV4l2 cam("/dev/video-fake");
+    cam.SetIo(dev);
+    if (!cam.Open() || !cam.Init() ||
+        !cam.SetPixFormat(WebcamFormat::kFmtYUYV, 640, 480) || !cam.Start()) {
+        std::cout << "prepare failure, " << cam.GetError() << std::endl;
+        return 1;
+    }
+
+    int grabbed_off, grabbed_on;
+    double off_us = GrabUs(cam, *dev, frames, grabbed_off);
+    util::EnableTrace(true);
+    util::SetTraceThreadName("bench");
+    double on_us = GrabUs(cam, *dev, frames, grabbed_on);
+    util::EnableTrace(false);
+    cam.Stop();
+    printf("grab     off %6.1f us, on %6.1f us, %d and %d frames\n", off_us,
+           on_us, grabbed_off, grabbed_on);
+
+    // a thread of its own with a ring of 64, which wraps
+    util::EnableTrace(true, 64);
+    std::thread([] {
+        util::SetTraceThreadName("wrapped");
+        for (int i = 0; i < 1000; ++i) {
+            util::TraceScope trace("wrap", i);
+        }
+    }).join();
+    util::EnableTrace(false);
+
+    bool dumped = util::DumpTrace(path);
+    std::string json = util::TraceJson();
+
+    size_t begins = Count(json, "\"ph\":\"B\"");
+    size_t ends = Count(json, "\"ph\":\"E\"");
+    // every stage of a grab, twice each
+    bool stages = true;
+    for (const char *stage : {"\"grab\"", "\"poll\"", "\"VIDIOC_DQBUF\"",
+                              "\"copy\"", "\"VIDIOC_QBUF\"", "\"process\""}) {
+        stages = stages && Count(json, stage) == 2u * grabbed_on;
+    }
+    // the last frame dequeued, the fake counts from 0
+    size_t at = json.rfind("\"name\":\"process\",\"ph\":\"E\"");
+    std::string frame = fmt::format("\"args\":{{\"frame\":{}}}",
+                                    grabbed_off + grabbed_on - 1);
+    bool tagged = at != std::string::npos &&
+                  json.find(frame, at) < json.find('}', at) + 1;
+    size_t wraps = Count(json, "\"wrap\"");
+
+    util::ClearTrace();
+    bool cleared = Count(util::TraceJson(), "\"ph\":\"B\"") == 0;
+    unlink(path.data());
+
+    printf("trace    %zu bytes, %zu begin, %zu end, %zu of 2000 wrapped "
+           "events kept\n",
+           json.size(), begins, ends, wraps);
+    printf("dump %s, stages %s, frames %s, clear %s\n",
+           dumped ? "ok" : "failure", stages ? "ok" : "missing",
+           tagged ? "tagged" : "untagged", cleared ? "ok" : "failure");
+
+    return dumped && grabbed_on == frames && begins == ends && stages &&
+                   tagged && wraps == 64 && cleared
+               ? 0
+               : 1;
+}
@@ -1,4 +1,5 @@
 #include "jpeg_transform.h"
+#include "trace.h"
 #include "webcam_v4l2.h"
 #include <iostream>
 #include <string>
@@ -6,6 +7,7 @@
 using namespace noevil::webcam;
 
 bool WriteFile(const std::string &path, const std::string &content) {
+    noevil::util::TraceScope trace("write file");
     int fd = open(path.data(), O_RDWR | O_CREAT, 00664);
     if (fd == -1) {
         throw std::runtime_error(
@@ -23,6 +25,12 @@ int main(int argc, char **argv) {
     noevil::util::Init("cam.log");
     noevil::util::SetLevel(spdlog::level::trace);
 
+    // usage: cap <device> [trace.json]
+    if (argc > 2) {
+        noevil::util::EnableTrace(true);
+        noevil::util::SetTraceThreadName("main");
+    }
+
     noevil::webcam::WebcamV4l2 cam(argv[1]);
     if (!cam.Open()) {
         return 1;
@@ -59,5 +67,8 @@ int main(int argc, char **argv) {
 
     cam.Stop();
 
+    if (argc > 2 && !noevil::util::DumpTrace(argv[2])) {
+        std::cout << "dump trace to " << argv[2] << " failure" << std::endl;
+    }
     return 0;
 }